@@ -0,0 +1,397 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+// Local store of past results, to catch regressions that stay above the
+// ratio asserts. One JSON file holds the raw samples of every measurement,
+// per host, CPU model, ISA and suite; several binaries share it, each replacing
+// only its own suite. A later run on the same machine compares its samples
+// against the stored ones with a one-sided Mann-Whitney U test, which makes
+// no assumption about the shape of the timing distribution.
+
+namespace benchmark {
+namespace baseline {
+
+// Just enough JSON for the baseline file. Numbers keep their source text, so
+// params written as JSON read back to the same key
+struct Json {
+    enum Kind { Null, Bool, Number, String, Array, Object };
+
+    Kind kind = Null;
+    // Bool, Number and String content
+    std::string text;
+    std::vector<Json> items;
+    std::vector<std::pair<std::string, Json>> fields;
+
+    const Json* find(const std::string& key) const
+    {
+        for (const auto& field : fields) {
+            if (field.first == key) {
+                return &field.second;
+            }
+        }
+        return nullptr;
+    }
+
+    std::string string(const std::string& key) const
+    {
+        const Json* value = find(key);
+        return value != nullptr && value->kind == String ? value->text : "";
+    }
+};
+
+class JsonParser
+{
+public:
+    explicit JsonParser(std::string text) : text_(std::move(text)) {}
+
+    // False on malformed input, the value is then partial
+    bool parse(Json& value)
+    {
+        return parse_value(value) && (skip_space(), pos_ == text_.size());
+    }
+
+private:
+    void skip_space()
+    {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            ++pos_;
+        }
+    }
+
+    bool consume(char c)
+    {
+        skip_space();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_string(std::string& result)
+    {
+        if (!consume('"')) {
+            return false;
+        }
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            if (text_[pos_] == '\\' && pos_ + 1 < text_.size()) {
+                ++pos_;
+            }
+            result += text_[pos_++];
+        }
+        return consume('"');
+    }
+
+    bool parse_value(Json& value)
+    {
+        skip_space();
+        if (pos_ == text_.size()) {
+            return false;
+        }
+        char c = text_[pos_];
+        if (c == '"') {
+            value.kind = Json::String;
+            return parse_string(value.text);
+        }
+        if (c == '[') {
+            ++pos_;
+            value.kind = Json::Array;
+            if (consume(']')) {
+                return true;
+            }
+            do {
+                value.items.emplace_back();
+                if (!parse_value(value.items.back())) {
+                    return false;
+                }
+            } while (consume(','));
+            return consume(']');
+        }
+        if (c == '{') {
+            ++pos_;
+            value.kind = Json::Object;
+            if (consume('}')) {
+                return true;
+            }
+            do {
+                value.fields.emplace_back();
+                if (!parse_string(value.fields.back().first) || !consume(':') ||
+                    !parse_value(value.fields.back().second)) {
+                    return false;
+                }
+            } while (consume(','));
+            return consume('}');
+        }
+        size_t start = pos_;
+        while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) ||
+                                       text_[pos_] == '-' || text_[pos_] == '+' || text_[pos_] == '.')) {
+            ++pos_;
+        }
+        value.text = text_.substr(start, pos_ - start);
+        if (value.text == "null") {
+            value.kind = Json::Null;
+        } else if (value.text == "true" || value.text == "false") {
+            value.kind = Json::Bool;
+        } else {
+            value.kind = Json::Number;
+        }
+        return !value.text.empty();
+    }
+
+    std::string text_;
+    size_t pos_ = 0;
+};
+
+inline std::string escape(const std::string& text)
+{
+    std::string result;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+inline void write_json(std::ostream& out, const Json& value)
+{
+    switch (value.kind) {
+    case Json::Null:
+        out << "null";
+        break;
+    case Json::Bool:
+    case Json::Number:
+        out << value.text;
+        break;
+    case Json::String:
+        out << '"' << escape(value.text) << '"';
+        break;
+    case Json::Array:
+        out << '[';
+        for (size_t i = 0; i < value.items.size(); ++i) {
+            out << (i ? ", " : "");
+            write_json(out, value.items[i]);
+        }
+        out << ']';
+        break;
+    case Json::Object:
+        out << '{';
+        for (size_t i = 0; i < value.fields.size(); ++i) {
+            out << (i ? ", " : "") << '"' << escape(value.fields[i].first) << "\": ";
+            write_json(out, value.fields[i].second);
+        }
+        out << '}';
+        break;
+    }
+}
+
+// Results of one binary on one machine can only be compared with results of
+// the same binary on the same machine, running the same kernel variants
+struct Machine {
+    std::string host;
+    std::string cpu;
+    // Set by the caller, see cpu_dispatch.h
+    std::string isa;
+
+    static Machine current()
+    {
+        Machine machine;
+        char host[256] = {};
+        if (gethostname(host, sizeof(host) - 1) == 0) {
+            machine.host = host;
+        }
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos) {
+                machine.cpu = line.substr(line.find(':') + 1);
+                machine.cpu.erase(0, machine.cpu.find_first_not_of(' '));
+                break;
+            }
+        }
+        return machine;
+    }
+};
+
+// Samples of one measurement, in ns per operation. Key is the name and the
+// params, plus "#2", "#3" for the repeats of the same measurement in a run
+struct Entry {
+    std::string key;
+    std::vector<double> samples;
+};
+
+// Probability of samples at least this much slower than baseline if both
+// came from the same distribution: one-sided Mann-Whitney U, normal
+// approximation with continuity and tie correction
+inline double slower_p_value(const std::vector<double>& baseline, const std::vector<double>& samples)
+{
+    double n1 = baseline.size(), n2 = samples.size();
+    if (n1 == 0 || n2 == 0) {
+        return 1;
+    }
+    std::vector<std::pair<double, int>> all;
+    for (double value : baseline) {
+        all.emplace_back(value, 0);
+    }
+    for (double value : samples) {
+        all.emplace_back(value, 1);
+    }
+    std::sort(all.begin(), all.end());
+    // Rank sum of the new samples, ties get their average rank
+    double rank_sum = 0, ties = 0;
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) {
+            ++j;
+        }
+        double tied = double(j - i);
+        ties += tied * tied * tied - tied;
+        for (size_t k = i; k < j; ++k) {
+            if (all[k].second == 1) {
+                rank_sum += (i + j + 1) / 2.0;
+            }
+        }
+        i = j;
+    }
+    double u = rank_sum - n2 * (n2 + 1) / 2;
+    double n = n1 + n2;
+    double variance = n1 * n2 / 12 * (n + 1 - ties / (n * (n - 1)));
+    if (variance <= 0) {
+        return 1;
+    }
+    double z = (u - n1 * n2 / 2 - 0.5) / std::sqrt(variance);
+    return std::erfc(z / std::sqrt(2.0)) / 2;
+}
+
+// The baseline file: {"baselines": [{"host", "cpu", "isa", "suite", "results":
+// [{"name", "params", "key", "samples"}]}]}
+class Store
+{
+public:
+    // Missing or malformed file is an empty store
+    bool load(const std::string& path)
+    {
+        std::ifstream in(path);
+        if (!in) {
+            return false;
+        }
+        std::stringstream text;
+        text << in.rdbuf();
+        Json json;
+        JsonParser parser(text.str());
+        if (!parser.parse(json) || json.kind != Json::Object) {
+            return false;
+        }
+        const Json* baselines = json.find("baselines");
+        if (baselines == nullptr || baselines->kind != Json::Array) {
+            return false;
+        }
+        root_ = std::move(json);
+        return true;
+    }
+
+    bool save(const std::string& path) const
+    {
+        std::ofstream out(path);
+        const Json* baselines = root_.find("baselines");
+        out << "{\"baselines\": [";
+        for (size_t i = 0; baselines != nullptr && i < baselines->items.size(); ++i) {
+            const Json& suite = baselines->items[i];
+            out << (i ? ",\n" : "\n") << " {\"host\": \"" << escape(suite.string("host"))
+                << "\", \"cpu\": \"" << escape(suite.string("cpu")) << "\", \"isa\": \""
+                << escape(suite.string("isa")) << "\", \"suite\": \""
+                << escape(suite.string("suite")) << "\", \"results\": [";
+            const Json* results = suite.find("results");
+            for (size_t j = 0; results != nullptr && j < results->items.size(); ++j) {
+                out << (j ? ",\n  " : "\n  ");
+                write_json(out, results->items[j]);
+            }
+            out << "\n ]}";
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+
+    // Samples of suite on machine, empty if never recorded there
+    std::vector<Entry> entries(const Machine& machine, const std::string& suite) const
+    {
+        std::vector<Entry> result;
+        const Json* found = find(machine, suite);
+        const Json* results = found != nullptr ? found->find("results") : nullptr;
+        if (results == nullptr) {
+            return result;
+        }
+        for (const Json& item : results->items) {
+            Entry entry{item.string("key"), {}};
+            if (const Json* samples = item.find("samples")) {
+                for (const Json& sample : samples->items) {
+                    entry.samples.push_back(std::strtod(sample.text.c_str(), nullptr));
+                }
+            }
+            result.push_back(std::move(entry));
+        }
+        return result;
+    }
+
+    // Replaces whatever suite had on machine. results are the JSON objects
+    // of the measurements, with the key and samples fields set
+    void replace(const Machine& machine, const std::string& suite, std::vector<Json> results)
+    {
+        Json* baselines = nullptr;
+        for (auto& field : root_.fields) {
+            if (field.first == "baselines") {
+                baselines = &field.second;
+            }
+        }
+        if (baselines == nullptr) {
+            root_.kind = Json::Object;
+            root_.fields.emplace_back("baselines", Json{Json::Array, "", {}, {}});
+            baselines = &root_.fields.back().second;
+        }
+        auto& items = baselines->items;
+        items.erase(std::remove_if(items.begin(), items.end(), [&] (const Json& item) {
+            return item.string("host") == machine.host && item.string("cpu") == machine.cpu &&
+                   item.string("isa") == machine.isa && item.string("suite") == suite;
+        }), items.end());
+        Json entry{Json::Object, "", {}, {}};
+        entry.fields.emplace_back("host", Json{Json::String, machine.host, {}, {}});
+        entry.fields.emplace_back("cpu", Json{Json::String, machine.cpu, {}, {}});
+        entry.fields.emplace_back("isa", Json{Json::String, machine.isa, {}, {}});
+        entry.fields.emplace_back("suite", Json{Json::String, suite, {}, {}});
+        entry.fields.emplace_back("results", Json{Json::Array, "", std::move(results), {}});
+        items.push_back(std::move(entry));
+    }
+
+private:
+    const Json* find(const Machine& machine, const std::string& suite) const
+    {
+        const Json* baselines = root_.find("baselines");
+        if (baselines == nullptr) {
+            return nullptr;
+        }
+        for (const Json& item : baselines->items) {
+            if (item.string("host") == machine.host && item.string("cpu") == machine.cpu &&
+                item.string("isa") == machine.isa && item.string("suite") == suite) {
+                return &item;
+            }
+        }
+        return nullptr;
+    }
+
+    Json root_;
+};
+
+}  // namespace baseline
+}  // namespace benchmark
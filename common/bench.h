@@ -0,0 +1,582 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "baseline.h"
+#include "cpu_dispatch.h"
+#include "perf_counter.h"
+
+// Benchmark harness shared by every task. A benchmark is a callable timed
+// as a whole: a few warmup runs, then a number of measured runs summarized
+// as min, median, MAD and a confidence interval of the median. Speedups in
+// the test asserts are ratios of minimums, the best each code can do; the
+// spread goes to the JSON/CSV report for dashboards. Hardware counters of
+// the calling thread are collected over the measured runs, when the machine
+// has them. A run can be recorded as the baseline of the machine and later
+// runs compared against it, see baseline.h.
+//
+// Command line of every benchmark binary, after benchmark::init(argc, argv),
+// anything not an option is left in config().arguments:
+//   --warmup=N --iterations=N   runs per measurement, 1 and 11 by default
+//   --cpu=N                     pin to CPU N, -1 to leave the thread alone
+//   --fifo                      SCHED_FIFO, needs CAP_SYS_NICE
+//   --json=PATH --csv=PATH      write every measurement there on exit
+//   --no-counters               do not open perf events
+//   --record=PATH               store the samples as the baseline of this
+//                               host and CPU in PATH, on exit
+//   --compare=PATH              flag measurements significantly slower than
+//                               the baseline in PATH, exit with status 1 if any
+//   --isa=sse4.2|avx2|avx512    run the kernels of that ISA, the widest the
+//                               CPU has by default
+//   --tolerance=PCT             slowdowns of the median below PCT are not
+//                               flagged, 5 by default
+
+namespace benchmark {
+
+// Keeps value and everything it points to alive, as if read by the CPU
+template <typename T>
+inline void do_not_optimize(const T& value)
+{
+    if constexpr (std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(void*)) {
+        asm volatile("" :: "r,m" (value) : "memory");
+    } else {
+        asm volatile("" :: "m" (value) : "memory");
+    }
+}
+
+// Every write so far must reach memory before the next read
+inline void clobber_memory()
+{
+    asm volatile("" ::: "memory");
+}
+
+// Pin to the CPU the process started on
+constexpr int CPU_CURRENT = -2;
+constexpr int CPU_ANY = -1;
+
+struct Config {
+    int warmup = 1;
+    int iterations = 11;
+    int cpu = CPU_CURRENT;
+    bool fifo = false;
+    bool counters = true;
+    std::string json_path;
+    std::string csv_path;
+    std::string record_path;
+    std::string compare_path;
+    double tolerance = 0.05;
+    // Command line arguments that are not options, for the binary to use
+    std::vector<std::string> arguments;
+};
+
+struct Stats {
+    size_t samples = 0;
+    double min = 0;
+    double median = 0;
+    // Median absolute deviation from the median
+    double mad = 0;
+    double mean = 0;
+    // 95% confidence interval of the median, by order statistics
+    double ci_low = 0;
+    double ci_high = 0;
+    // Perf event name and average count per run, empty without counters
+    std::vector<std::pair<std::string, double>> counters;
+
+    // The same numbers per operation, when a run does ops of them
+    Stats per(double ops) const
+    {
+        Stats result = *this;
+        for (double* value : {&result.min, &result.median, &result.mad, &result.mean, &result.ci_low, &result.ci_high}) {
+            *value /= ops;
+        }
+        for (auto& counter : result.counters) {
+            counter.second /= ops;
+        }
+        return result;
+    }
+
+    bool has_counter(const std::string& name) const
+    {
+        for (const auto& counter : counters) {
+            if (counter.first == name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 0 if the counter is unavailable
+    double counter(const std::string& name) const
+    {
+        for (const auto& counter : counters) {
+            if (counter.first == name) {
+                return counter.second;
+            }
+        }
+        return 0;
+    }
+};
+
+inline Stats summarize(std::vector<double> samples)
+{
+    Stats stats;
+    if (samples.empty()) {
+        return stats;
+    }
+    size_t n = samples.size();
+    std::sort(samples.begin(), samples.end());
+    auto median_of = [] (const std::vector<double>& sorted) {
+        size_t n = sorted.size();
+        return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    };
+    stats.samples = n;
+    stats.min = samples.front();
+    stats.median = median_of(samples);
+    double total = 0;
+    for (double sample : samples) {
+        total += sample;
+    }
+    stats.mean = total / n;
+    std::vector<double> deviations(n);
+    for (size_t i = 0; i < n; ++i) {
+        deviations[i] = std::abs(samples[i] - stats.median);
+    }
+    std::sort(deviations.begin(), deviations.end());
+    stats.mad = median_of(deviations);
+    // The rank of the median is Binomial(n, 1/2), about n/2 +- 1.96 sqrt(n)/2
+    double half_width = 1.96 * std::sqrt(double(n)) / 2;
+    long low = std::lround(n / 2.0 - half_width) - 1, high = std::lround(n / 2.0 + half_width);
+    stats.ci_low = samples[std::clamp<long>(low, 0, n - 1)];
+    stats.ci_high = samples[std::clamp<long>(high, 0, n - 1)];
+    return stats;
+}
+
+// One benchmark parameter, such as the array size. Kept as JSON text
+struct Param {
+    template <typename T>
+    Param(std::string key, const T& value) : key(std::move(key))
+    {
+        std::ostringstream out;
+        if constexpr (std::is_arithmetic_v<T>) {
+            out << value;
+            this->value = out.str();
+        } else {
+            out << value;
+            std::string text = out.str();
+            this->value = "\"";
+            for (char c : text) {
+                this->value += c == '"' ? '\'' : c;
+            }
+            this->value += '"';
+        }
+    }
+
+    std::string key;
+    std::string value;
+};
+
+using Params = std::vector<Param>;
+
+namespace detail {
+
+struct Record {
+    std::string name;
+    Params params;
+    Stats stats;
+    // Per operation, in the order of the runs
+    std::vector<double> samples;
+};
+
+// A slowdown is flagged only when it is this unlikely to be noise
+constexpr double BASELINE_SIGNIFICANCE = 0.01;
+
+// Measurements of the process, written to the configured files on exit
+class Registry
+{
+public:
+    static Registry& instance()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    Config config;
+    std::string suite = "bench";
+    std::vector<Record> records;
+    // Opened by init() unless disabled
+    std::unique_ptr<PerfCounterGroup> counters;
+
+    // Forked children exit through the same destructors, only init() writes
+    pid_t owner = -1;
+
+    baseline::Machine machine;
+    // Loaded by init() for --compare
+    std::vector<baseline::Entry> baseline;
+    size_t regressions = 0;
+
+    ~Registry()
+    {
+        if (getpid() != owner) {
+            return;
+        }
+        if (!config.json_path.empty()) {
+            write_json(config.json_path);
+        }
+        if (!config.csv_path.empty()) {
+            write_csv(config.csv_path);
+        }
+        if (!config.record_path.empty()) {
+            write_baseline(config.record_path);
+        }
+        if (regressions > 0) {
+            std::cerr << regressions << " measurements of " << suite << " are slower than the baseline in "
+                      << config.compare_path << std::endl;
+            std::cout.flush();
+            _exit(1);
+        }
+    }
+
+    // "name {params}", then " #2", " #3" for the same measurement repeated
+    std::string key(size_t index) const
+    {
+        const Record& record = records[index];
+        std::string result = record.name + " " + params_json(record.params);
+        size_t repeat = 1;
+        for (size_t i = 0; i < index; ++i) {
+            repeat += records[i].name == record.name && params_json(records[i].params) == params_json(record.params);
+        }
+        return repeat > 1 ? result + " #" + std::to_string(repeat) : result;
+    }
+
+    // Flags the last record if the baseline has it and it got slower
+    void compare_last()
+    {
+        if (baseline.empty()) {
+            return;
+        }
+        std::string id = key(records.size() - 1);
+        const Record& record = records.back();
+        for (const baseline::Entry& entry : baseline) {
+            if (entry.key != id) {
+                continue;
+            }
+            Stats before = summarize(entry.samples);
+            double p = baseline::slower_p_value(entry.samples, record.samples);
+            double slowdown = record.stats.median / before.median - 1;
+            if (p < BASELINE_SIGNIFICANCE && slowdown > config.tolerance) {
+                ++regressions;
+                std::cerr << "Slower than baseline: " << id << ", median " << before.median << "ns -> "
+                          << record.stats.median << "ns (+" << std::lround(slowdown * 100) << "%), p = " << p << std::endl;
+            }
+            return;
+        }
+    }
+
+private:
+    static std::string params_json(const Params& params)
+    {
+        std::string result = "{";
+        for (size_t i = 0; i < params.size(); ++i) {
+            result += (i ? ", \"" : "\"") + baseline::escape(params[i].key) + "\": " + params[i].value;
+        }
+        return result + "}";
+    }
+
+    void write_baseline(const std::string& path) const
+    {
+        baseline::Store store;
+        store.load(path);
+        std::vector<baseline::Json> results;
+        for (size_t i = 0; i < records.size(); ++i) {
+            std::ostringstream text;
+            text.precision(9);
+            text << "{\"key\": \"" << baseline::escape(key(i)) << "\", \"samples\": [";
+            for (size_t j = 0; j < records[i].samples.size(); ++j) {
+                text << (j ? ", " : "") << records[i].samples[j];
+            }
+            text << "]}";
+            results.emplace_back();
+            baseline::JsonParser(text.str()).parse(results.back());
+        }
+        store.replace(machine, suite, std::move(results));
+        if (!store.save(path)) {
+            std::cerr << "Cannot write the baseline to " << path << std::endl;
+        }
+    }
+
+    void write_json(const std::string& path) const
+    {
+        std::ofstream out(path);
+        out.precision(9);
+        out << "{\"suite\": \"" << baseline::escape(suite) << "\", \"unit\": \"ns\", \"results\": [";
+        for (size_t i = 0; i < records.size(); ++i) {
+            const Record& record = records[i];
+            const Stats& stats = record.stats;
+            out << (i ? ",\n" : "\n") << "  {\"name\": \"" << baseline::escape(record.name) << "\", \"params\": "
+                << params_json(record.params) << ", \"samples\": " << stats.samples << ", \"min\": " << stats.min
+                << ", \"median\": " << stats.median << ", \"mad\": " << stats.mad << ", \"mean\": " << stats.mean
+                << ", \"ci_low\": " << stats.ci_low << ", \"ci_high\": " << stats.ci_high << ", \"counters\": {";
+            for (size_t j = 0; j < stats.counters.size(); ++j) {
+                out << (j ? ", " : "") << '"' << stats.counters[j].first << "\": " << stats.counters[j].second;
+            }
+            out << "}}";
+        }
+        out << "\n]}\n";
+    }
+
+    // Quoted, quotes doubled: commas and quotes in text stay inside the field
+    static std::string csv_field(const std::string& text)
+    {
+        std::string result = "\"";
+        for (char c : text) {
+            result += c == '"' ? "\"\"" : std::string(1, c);
+        }
+        return result + "\"";
+    }
+
+    void write_csv(const std::string& path) const
+    {
+        std::ofstream out(path);
+        out.precision(9);
+        out << "suite,name,params,samples,min,median,mad,mean,ci_low,ci_high,counters\n";
+        for (const Record& record : records) {
+            const Stats& stats = record.stats;
+            std::string params;
+            for (const Param& param : record.params) {
+                params += (params.empty() ? "" : ";") + param.key + "=" + param.value;
+            }
+            // String values lose their JSON quotes, the field is quoted as a whole
+            params.erase(std::remove(params.begin(), params.end(), '"'), params.end());
+            out << suite << "," << csv_field(record.name) << "," << csv_field(params) << "," << stats.samples << ","
+                << stats.min << "," << stats.median << "," << stats.mad << "," << stats.mean << ","
+                << stats.ci_low << "," << stats.ci_high << ",";
+            for (size_t j = 0; j < stats.counters.size(); ++j) {
+                out << (j ? ";" : "") << stats.counters[j].first << "=" << stats.counters[j].second;
+            }
+            out << "\n";
+        }
+    }
+};
+
+}  // namespace detail
+
+inline const Config& config()
+{
+    return detail::Registry::instance().config;
+}
+
+inline bool pin_to_cpu(int cpu)
+{
+    if (cpu < 0) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Parses the command line over the defaults of the binary, then pins the
+// calling thread and switches it to SCHED_FIFO if asked. Threads started
+// later inherit both, multithreaded benchmarks default to CPU_ANY
+inline void init(int argc, char** argv, Config defaults = Config())
+{
+    detail::Registry& registry = detail::Registry::instance();
+    Config& config = registry.config;
+    config = defaults;
+    registry.owner = getpid();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&] (const char* prefix) -> const char* {
+            size_t length = std::strlen(prefix);
+            return arg.compare(0, length, prefix) == 0 ? argv[i] + length : nullptr;
+        };
+        if (const char* v = value("--warmup=")) {
+            config.warmup = std::max(0, std::atoi(v));
+        } else if (const char* v = value("--iterations=")) {
+            config.iterations = std::max(1, std::atoi(v));
+        } else if (const char* v = value("--cpu=")) {
+            config.cpu = std::atoi(v);
+        } else if (arg == "--fifo") {
+            config.fifo = true;
+        } else if (arg == "--no-counters") {
+            config.counters = false;
+        } else if (const char* v = value("--json=")) {
+            config.json_path = v;
+        } else if (const char* v = value("--csv=")) {
+            config.csv_path = v;
+        } else if (const char* v = value("--record=")) {
+            config.record_path = v;
+        } else if (const char* v = value("--compare=")) {
+            config.compare_path = v;
+        } else if (const char* v = value("--isa=")) {
+            Isa isa;
+            if (!parse_isa(v, isa) || !force_isa(isa)) {
+                std::cerr << "Cannot run " << v << " kernels on this CPU" << std::endl;
+                std::exit(2);
+            }
+        } else if (const char* v = value("--tolerance=")) {
+            config.tolerance = std::atof(v) / 100;
+        } else if (arg.rfind("--", 0) != 0) {
+            config.arguments.push_back(arg);
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            std::exit(2);
+        }
+    }
+    // The suite is the task directory of the binary: sort/main -> sort
+    std::string path = argc > 0 ? argv[0] : "";
+    if (path.find('/') == std::string::npos || path.rfind("./", 0) == 0) {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) != nullptr) {
+            path = std::string(cwd) + "/main";
+        }
+    }
+    path = path.substr(0, path.rfind('/'));
+    registry.suite = path.substr(path.rfind('/') + 1);
+    registry.machine = baseline::Machine::current();
+    registry.machine.isa = isa_name(active_isa());
+    registry.baseline.clear();
+    registry.regressions = 0;
+    if (!config.compare_path.empty()) {
+        baseline::Store store;
+        store.load(config.compare_path);
+        registry.baseline = store.entries(registry.machine, registry.suite);
+        if (registry.baseline.empty()) {
+            std::cerr << "No baseline of " << registry.suite << " for host " << registry.machine.host << ", CPU "
+                      << registry.machine.cpu << ", " << registry.machine.isa << " in " << config.compare_path << std::endl;
+        }
+    }
+
+    if (config.cpu == CPU_CURRENT) {
+        config.cpu = sched_getcpu();
+    }
+    if (config.cpu >= 0 && !pin_to_cpu(config.cpu)) {
+        std::cerr << "Cannot pin to CPU " << config.cpu << ", running unpinned" << std::endl;
+        config.cpu = CPU_ANY;
+    }
+    if (config.fifo) {
+        sched_param param{};
+        param.sched_priority = 1;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+            std::cerr << "SCHED_FIFO needs CAP_SYS_NICE, running with the default scheduler" << std::endl;
+            config.fifo = false;
+        }
+    }
+    registry.counters.reset();
+    if (config.counters) {
+        registry.counters = std::make_unique<PerfCounterGroup>();
+        if (!registry.counters->error().empty()) {
+            std::cerr << "Some perf events are unavailable (" << registry.counters->error() << "), counting";
+            for (const std::string& name : registry.counters->names()) {
+                std::cerr << " " << name << ",";
+            }
+            std::cerr << " nothing else" << std::endl;
+        }
+    }
+}
+
+// " Per search: 41.2 cycles, 12.5 instructions, ..." for the counters of
+// stats, to append to a result line. Empty without counters
+inline std::string format_counters(const Stats& stats, const std::string& op)
+{
+    if (stats.counters.empty()) {
+        return "";
+    }
+    std::ostringstream out;
+    out.precision(3);
+    out << " Per " << op << ":";
+    for (size_t i = 0; i < stats.counters.size(); ++i) {
+        out << (i ? ", " : " ") << stats.counters[i].second << " " << stats.counters[i].first;
+    }
+    out << ".";
+    return out.str();
+}
+
+// Measures run() and records the result under name and params. setup() is
+// called before every run, warmup included, and is not timed. The stats are
+// per operation when a run does ops of them
+template <typename Setup, typename Run>
+Stats measure_with_setup(const std::string& name, const Params& params, const Setup& setup, const Run& run, double ops = 1)
+{
+    const Config& config = benchmark::config();
+    for (int i = 0; i < config.warmup; ++i) {
+        setup();
+        run();
+    }
+    PerfCounterGroup* counters = detail::Registry::instance().counters.get();
+    if (counters != nullptr) {
+        counters->reset();
+    }
+    std::vector<double> samples;
+    samples.reserve(config.iterations);
+    for (int i = 0; i < config.iterations; ++i) {
+        setup();
+        clobber_memory();
+        if (counters != nullptr) {
+            counters->start();
+        }
+        auto start = std::chrono::steady_clock::now();
+        run();
+        clobber_memory();
+        auto end = std::chrono::steady_clock::now();
+        if (counters != nullptr) {
+            counters->stop();
+        }
+        samples.push_back(double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+    }
+    Stats stats = summarize(samples);
+    if (counters != nullptr) {
+        stats.counters = counters->read();
+        for (auto& counter : stats.counters) {
+            counter.second /= config.iterations;
+        }
+    }
+    stats = stats.per(ops);
+    for (double& sample : samples) {
+        sample /= ops;
+    }
+    detail::Registry& registry = detail::Registry::instance();
+    registry.records.push_back({name, params, stats, std::move(samples)});
+    registry.compare_last();
+    return stats;
+}
+
+// Calls f(isa) with the kernels of every ISA the CPU has, narrowest first,
+// to test or compare the variants. The ISA in use is restored afterwards
+template <typename F>
+void for_each_isa(const F& f)
+{
+    Isa active = active_isa();
+    for (int i = 0; i < ISA_COUNT; ++i) {
+        Isa isa = static_cast<Isa>(i);
+        if (force_isa(isa)) {
+            f(isa);
+        }
+    }
+    force_isa(active);
+}
+
+template <typename Run>
+Stats measure(const std::string& name, const Params& params, const Run& run, double ops = 1)
+{
+    return measure_with_setup(name, params, [] {}, run, ops);
+}
+
+}  // namespace benchmark
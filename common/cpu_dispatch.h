@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+
+// Runtime choice between the SIMD variants of a kernel. The tasks build for
+// the x86-64-v2 baseline (SSE4.2, POPCNT), so one binary runs on every
+// machine of the fleet; kernels that gain from wider vectors come in AVX2
+// and AVX-512 variants too, compiled with __attribute__((target)). The widest
+// ISA the CPU reports through CPUID is picked on first use. A benchmark can
+// force a narrower one to compare the variants on the same machine.
+
+enum class Isa { SSE42, AVX2, AVX512 };
+constexpr int ISA_COUNT = 3;
+
+inline const char * isa_name(Isa isa)
+{
+    switch (isa) {
+    case Isa::SSE42:
+        return "sse4.2";
+    case Isa::AVX2:
+        return "avx2";
+    case Isa::AVX512:
+        return "avx512";
+    }
+    return "";
+}
+
+// Accepts the names of isa_name
+inline bool parse_isa(const std::string& name, Isa& isa)
+{
+    for (int i = 0; i < ISA_COUNT; ++i) {
+        if (name == isa_name(static_cast<Isa>(i))) {
+            isa = static_cast<Isa>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The AVX-512 kernels use F and BW, the AVX2 ones also need BMI2 and FMA of
+// the same generation
+inline Isa detect_isa()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return Isa::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma")) {
+        return Isa::AVX2;
+    }
+    return Isa::SSE42;
+}
+
+// -1 until the first dispatch, constant initialized so kernels called from
+// static constructors of other files still see the CPU
+inline int active_isa_index = -1;
+
+inline Isa active_isa()
+{
+    if (__builtin_expect(active_isa_index < 0, 0)) {
+        active_isa_index = static_cast<int>(detect_isa());
+    }
+    return static_cast<Isa>(active_isa_index);
+}
+
+// Every dispatch from now on goes to the isa variants. False, and nothing
+// changes, if the CPU does not have isa
+inline bool force_isa(Isa isa)
+{
+    if (static_cast<int>(isa) > static_cast<int>(detect_isa())) {
+        return false;
+    }
+    active_isa_index = static_cast<int>(isa);
+    return true;
+}
+
+// The variants of one kernel, a function pointer per ISA. A kernel without
+// an AVX-512 variant passes its AVX2 one twice
+template <typename F>
+class IsaDispatch
+{
+public:
+    constexpr IsaDispatch(F sse42, F avx2, F avx512) : variants_{sse42, avx2, avx512} {}
+
+    F get() const { return variants_[static_cast<int>(active_isa())]; }
+
+    template <typename... Args>
+    decltype(auto) operator()(Args&&... args) const
+    {
+        return get()(static_cast<Args&&>(args)...);
+    }
+
+private:
+    F variants_[ISA_COUNT];
+};
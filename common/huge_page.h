@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Memory backed by 2 MB pages, optionally bound to one NUMA node. Random
+// probes over a large array then need one TLB entry per 2 MB instead of per
+// 4 KB. Explicit hugetlbfs pages (MAP_HUGETLB) are tried first; if none are
+// reserved, the mapping is 2 MB aligned and handed to transparent huge pages
+// with madvise(MADV_HUGEPAGE). Small blocks stay on the regular heap. Every
+// block is at least cache line aligned.
+
+constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+// Allocations below this size do not go to mmap
+constexpr size_t HUGE_PAGE_MIN_ALLOC = HUGE_PAGE_SIZE / 2;
+// Any node, no binding
+constexpr int NUMA_NODE_ANY = -1;
+// Cache line alignment of the blocks from the regular heap
+constexpr size_t HUGE_PAGE_HEAP_ALIGN = 64;
+
+inline size_t huge_page_round(size_t bytes)
+{
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+// Bind [ptr, ptr + bytes) to node before first touch. Without libnuma, so the
+// raw syscall; fails harmlessly on kernels without NUMA support
+inline void huge_page_bind(void * ptr, size_t bytes, int numa_node)
+{
+#ifdef SYS_mbind
+    if (numa_node < 0 || numa_node >= 64) {
+        return;
+    }
+    constexpr int MPOL_BIND = 2;
+    unsigned long mask = 1ul << numa_node;
+    syscall(SYS_mbind, ptr, bytes, MPOL_BIND, &mask, 64, 0);
+#else
+    (void)ptr, (void)bytes, (void)numa_node;
+#endif
+}
+
+inline void * huge_page_alloc(size_t bytes, int numa_node = NUMA_NODE_ANY)
+{
+    if (bytes < HUGE_PAGE_MIN_ALLOC) {
+        return ::operator new(bytes, std::align_val_t(HUGE_PAGE_HEAP_ALIGN));
+    }
+    size_t size = huge_page_round(bytes);
+    void * ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+        // Over-map by a page to cut a 2 MB aligned range out of it, THP only
+        // backs aligned 2 MB ranges
+        char * raw = static_cast<char*>(mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        char * aligned = reinterpret_cast<char*>(huge_page_round(reinterpret_cast<uintptr_t>(raw)));
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+        madvise(aligned, size, MADV_HUGEPAGE);
+        ptr = aligned;
+    }
+    huge_page_bind(ptr, size, numa_node);
+    return ptr;
+}
+
+// bytes must be the size passed to huge_page_alloc
+inline void huge_page_free(void * ptr, size_t bytes)
+{
+    if (bytes < HUGE_PAGE_MIN_ALLOC) {
+        ::operator delete(ptr, std::align_val_t(HUGE_PAGE_HEAP_ALIGN));
+        return;
+    }
+    munmap(ptr, huge_page_round(bytes));
+}
+
+// Standard allocator over huge_page_alloc, for std::vector and friends
+template <typename T>
+class HugePageAllocator
+{
+public:
+    using value_type = T;
+
+    HugePageAllocator() = default;
+    explicit HugePageAllocator(int numa_node) : numa_node_(numa_node) {}
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>& other) : numa_node_(other.numa_node()) {}
+
+    T * allocate(size_t n)
+    {
+        return static_cast<T*>(huge_page_alloc(n * sizeof(T), numa_node_));
+    }
+
+    void deallocate(T * ptr, size_t n)
+    {
+        huge_page_free(ptr, n * sizeof(T));
+    }
+
+    int numa_node() const { return numa_node_; }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>& other) const { return numa_node_ == other.numa_node(); }
+    template <typename U>
+    bool operator!=(const HugePageAllocator<U>& other) const { return numa_node_ != other.numa_node(); }
+
+private:
+    int numa_node_ = NUMA_NODE_ANY;
+};
+
+template <typename T>
+using HugeVector = std::vector<T, HugePageAllocator<T>>;
+
+// Bytes of this process currently on transparent huge pages, to check that
+// the kernel actually granted them. Hugetlbfs pages are not counted
+inline size_t transparent_huge_page_bytes()
+{
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string field;
+    size_t kb = 0;
+    while (smaps >> field) {
+        if (field == "AnonHugePages:") {
+            smaps >> kb;
+            break;
+        }
+    }
+    return kb << 10;
+}
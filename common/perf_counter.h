@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware counters of the calling thread in user space, via perf_event_open.
+// The events are opened as one group, so they count over exactly the same
+// instructions and are multiplexed together. Any event the machine lacks is
+// left out: in containers and VMs without a PMU only the software ones
+// remain, or none, and benchmarks report what there is and go on.
+class PerfCounterGroup
+{
+public:
+    struct Event {
+        const char * name;
+        uint32_t type;
+        uint64_t config;
+    };
+
+    static constexpr uint64_t cache_event(uint64_t cache, uint64_t result)
+    {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    }
+
+    // What explains most slow kernels: where the cycles went, and the misses
+    // and mispredicts that cost them
+    static std::vector<Event> default_events()
+    {
+        return {
+            {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {"L1d misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+            {"LLC misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+            {"dTLB misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+            {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+        };
+    }
+
+    explicit PerfCounterGroup(const std::vector<Event>& events = default_events())
+    {
+        for (const Event& event : events) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = event.type;
+            attr.config = event.config;
+            attr.disabled = leader() < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader(), 0));
+            if (fd < 0) {
+                if (error_.empty()) {
+                    error_ = std::string(event.name) + ": " + std::strerror(errno);
+                }
+                continue;
+            }
+            fds_.push_back(fd);
+            names_.push_back(event.name);
+        }
+    }
+
+    PerfCounterGroup(const PerfCounterGroup&) = delete;
+    PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+    ~PerfCounterGroup()
+    {
+        for (int fd : fds_) {
+            close(fd);
+        }
+    }
+
+    bool valid() const { return !fds_.empty(); }
+    // Why the first missing event could not be opened, empty if none is missing
+    const std::string& error() const { return error_; }
+    const std::vector<std::string>& names() const { return names_; }
+
+    // Counts accumulate over start()/stop() pairs until reset()
+    void reset()
+    {
+        if (leader() >= 0) {
+            ioctl(leader(), PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    void start()
+    {
+        if (leader() >= 0) {
+            ioctl(leader(), PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    void stop()
+    {
+        if (leader() >= 0) {
+            ioctl(leader(), PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    // Event name and count, scaled up for the time the group was not on the
+    // PMU when the kernel had to multiplex it
+    std::vector<std::pair<std::string, double>> read() const
+    {
+        std::vector<std::pair<std::string, double>> counts;
+        if (leader() < 0) {
+            return counts;
+        }
+        // nr, time enabled, time running, then one value per event
+        std::vector<uint64_t> buffer(3 + fds_.size());
+        ssize_t size = ::read(leader(), buffer.data(), buffer.size() * sizeof(uint64_t));
+        if (size < ssize_t(3 * sizeof(uint64_t)) || buffer[0] != fds_.size()) {
+            return counts;
+        }
+        double scale = buffer[2] > 0 ? double(buffer[1]) / double(buffer[2]) : 1;
+        for (size_t i = 0; i < fds_.size(); ++i) {
+            counts.emplace_back(names_[i], double(buffer[3 + i]) * scale);
+        }
+        return counts;
+    }
+
+private:
+    int leader() const { return fds_.empty() ? -1 : fds_.front(); }
+
+    std::vector<int> fds_;
+    std::vector<std::string> names_;
+    std::string error_;
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+
+#include <immintrin.h>
+
+#include "cpu_dispatch.h"
+
+// Linear scan for value in data[0, size), shared by the search tasks. Every
+// variant checks several vectors per branch and reads the tail with a masked
+// load (scalar for SSE), so it never touches memory past data + size. The
+// widest one the CPU supports is picked on first use, see cpu_dispatch.h.
+// Short ranges skip the kernels and are scanned inline by search_tiny().
+
+// A window of 8 ints starting at TAIL_MASK + 8 - n enables the first n lanes
+alignas(64) inline constexpr int TAIL_MASK[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+
+__attribute__((target("avx512f")))
+inline bool search_small_avx512(const int * data, size_t size, int value)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m512i) / sizeof(int);
+    const __m512i vec_value = _mm512_set1_epi32(value);
+    size_t idx = 0;
+    for (; idx + 4 * INTS_IN_VEC <= size; idx += 4 * INTS_IN_VEC) {
+        __mmask16 found = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(data + idx), vec_value)
+                        | _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(data + idx + INTS_IN_VEC), vec_value)
+                        | _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(data + idx + 2 * INTS_IN_VEC), vec_value)
+                        | _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(data + idx + 3 * INTS_IN_VEC), vec_value);
+        if (found != 0) {
+            return true;
+        }
+    }
+    for (; idx + INTS_IN_VEC <= size; idx += INTS_IN_VEC) {
+        if (_mm512_cmpeq_epi32_mask(_mm512_loadu_si512(data + idx), vec_value) != 0) {
+            return true;
+        }
+    }
+    if (idx == size) {
+        return false;
+    }
+    // Masked out lanes are neither loaded nor compared
+    __mmask16 lanes = static_cast<__mmask16>((1u << (size - idx)) - 1);
+    __m512i chunk = _mm512_maskz_loadu_epi32(lanes, data + idx);
+    return _mm512_mask_cmpeq_epi32_mask(lanes, chunk, vec_value) != 0;
+}
+
+__attribute__((target("avx2")))
+inline bool search_small_avx2(const int * data, size_t size, int value)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m256i) / sizeof(int);
+    const __m256i vec_value = _mm256_set1_epi32(value);
+    // Lambdas do not inherit the target of the enclosing function
+    auto load = [data] (size_t idx) __attribute__((target("avx2"))) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + idx));
+    };
+    size_t idx = 0;
+    for (; idx + 4 * INTS_IN_VEC <= size; idx += 4 * INTS_IN_VEC) {
+        __m256i found = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi32(load(idx), vec_value),
+                            _mm256_cmpeq_epi32(load(idx + INTS_IN_VEC), vec_value)),
+            _mm256_or_si256(_mm256_cmpeq_epi32(load(idx + 2 * INTS_IN_VEC), vec_value),
+                            _mm256_cmpeq_epi32(load(idx + 3 * INTS_IN_VEC), vec_value)));
+        if (!_mm256_testz_si256(found, found)) {
+            return true;
+        }
+    }
+    for (; idx + INTS_IN_VEC <= size; idx += INTS_IN_VEC) {
+        __m256i found = _mm256_cmpeq_epi32(load(idx), vec_value);
+        if (!_mm256_testz_si256(found, found)) {
+            return true;
+        }
+    }
+    if (idx == size) {
+        return false;
+    }
+    // Masked out lanes load as zero, so they are also dropped from the compare
+    __m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(TAIL_MASK + INTS_IN_VEC - (size - idx)));
+    __m256i chunk = _mm256_maskload_epi32(data + idx, lanes);
+    return !_mm256_testz_si256(_mm256_cmpeq_epi32(chunk, vec_value), lanes);
+}
+
+inline bool search_small_sse(const int * data, size_t size, int value)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m128i) / sizeof(int);
+    const __m128i vec_value = _mm_set1_epi32(value);
+    auto load = [data] (size_t idx) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + idx));
+    };
+    size_t idx = 0;
+    for (; idx + 4 * INTS_IN_VEC <= size; idx += 4 * INTS_IN_VEC) {
+        __m128i found = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(load(idx), vec_value),
+                         _mm_cmpeq_epi32(load(idx + INTS_IN_VEC), vec_value)),
+            _mm_or_si128(_mm_cmpeq_epi32(load(idx + 2 * INTS_IN_VEC), vec_value),
+                         _mm_cmpeq_epi32(load(idx + 3 * INTS_IN_VEC), vec_value)));
+        if (_mm_movemask_epi8(found) != 0) {
+            return true;
+        }
+    }
+    // No masked loads before AVX, the tail is short enough to go one by one
+    bool found = false;
+    for (; idx < size; ++idx) {
+        found |= data[idx] == value;
+    }
+    return found;
+}
+
+using SearchSmall = bool (*)(const int * data, size_t size, int value);
+
+inline constexpr IsaDispatch<SearchSmall> search_small_kernel(search_small_sse, search_small_avx2, search_small_avx512);
+
+// Up to this size a scan is a few loads, cheaper than picking a kernel
+constexpr size_t SCAN_INLINE_SIZE = 16;
+
+// Scan of at most SCAN_INLINE_SIZE ints without a branch per vector. The
+// 4-int windows overlap instead of masking the tail, so nothing past
+// data + size is read
+inline bool search_tiny(const int * data, size_t size, int value)
+{
+    if (size < 4) {
+        bool found = false;
+        for (size_t idx = 0; idx < size; ++idx) {
+            found |= data[idx] == value;
+        }
+        return found;
+    }
+    const __m128i vec_value = _mm_set1_epi32(value);
+    auto match = [data, vec_value] (size_t idx) {
+        return _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + idx)), vec_value);
+    };
+    __m128i found = _mm_or_si128(match(0), match(size - 4));
+    if (size > 8) {
+        found = _mm_or_si128(found, _mm_or_si128(match(4), match(size - 8)));
+    }
+    return _mm_movemask_epi8(found) != 0;
+}
+
+// Loops over many scans pass search_small_kernel.get(), bound once
+inline bool search_small(SearchSmall kernel, const int * data, size_t size, int value)
+{
+    return size <= SCAN_INLINE_SIZE ? search_tiny(data, size, value) : kernel(data, size, value);
+}
+
+inline bool search_small(const int * data, size_t size, int value)
+{
+    return size <= SCAN_INLINE_SIZE ? search_tiny(data, size, value) : search_small_kernel(data, size, value);
+}
@@ -1,16 +1,17 @@
 #include <iostream>
 #include <random>
 #include <cassert>
-#include <chrono>
+#include <string>
 
 #include "matrix.h"
+#include "bench.h"
 
 Matrix generate_matrix(int n)
 {
     std::random_device device;
     std::mt19937 mt(device());
 
-    std::vector<int> data(n*n);
+    HugeVector<int> data(n*n);
     for (int i = 0; i < n; ++i) {
         for (int j = 0; j < n; ++j) {
             data[i*n+j] = mt();
@@ -23,7 +24,7 @@ Matrix multiply_basic(const Matrix& a, const Matrix& b)
 {
     assert(a.n == b.n);
     int n = a.n;
-    std::vector<int> data(n*n);
+    HugeVector<int> data(n*n);
     for (int i = 0; i < n; ++i) {
         for (int j = 0; j < n; ++j) {
             int r = 0;
@@ -51,37 +52,23 @@ void validate(const F& multiplier, const Matrix& a, const Matrix& b)
 }
 
 template <typename F>
-long bench_single(const F& multiplier, const Matrix& a, const Matrix& b)
+benchmark::Stats bench_best(const std::string& name, const F& multiplier, const Matrix& a, const Matrix& b)
 {
-    auto start = std::chrono::high_resolution_clock::now();
-    auto m = multiplier(a, b);
-    int r = 0;
-    for (int i = 0; i < m.data.size(); ++i) {
-        r += m.data[i];
-    }
-    asm volatile("":: "r" (r));
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    return duration;
-}
-
-template <typename F>
-double bench_best(const F& multiplier, const Matrix& a, const Matrix& b)
-{
-    auto best = bench_single(multiplier, a, b);
-    for (int i = 0; i < 10; ++i) {
-        best = std::min(best, bench_single(multiplier, a, b));
-    }
-    return double(best);
+    return benchmark::measure(name, {{"n", a.n}}, [&] {
+        auto m = multiplier(a, b);
+        benchmark::do_not_optimize(m.data.data());
+    });
 }
 
 void bench(const Matrix& a, const Matrix& b)
 {
-    double basic = bench_best(multiply_basic, a, b);
-    double good = bench_best(multiply, a, b);
-    double ratio = basic / good;
+    auto basic = bench_best("basic", multiply_basic, a, b);
+    auto good = bench_best("multiply", multiply, a, b);
+    double ratio = basic.min / good.min;
     std::cout << "Multiply " << a.n << " size matrices. ";
-    std::cout << "Basic: " << basic << "ns " << " Your: " << good << " ns. Speedup: " << ratio << std::endl;
+    std::cout << "Basic: " << basic.min << "ns " << " Your: " << good.min << " ns. Speedup: " << ratio << ".";
+    // A multiply-add per element of the n^3 product
+    std::cout << benchmark::format_counters(good.per(double(a.n) * a.n * a.n), "multiply-add") << std::endl;
     assert(ratio > 4);
 }
 
@@ -90,7 +77,9 @@ void test_correctness()
     int n = 1000;
     auto a = generate_matrix(n);
     auto b = generate_matrix(n);
-    validate(multiply, a, b);
+    benchmark::for_each_isa([&] (Isa) {
+        validate(multiply, a, b);
+    });
     std::cout << "test_correctness PASSED" << std::endl;
 }
 
@@ -109,8 +98,72 @@ void test_performance()
     std::cout << "test_performance PASSED" << std::endl;
 }
 
-int main()
+// Column sums of the same n x n matrix on 4 KB and on 2 MB pages: every
+// step of a column walk is n * 4 bytes away, a new 4 KB page for n >= 1024
+template <typename Vector>
+benchmark::Stats bench_column_walk(const std::string& name, const Vector& data, int n)
+{
+    return benchmark::measure(name, {{"n", n}}, [&] {
+        int r = 0;
+        for (int j = 0; j < n; ++j) {
+            for (int i = 0; i < n; ++i) {
+                r += data[i*n + j];
+            }
+        }
+        benchmark::do_not_optimize(r);
+    });
+}
+
+void test_huge_pages(int n)
+{
+    size_t huge_before = transparent_huge_page_bytes();
+    auto a = generate_matrix(n);
+    size_t huge_bytes = transparent_huge_page_bytes() - std::min(huge_before, transparent_huge_page_bytes());
+    std::vector<int> small_pages(a.data.begin(), a.data.end());
+
+    auto small = bench_column_walk("column walk 4 KB pages", small_pages, n);
+    auto huge = bench_column_walk("column walk 2 MB pages", a.data, n);
+    std::cout << "Column walk of " << n << " size matrix (" << (huge_bytes >> 20) << " MB on huge pages). ";
+    std::cout << "4 KB pages: " << small.min << "ns, 2 MB pages: " << huge.min << "ns.";
+    if (huge.has_counter("dTLB misses")) {
+        std::cout << " dTLB misses per walk " << small.counter("dTLB misses") << " vs " << huge.counter("dTLB misses") << ".";
+    }
+    std::cout << " Speedup: " << small.min / huge.min << std::endl;
+    // A hypervisor that maps guest memory with 4 KB pages leaves nothing to
+    // gain, so only a regression is an error
+    if (huge_bytes >= size_t(n) * n * sizeof(int) / 2) {
+        assert(small.min / huge.min > 0.9);
+    }
+}
+
+void test_huge_pages()
+{
+    for (int n : {1024, 2048, 4096}) {
+        test_huge_pages(n);
+    }
+    std::cout << "test_huge_pages PASSED" << std::endl;
+}
+
+// The inner product vectorized for each ISA, on the same matrices
+void test_performance_isa()
+{
+    int n = 512;
+    auto a = generate_matrix(n);
+    auto b = generate_matrix(n);
+    std::cout << "Multiply " << n << " size matrices.";
+    benchmark::for_each_isa([&] (Isa isa) {
+        auto good = bench_best(std::string("multiply ") + isa_name(isa), multiply, a, b);
+        std::cout << " " << isa_name(isa) << " " << good.min << "ns";
+    });
+    std::cout << "." << std::endl;
+    std::cout << "test_performance_isa PASSED" << std::endl;
+}
+
+int main(int argc, char** argv)
 {
+    benchmark::init(argc, argv);
     test_correctness();
     test_performance();
+    test_huge_pages();
+    test_performance_isa();
 }
@@ -1,20 +1,12 @@
 #include "matrix.h"
 
-Matrix multiply(const Matrix& a, const Matrix& b)
-{
-    int n = a.n;
-
-    const std::vector<int>& a_dat = a.data;
-    std::vector<int> b_t_dat(n * n);
-    std::vector<int> res(n * n);
-
-    // Transpose in order to prevent multiple cache misses
-    for (int row = 0; row < n; ++row) {
-        for (int col = 0; col < n; ++col) {
-            b_t_dat[col * n + row] = b.data[row * n + col];
-        }
-    }
+#include "cpu_dispatch.h"
 
+// res = a * b_t^T. The portable body is compiled once per ISA: flatten
+// inlines it into each target wrapper, where the inner product is vectorized
+// as wide as that ISA goes
+static inline void multiply_rows(const int * a_dat, const int * b_t_dat, int * res, int n)
+{
     int val = 0;
     int a_row = 0, b_t_row = 0;
     for (int row = 0; row < n; ++row) {
@@ -29,5 +21,45 @@ Matrix multiply(const Matrix& a, const Matrix& b)
         }
         a_row += n;
     }
+}
+
+__attribute__((target("avx512f,avx512bw"), flatten))
+static void multiply_rows_avx512(const int * a_dat, const int * b_t_dat, int * res, int n)
+{
+    multiply_rows(a_dat, b_t_dat, res, n);
+}
+
+__attribute__((target("avx2"), flatten))
+static void multiply_rows_avx2(const int * a_dat, const int * b_t_dat, int * res, int n)
+{
+    multiply_rows(a_dat, b_t_dat, res, n);
+}
+
+__attribute__((flatten))
+static void multiply_rows_sse(const int * a_dat, const int * b_t_dat, int * res, int n)
+{
+    multiply_rows(a_dat, b_t_dat, res, n);
+}
+
+using MultiplyRows = void (*)(const int * a_dat, const int * b_t_dat, int * res, int n);
+
+static constexpr IsaDispatch<MultiplyRows> multiply_transposed(multiply_rows_sse, multiply_rows_avx2, multiply_rows_avx512);
+
+Matrix multiply(const Matrix& a, const Matrix& b)
+{
+    int n = a.n;
+
+    const HugeVector<int>& a_dat = a.data;
+    HugeVector<int> b_t_dat(n * n);
+    HugeVector<int> res(n * n);
+
+    // Transpose in order to prevent multiple cache misses
+    for (int row = 0; row < n; ++row) {
+        for (int col = 0; col < n; ++col) {
+            b_t_dat[col * n + row] = b.data[row * n + col];
+        }
+    }
+
+    multiply_transposed(a_dat.data(), b_t_dat.data(), res.data(), n);
     return Matrix{n, std::move(res)};
 }
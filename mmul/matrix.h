@@ -1,13 +1,17 @@
 #include <vector>
 
+#include "huge_page.h"
+
 struct Matrix
 {
     int n;
-    std::vector<int> data;
+    // On huge pages: a column walk of a large matrix touches a new 4 KB page
+    // on every row, a 2 MB page covers hundreds of rows
+    HugeVector<int> data;
 
     int get(int i, int j) const {
         return data[i*n + j];
     }
 };
 
-Matrix multiply(const Matrix& a, const Matrix& b);
\ No newline at end of file
+Matrix multiply(const Matrix& a, const Matrix& b);
@@ -3,10 +3,21 @@
 #include <algorithm>
 #include <unordered_set>
 #include <cassert>
-#include <chrono>
 #include <cstdlib>
+#include <memory>
+#include <limits>
+#include <iterator>
+#include <string>
+#include <numeric>
+#include <stdexcept>
+#include <cstdio>
+#include <chrono>
+
+#include <unistd.h>
 
 #include "search.h"
+#include "bench.h"
+#include "huge_page.h"
 
 bool search_stl(const std::vector<int>& data, int value)
 {
@@ -14,49 +25,168 @@ bool search_stl(const std::vector<int>& data, int value)
 }
 
 template <typename F>
-long bench_single(const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted, size_t nlookups)
+benchmark::Stats bench_best(const std::string& name, const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted)
 {
-    auto start = std::chrono::high_resolution_clock::now();
+    size_t nlookups = std::max(1000UL, unsorted.size());
+    nlookups = std::min(nlookups, 1UL<<16);
     auto lookup = [&] (size_t i) {
         if (!binsearch(sorted, unsorted[i])) {
             std::cout << "Fail binsearch" << std::endl;
         }
     };
-    for (size_t j = 0; j < nlookups / unsorted.size(); ++j) {
-        for (size_t i = 0; i < unsorted.size(); ++i) {
+    return benchmark::measure(name, {{"n", sorted.size()}}, [&] {
+        for (size_t j = 0; j < nlookups / unsorted.size(); ++j) {
+            for (size_t i = 0; i < unsorted.size(); ++i) {
+                lookup(i);
+            }
+        }
+        for (size_t i = 0; i < nlookups % unsorted.size(); ++i) {
             lookup(i);
         }
+    }, nlookups);
+}
+
+void bench(const std::vector<int>& sorted, const std::vector<int>& unsorted)
+{
+    double basic = bench_best("std::binary_search", search_stl, sorted, unsorted).min;
+    auto stats = bench_best("search", search, sorted, unsorted);
+    double good = stats.min;
+    double ratio = basic / good;
+    std::cout << "Search in " << sorted.size() << " elements.";
+    std::cout << " std::binary_search " << basic << "ns per search.";
+    std::cout << " Your " << good << "ns per search. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
+    assert(ratio > 2);
+}
+
+// Keys heavily skewed towards small values: interpolation guesses are far off
+std::vector<int> generate_lognormal(int n, std::mt19937& mt)
+{
+    std::lognormal_distribution<double> dist(0., 3.);
+    std::vector<int> data(n);
+    for (int i = 0; i < n; ++i) {
+        data[i] = static_cast<int>(std::min(1000 * dist(mt), 2e9));
     }
-    for (size_t i = 0; i < nlookups % unsorted.size(); ++i) {
-        lookup(i);
+    return data;
+}
+
+// Dense clusters of keys separated by wide gaps: a single global model
+// lands far away, a piecewise one follows every cluster
+std::vector<int> generate_clustered(int n, std::mt19937& mt)
+{
+    constexpr int CLUSTERS = 64;
+    std::normal_distribution<double> dist(0., 1e4);
+    std::vector<int> centers(CLUSTERS);
+    for (auto& center : centers) {
+        center = static_cast<int>(mt() % (1u << 30));
+    }
+    std::vector<int> data(n);
+    for (int i = 0; i < n; ++i) {
+        data[i] = centers[mt() % CLUSTERS] + static_cast<int>(dist(mt));
     }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    return duration;
+    return data;
 }
 
-template <typename F>
-double bench_best(const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted)
+void bench_index(const std::string& name, const std::vector<int>& data)
+{
+    std::vector<int> sdata = data;
+    std::sort(sdata.begin(), sdata.end());
+    EytzingerIndex index(sdata);
+    auto search_index = [&] (const std::vector<int>&, int value) {
+        return index.contains(value);
+    };
+    LearnedIndex learned_index(sdata);
+    auto search_learned = [&] (const std::vector<int>&, int value) {
+        return learned_index.contains(value);
+    };
+    double basic = bench_best("std::binary_search " + name, search_stl, sdata, data).min;
+    auto interpolation_stats = bench_best("search " + name, search, sdata, data);
+    auto eytzinger_stats = bench_best("EytzingerIndex " + name, search_index, sdata, data);
+    auto learned_stats = bench_best("LearnedIndex " + name, search_learned, sdata, data);
+    double interpolation = interpolation_stats.min, eytzinger = eytzinger_stats.min, learned = learned_stats.min;
+    std::cout << "Search in " << sdata.size() << " " << name << " elements.";
+    std::cout << " std::binary_search " << basic << "ns.";
+    std::cout << " Interpolation " << interpolation << "ns.";
+    std::cout << " Eytzinger " << eytzinger << "ns.";
+    std::cout << " Learned (" << learned_index.segments() << " segments) " << learned << "ns per search.";
+    std::cout << " Speedup: " << basic / eytzinger << ", " << basic / learned << ".";
+    std::cout << benchmark::format_counters(interpolation_stats, "interpolation search");
+    std::cout << benchmark::format_counters(eytzinger_stats, "Eytzinger search");
+    std::cout << benchmark::format_counters(learned_stats, "learned search") << std::endl;
+    assert(basic / eytzinger > 1.5);
+    assert(basic / learned > 1.5);
+}
+
+void bench_many(const std::vector<int>& sorted, const std::vector<int>& unsorted)
 {
     size_t nlookups = std::max(1000UL, unsorted.size());
     nlookups = std::min(nlookups, 1UL<<16);
-    auto best = bench_single(binsearch, sorted, unsorted, nlookups);
-    for (int i = 0; i < 10; ++i) {
-        asm volatile ("");
-        best = std::min(best, bench_single(binsearch, sorted, unsorted, nlookups));
+    std::vector<int> keys(nlookups);
+    for (size_t i = 0; i < nlookups; ++i) {
+        keys[i] = unsorted[i % unsorted.size()];
+    }
+    std::unique_ptr<bool[]> found(new bool[nlookups]);
+    auto stats = benchmark::measure("search_many", {{"n", sorted.size()}}, [&] {
+        search_many(sorted, keys.data(), nlookups, found.get());
+    }, nlookups);
+    double many = stats.min;
+    for (size_t i = 0; i < nlookups; ++i) {
+        if (!found[i]) {
+            std::cout << "Fail search_many" << std::endl;
+        }
     }
-    return double(best) / nlookups;
+    double single = bench_best("search", search, sorted, unsorted).min;
+    std::cout << "Search " << nlookups << " keys in " << sorted.size() << " elements.";
+    std::cout << " One by one " << single << "ns per search.";
+    std::cout << " search_many " << many << "ns per search. Speedup: " << single / many << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
 }
 
-void bench(const std::vector<int>& sorted, const std::vector<int>& unsorted)
+// Position searches against the std:: algorithm doing the same. Keys are a
+// long random sequence: a short one repeated in the same order is learned
+// by the branch predictor and flatters branchy searches
+template <typename F>
+double bench_positions(const std::string& name, const F& bound, const std::vector<int>& sorted, const std::vector<int>& keys)
 {
-    double basic = bench_best(search_stl, sorted, unsorted);
-    double good = bench_best(search, sorted, unsorted);
-    double ratio = basic / good;
-    std::cout << "Search in " << sorted.size() << " elements.";
-    std::cout << " std::binary_search " << basic << "ns per search.";
-    std::cout << " Your " << good << "ns per search. Speedup: " << ratio << std::endl;
-    assert(ratio > 2);
+    return benchmark::measure(name, {{"n", sorted.size()}}, [&] {
+        size_t checksum = 0;
+        for (int key : keys) {
+            checksum += bound(sorted, key);
+        }
+        benchmark::do_not_optimize(checksum);
+    }, keys.size()).min;
+}
+
+void bench_bounds(const std::string& name, const std::vector<int>& sorted, std::mt19937& mt, double min_speedup)
+{
+    std::vector<int> keys(1 << 16);
+    for (auto& key : keys) {
+        key = sorted[mt() % sorted.size()];
+    }
+    auto std_lower = [] (const std::vector<int>& data, int value) {
+        return size_t(std::lower_bound(data.begin(), data.end(), value) - data.begin());
+    };
+    auto std_upper = [] (const std::vector<int>& data, int value) {
+        return size_t(std::upper_bound(data.begin(), data.end(), value) - data.begin());
+    };
+    auto std_range = [] (const std::vector<int>& data, int value) {
+        auto range = std::equal_range(data.begin(), data.end(), value);
+        return size_t((range.first - data.begin()) + (range.second - data.begin()));
+    };
+    auto fast_range = [] (const std::vector<int>& data, int value) {
+        auto range = equal_range(data, value);
+        return range.first + range.second;
+    };
+    double lower_ratio = bench_positions("std::lower_bound " + name, std_lower, sorted, keys)
+        / bench_positions("lower_bound " + name, lower_bound, sorted, keys);
+    double upper_ratio = bench_positions("std::upper_bound " + name, std_upper, sorted, keys)
+        / bench_positions("upper_bound " + name, upper_bound, sorted, keys);
+    double range_ratio = bench_positions("std::equal_range " + name, std_range, sorted, keys)
+        / bench_positions("equal_range " + name, fast_range, sorted, keys);
+    std::cout << "Bounds in " << sorted.size() << " " << name << " elements. Speedup over std::";
+    std::cout << " lower_bound " << lower_ratio << ", upper_bound " << upper_ratio;
+    std::cout << ", equal_range " << range_ratio << std::endl;
+    assert(std::min({lower_ratio, upper_ratio, range_ratio}) > min_speedup);
 }
 
 void test_performance(int n)
@@ -71,6 +201,14 @@ void test_performance(int n)
     }
     std::sort(sdata.begin(), sdata.end());
     bench(sdata, data);
+    bench_many(sdata, data);
+    bench_bounds("distinct", sdata, mt, 1.2);
+    // Runs of 16 equal elements on average
+    for (int i = 0; i < n; ++i) {
+        sdata[i] = static_cast<int>(mt() % (n / 16));
+    }
+    std::sort(sdata.begin(), sdata.end());
+    bench_bounds("duplicate", sdata, mt, 1.2);
 }
 
 void validate(int n)
@@ -93,10 +231,180 @@ void validate(int n)
         int v = mt();
         assert(search(sdata, v) == (map.find(v) != map.end()));
     }
+    std::vector<int> keys = data;
+    for (int i = 0; i < n; ++i) {
+        keys.push_back(mt());
+    }
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    search_many(sdata, keys.data(), keys.size(), found.get());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(found[i] == (map.find(keys[i]) != map.end()));
+    }
+}
+
+// Values are drawn from [0, modulo), so small modulo gives long runs of duplicates
+void validate_bounds(int n, int modulo)
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    std::vector<int> sdata(n);
+    for (int i = 0; i < n; ++i) {
+        sdata[i] = mt() % modulo;
+    }
+    std::sort(sdata.begin(), sdata.end());
+    for (int i = 0; i < 2 * n + 10; ++i) {
+        int v = static_cast<int>(mt() % (modulo + 2)) - 1;
+        size_t first = std::lower_bound(sdata.begin(), sdata.end(), v) - sdata.begin();
+        size_t last = std::upper_bound(sdata.begin(), sdata.end(), v) - sdata.begin();
+        assert(lower_bound(sdata, v) == first);
+        assert(upper_bound(sdata, v) == last);
+        assert(equal_range(sdata, v) == std::make_pair(first, last));
+    }
+}
+
+void validate_index(int n, int modulo)
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    std::vector<int> sdata(n);
+    for (int i = 0; i < n; ++i) {
+        sdata[i] = mt() % modulo;
+    }
+    std::sort(sdata.begin(), sdata.end());
+    // Node 0 exists on every machine, NUMA or not
+    EytzingerIndex index(sdata, 0);
+    LearnedIndex learned_index(sdata);
+    assert(index.size() == sdata.size());
+    assert(learned_index.size() == sdata.size());
+    for (int i = 0; i < 2 * n + 10; ++i) {
+        int v = static_cast<int>(mt() % (modulo + 2)) - 1;
+        size_t expected = std::lower_bound(sdata.begin(), sdata.end(), v) - sdata.begin();
+        bool found = std::binary_search(sdata.begin(), sdata.end(), v);
+        assert(index.lower_bound(v) == expected);
+        assert(index.contains(v) == found);
+        assert(learned_index.lower_bound(v) == expected);
+        assert(learned_index.contains(v) == found);
+    }
+}
+
+// The mapped copy of a saved index answers like the one it was saved from
+void validate_index_file(int n, int modulo)
+{
+    std::mt19937 mt(std::random_device{}());
+    std::vector<int> sdata(n);
+    for (auto& v : sdata) {
+        v = mt() % modulo;
+    }
+    std::sort(sdata.begin(), sdata.end());
+    char path[] = "/tmp/learned_index_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    LearnedIndex(sdata).save(path);
+    LearnedIndex mapped = LearnedIndex::open(path);
+    unlink(path);
+    assert(mapped.size() == sdata.size());
+    assert(std::equal(sdata.begin(), sdata.end(), mapped.data()));
+    // Sections are cache line aligned in the file, the mapping is page aligned
+    assert(reinterpret_cast<uintptr_t>(mapped.data()) % 64 == 0);
+    for (int i = 0; i < 2 * n + 10; ++i) {
+        int v = static_cast<int>(mt() % (modulo + 2)) - 1;
+        size_t expected = std::lower_bound(sdata.begin(), sdata.end(), v) - sdata.begin();
+        assert(mapped.lower_bound(v) == expected);
+        assert(mapped.contains(v) == std::binary_search(sdata.begin(), sdata.end(), v));
+    }
+}
+
+void validate_index_file_errors()
+{
+    char path[] = "/tmp/learned_index_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    auto expect_throw = [&] {
+        bool thrown = false;
+        try {
+            LearnedIndex::open(path);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    };
+    std::vector<int> sdata(1 << 12);
+    std::iota(sdata.begin(), sdata.end(), 0);
+    LearnedIndex(sdata).save(path);
+    // Cut in the middle of the keys
+    assert(truncate(path, 1 << 12) == 0);
+    expect_throw();
+    std::FILE * file = std::fopen(path, "wb");
+    std::fputs("not an index, just text", file);
+    std::fclose(file);
+    expect_throw();
+    unlink(path);
+    expect_throw();
+}
+
+// Sorted set of about n distinct values below modulo
+std::vector<int> generate_set(size_t n, int modulo, std::mt19937& mt)
+{
+    std::vector<int> data(n);
+    for (auto& v : data) {
+        v = mt() % modulo;
+    }
+    std::sort(data.begin(), data.end());
+    data.erase(std::unique(data.begin(), data.end()), data.end());
+    return data;
+}
+
+void validate_intersect(size_t a_size, size_t b_size, int modulo)
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    std::vector<int> a = generate_set(a_size, modulo, mt);
+    std::vector<int> b = generate_set(b_size, modulo, mt);
+    std::vector<int> expected;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+    for (int swap = 0; swap < 2; ++swap) {
+        std::vector<int> result(std::min(a.size(), b.size()));
+        assert(intersect_count(a, b) == expected.size());
+        size_t count = intersect(a, b, result.data());
+        result.resize(count);
+        assert(result == expected);
+        std::swap(a, b);
+    }
 }
 
 void test_correctness()
 {
+    for (int i = 0; i < 300; ++i) {
+        validate_index(i, 2 * i + 1);
+        validate_index(i, 1 << 30);
+    }
+    validate_index(1 << 16, 1 << 10);
+    validate_index(1 << 20, 1 << 30);
+    for (int i = 0; i < 300; i += 7) {
+        validate_index_file(i, 2 * i + 1);
+    }
+    validate_index_file(1 << 16, 1 << 10);
+    validate_index_file(1 << 20, 1 << 30);
+    validate_index_file_errors();
+    for (int i = 0; i < 300; ++i) {
+        validate_bounds(i, 2 * i + 1);
+        validate_bounds(i, 1 << 30);
+    }
+    validate_bounds(1 << 16, 1 << 6);
+    validate_bounds(1 << 20, 1 << 30);
+    benchmark::for_each_isa([] (Isa) {
+        for (size_t i = 0; i < 100; ++i) {
+            validate_intersect(i, i, 2 * i + 1);
+            validate_intersect(i, 3 * i + 5, 4 * i + 8);
+            validate_intersect(i, 100 * i, 100 * i + 1);
+        }
+        validate_intersect(1 << 16, 1 << 16, 1 << 17);
+        validate_intersect(1 << 16, 1 << 20, 1 << 22);
+        validate_intersect(1 << 16, 1 << 16, 1 << 30);
+    });
+
     for (int i = 0; i < 20; ++i) {
         validate(1<<i);
     }
@@ -111,8 +419,217 @@ void test_performance()
     std::cout << "test_performance PASSED" << std::endl; 
 }
 
-int main()
+void test_performance_index()
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    for (int i = 16; i <= 26; i += 2) {
+        std::vector<int> uniform(1<<i);
+        for (auto& v : uniform) {
+            v = mt();
+        }
+        bench_index("uniform", uniform);
+        bench_index("lognormal", generate_lognormal(1<<i, mt));
+        bench_index("clustered", generate_clustered(1<<i, mt));
+    }
+    std::cout << "test_performance_index PASSED" << std::endl;
+}
+
+constexpr std::chrono::milliseconds INTERSECT_MIN_RUN(1);
+
+// Intersection of a small set with a large one, the small one is large / ratio.
+// Half of the small set is drawn from the large one
+void bench_intersect(size_t large_size, size_t ratio, std::mt19937& mt)
+{
+    std::vector<int> large = generate_set(large_size, 1 << 30, mt);
+    std::vector<int> small = generate_set(large_size / ratio / 2, 1 << 30, mt);
+    for (size_t i = 0; i < large_size / ratio / 2; ++i) {
+        small.push_back(large[mt() % large.size()]);
+    }
+    std::sort(small.begin(), small.end());
+    small.erase(std::unique(small.begin(), small.end()), small.end());
+    std::vector<int> out(small.size());
+
+    benchmark::Params params = {{"large", large.size()}, {"small", small.size()}};
+    // Median of one call in microseconds. A call at a high ratio takes a few
+    // microseconds, a timer hiccup would be most of it: each measured run
+    // repeats the call until it lasts INTERSECT_MIN_RUN
+    auto median_of = [&] (const std::string& name, const auto& run) {
+        size_t repeats = 1;
+        for (;;) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < repeats; ++i) {
+                benchmark::do_not_optimize(run());
+            }
+            if (std::chrono::steady_clock::now() - start >= INTERSECT_MIN_RUN) {
+                break;
+            }
+            repeats *= 2;
+        }
+        auto repeated = [&] {
+            for (size_t i = 0; i < repeats; ++i) {
+                benchmark::do_not_optimize(run());
+            }
+        };
+        return benchmark::measure(name, params, repeated, repeats).median / 1000;
+    };
+    double one_by_one = median_of("search() one by one", [&] {
+        size_t count = 0;
+        for (int v : small) {
+            count += search(large, v);
+        }
+        return count;
+    });
+    double stl = median_of("std::set_intersection", [&] {
+        return size_t(std::set_intersection(small.begin(), small.end(), large.begin(), large.end(), out.begin()) - out.begin());
+    });
+    double counted = median_of("intersect_count", [&] { return intersect_count(small, large); });
+    double materialized = median_of("intersect", [&] { return intersect(small, large, out.data()); });
+    std::cout << "Intersect " << small.size() << " with " << large.size() << " elements (1:" << ratio << ").";
+    std::cout << " search() one by one " << one_by_one << "us.";
+    std::cout << " std::set_intersection " << stl << "us.";
+    std::cout << " intersect_count " << counted << "us. intersect " << materialized << "us.";
+    std::cout << " Speedup: " << std::min(one_by_one, stl) / materialized << std::endl;
+    // When sizes differ a lot, intersect searches like search() does and is
+    // on par with calling it one by one. Bounds sit about 20% under the
+    // lowest medians seen over repeated runs
+    assert(stl / materialized > 1.1);
+    if (ratio <= 10) {
+        assert(std::min(one_by_one, stl) / materialized > 1.5);
+    } else {
+        assert(one_by_one / materialized > 0.75);
+    }
+}
+
+void test_performance_intersect()
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    for (size_t ratio : {1, 3, 10, 30, 100, 300, 1000, 3000, 10000}) {
+        bench_intersect(1 << 20, ratio, mt);
+    }
+    std::cout << "test_performance_intersect PASSED" << std::endl;
+}
+
+// Cold start of a worker: sorting the keys and building the index against
+// mapping a saved one, then lookups on the mapping against the heap copy
+void bench_index_file(size_t n, std::mt19937& mt)
+{
+    std::vector<int> unsorted(n);
+    for (auto& v : unsorted) {
+        v = mt();
+    }
+    char path[] = "/tmp/learned_index_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    auto build = benchmark::measure("LearnedIndex sort and build", {{"n", n}}, [&] {
+        std::vector<int> sorted = unsorted;
+        std::sort(sorted.begin(), sorted.end());
+        LearnedIndex index(sorted);
+        benchmark::do_not_optimize(index.segments());
+    });
+    std::vector<int> sorted = unsorted;
+    std::sort(sorted.begin(), sorted.end());
+    LearnedIndex heap(sorted);
+    heap.save(path);
+    auto open = benchmark::measure("LearnedIndex open", {{"n", n}}, [&] {
+        LearnedIndex index = LearnedIndex::open(path);
+        benchmark::do_not_optimize(index.contains(unsorted[0]));
+    });
+    LearnedIndex mapped = LearnedIndex::open(path);
+    unlink(path);
+    auto lookups = [&] (const std::string& name, const LearnedIndex& index) {
+        return benchmark::measure(name, {{"n", n}}, [&] {
+            size_t found = 0;
+            for (int v : unsorted) {
+                found += index.contains(v);
+            }
+            benchmark::do_not_optimize(found);
+        }, n);
+    };
+    auto heap_stats = lookups("LearnedIndex search heap", heap);
+    auto mapped_stats = lookups("LearnedIndex search mapped", mapped);
+    std::cout << "Started an index of " << n << " elements. Sorted and built in " << build.min / 1e6
+              << "ms, opened in " << open.min / 1e3 << "us. Speedup: " << build.min / open.min << ".";
+    std::cout << " Search " << heap_stats.min << "ns on the heap, " << mapped_stats.min << "ns mapped.";
+    std::cout << benchmark::format_counters(mapped_stats, "mapped search") << std::endl;
+    assert(build.min / open.min > 10);
+    assert(mapped_stats.min < 2 * heap_stats.min);
+}
+
+void test_performance_index_file()
+{
+    std::mt19937 mt(std::random_device{}());
+    for (int i = 20; i <= 24; i += 2) {
+        bench_index_file(1 << i, mt);
+    }
+    std::cout << "test_performance_index_file PASSED" << std::endl;
+}
+
+// Random lower_bound probes over the same sorted array on 4 KB and on 2 MB
+// pages. The array is far larger than the TLB reach of 4 KB pages, so the
+// difference is the page walks
+void bench_huge_pages(size_t n, std::mt19937& mt)
+{
+    std::vector<int> small_pages(n);
+    for (auto& v : small_pages) {
+        v = mt();
+    }
+    std::sort(small_pages.begin(), small_pages.end());
+    size_t huge_before = transparent_huge_page_bytes();
+    HugeVector<int> huge_pages(small_pages.begin(), small_pages.end());
+    size_t huge_bytes = transparent_huge_page_bytes() - std::min(huge_before, transparent_huge_page_bytes());
+    std::vector<int> keys(1 << 20);
+    for (auto& key : keys) {
+        key = small_pages[mt() % n];
+    }
+
+    auto run = [&] (const std::string& name, const int * data) {
+        return benchmark::measure(name, {{"n", n}}, [&] {
+            size_t checksum = 0;
+            for (int key : keys) {
+                checksum += std::lower_bound(data, data + n, key) - data;
+            }
+            benchmark::do_not_optimize(checksum);
+        }, keys.size());
+    };
+    auto small = run("lower_bound 4 KB pages", small_pages.data());
+    auto huge = run("lower_bound 2 MB pages", huge_pages.data());
+    double small_ns = small.min, huge_ns = huge.min;
+    std::cout << "Lower bound in " << n << " elements (" << (huge_bytes >> 20) << " MB on huge pages).";
+    std::cout << " 4 KB pages " << small_ns << "ns, 2 MB pages " << huge_ns << "ns per search.";
+    if (huge.has_counter("dTLB misses")) {
+        std::cout << " dTLB misses per search " << small.counter("dTLB misses") << " vs " << huge.counter("dTLB misses") << ".";
+    }
+    std::cout << " Speedup: " << small_ns / huge_ns << std::endl;
+    // Without huge pages from the kernel both runs are the same memory. Under
+    // a hypervisor that maps guest memory with 4 KB pages the TLB still holds
+    // 4 KB translations, so only a regression is an error
+    if (huge_bytes >= n * sizeof(int) / 2) {
+        assert(small_ns / huge_ns > 0.9);
+    }
+}
+
+void test_performance_huge_pages()
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    // Not powers of two: bisection over a power of two array on physically
+    // contiguous memory hits the same cache sets at every level
+    for (int i = 21; i <= 25; i += 2) {
+        bench_huge_pages(3 << i, mt);
+    }
+    std::cout << "test_performance_huge_pages PASSED" << std::endl;
+}
+
+int main(int argc, char** argv)
 {
+    benchmark::init(argc, argv);
     test_correctness();
     test_performance();
+    test_performance_index();
+    test_performance_index_file();
+    test_performance_intersect();
+    test_performance_huge_pages();
 }
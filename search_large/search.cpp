@@ -1,55 +1,34 @@
 #include "search.h"
 #include <cstdint>
+#include <algorithm>
 #include <iostream>
-
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <immintrin.h>
 
-#define _i_vec_t        __m256i
-#define _i_init_vec     _mm256_set1_epi32
-#define _i_cmpeq_vec    _mm256_cmpeq_epi32
-#define _i_cast_vec     _mm256_movemask_epi8
-
-constexpr uint16_t INTS_IN_VEC_INT = sizeof(_i_vec_t) / sizeof(int);
-
-bool search_small(const int * data, uint16_t size, int value)
-{
-    const _i_vec_t * _vec_data  = reinterpret_cast< const _i_vec_t * > ( data );
-    const _i_vec_t   _vec_value = _i_init_vec( value );
-
-    for (   uint16_t n_checked = 0;
-            n_checked < size;
-            n_checked += INTS_IN_VEC_INT, _vec_data += 1  // shift pointer to the next element
-    ) {
-        // WARNING! Would cause out of bounds for INTS_IN_VEC_INT bytes for some inputs, but we don't care
-        if ( _i_cast_vec( _i_cmpeq_vec( *_vec_data, _vec_value ) ) == 0 ) {
-            continue;  // likely
-        } else {
-            return true;
-        }
-    }
-    return false;
-}
-
+#include "simd_scan.h"
 
 constexpr uint32_t LINE_SEARCH_SIZE = 1 << 6;
 
 
-bool search(const std::vector<int> & vec, int value)
+// Gallop and bisection of search() from guess_idx on, with the scan kernel as
+// a parameter so that loops over many searches pick it once. The scanned
+// range starts at *at
+static bool search_from(SearchSmall kernel, const int * data, int64_t size, int64_t guess_idx, int value, int64_t * at)
 {
-    const int * data = vec.data();
-    int64_t size = static_cast<int64_t>(vec.size());
-
-    int64_t lower = vec.front();
-    int64_t upper = vec.back();
-    if (value < lower || value > upper) { return false; }
-    if (lower == upper) { return value == lower; }
-    if (value == upper) { return true; }
-    int64_t guess_idx = (size * (value - lower)) / (upper - lower);
-
     // Try to guess the best index
     int64_t rng = 2;
-    upper = guess_idx;
-    lower = guess_idx;
+    int64_t upper = guess_idx;
+    int64_t lower = guess_idx;
     if (data[guess_idx] > value)
     {
         while (data[lower] > value)
@@ -86,7 +65,64 @@ bool search(const std::vector<int> & vec, int value)
         }
     }
 
-    return search_small(data + lower, upper - lower, value);
+    *at = lower;
+    return search_small(kernel, data + lower, upper - lower, value);
+}
+
+bool search(const std::vector<int> & vec, int value)
+{
+    const int * data = vec.data();
+    int64_t size = static_cast<int64_t>(vec.size());
+
+    int64_t lower = vec.front();
+    int64_t upper = vec.back();
+    if (value < lower || value > upper) { return false; }
+    if (lower == upper) { return value == lower; }
+    if (value == upper) { return true; }
+    int64_t guess_idx = (size * (value - lower)) / (upper - lower);
+    int64_t at = 0;
+    return search_from(search_small_kernel.get(), data, size, guess_idx, value, &at);
+}
+
+
+
+constexpr size_t BATCH_SIZE = 32;
+
+// Branchless lower_bound for up to BATCH_SIZE keys advancing in lockstep:
+// all searches over one array take the same number of halving steps, so
+// the probes of one step are independent loads and their misses overlap
+static void lower_bound_batch(const int * data, size_t size, const int * keys, size_t count, size_t * out)
+{
+    const int * base[BATCH_SIZE];
+    for (size_t i = 0; i < count; ++i) {
+        base[i] = data;
+    }
+    size_t len = size;
+    while (len > 1) {
+        size_t half = len / 2;
+        size_t next_half = (len - half) / 2;
+        for (size_t i = 0; i < count; ++i) {
+            base[i] += (base[i][half - 1] < keys[i]) * half;
+            // Issue the next probe of this search while the others compute
+            __builtin_prefetch(base[i] + next_half - 1);
+        }
+        len -= half;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = (base[i] - data) + (size > 0 && *base[i] < keys[i]);
+    }
+}
+
+void search_many(const std::vector<int>& vec, const int * keys, size_t n, bool * out)
+{
+    size_t pos[BATCH_SIZE];
+    for (size_t start = 0; start < n; start += BATCH_SIZE) {
+        size_t count = std::min(BATCH_SIZE, n - start);
+        lower_bound_batch(vec.data(), vec.size(), keys + start, count, pos);
+        for (size_t i = 0; i < count; ++i) {
+            out[start + i] = pos[i] < vec.size() && vec[pos[i]] == keys[start + i];
+        }
+    }
 }
 
 
@@ -177,3 +213,582 @@ bool search(const std::vector<int> & vec, int value)
 
 //     return search_small(vec.data() + lower, static_cast<uint8_t>(upper - lower + 1), value);
 // }
+
+
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+// Nodes 4 levels down from k are 16k..16k+15, one cache line
+constexpr size_t PREFETCH_STRIDE = CACHE_LINE_SIZE / sizeof(int);
+
+static_assert(HUGE_PAGE_HEAP_ALIGN % CACHE_LINE_SIZE == 0, "The tree must start a cache line");
+
+EytzingerIndex::EytzingerIndex(const std::vector<int>& sorted, int numa_node)
+    : size_(sorted.size())
+    , tree_(size_ + 1, HugePageAllocator<int>(numa_node))
+    , rank_(size_ + 1, HugePageAllocator<uint32_t>(numa_node))
+{
+    build(sorted, 0, 1);
+}
+
+// In-order traversal of the implicit tree assigns sorted elements to nodes
+size_t EytzingerIndex::build(const std::vector<int>& sorted, size_t idx, size_t node)
+{
+    if (node <= size_) {
+        idx = build(sorted, idx, 2 * node);
+        tree_[node] = sorted[idx];
+        rank_[node] = static_cast<uint32_t>(idx);
+        idx = build(sorted, idx + 1, 2 * node + 1);
+    }
+    return idx;
+}
+
+size_t EytzingerIndex::lower_bound_node(int value) const
+{
+    const int * tree = tree_.data();
+    size_t node = 1;
+    while (node <= size_) {
+        // Prefetching past the end is harmless
+        __builtin_prefetch(tree + node * PREFETCH_STRIDE);
+        node = 2 * node + (tree[node] < value);
+    }
+    // The answer is the last node where the descent turned left (bit 0):
+    // shift out the trailing right turns (bits 1) and that left turn
+    node >>= __builtin_ffsll(~node);
+    return node;
+}
+
+bool EytzingerIndex::contains(int value) const
+{
+    size_t node = lower_bound_node(value);
+    return node != 0 && tree_[node] == value;
+}
+
+size_t EytzingerIndex::lower_bound(int value) const
+{
+    size_t node = lower_bound_node(value);
+    return node != 0 ? rank_[node] : size_;
+}
+
+
+
+// The search windows of LearnedIndex are a few cache lines, these plain
+// loops are vectorized by the compiler and stay within bounds
+static size_t count_less(const int * data, size_t size, int value)
+{
+    uint32_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += data[i] < value;
+    }
+    return count;
+}
+
+static size_t count_not_greater(const int * data, size_t size, int value)
+{
+    uint32_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += data[i] <= value;
+    }
+    return count;
+}
+
+// Segments the learned index keeps at the root, scanned linearly
+constexpr size_t ROOT_SIZE = 64;
+
+LearnedIndex::LearnedIndex(const std::vector<int>& sorted, int numa_node)
+    : data_storage_(sorted.begin(), sorted.end(), HugePageAllocator<int>(numa_node))
+{
+    data_ = data_storage_.data();
+    size_ = data_storage_.size();
+    // Duplicates are represented by their first position, lower_bound of the key
+    std::vector<int> keys;
+    std::vector<uint32_t> positions;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (i == 0 || sorted[i] != sorted[i - 1]) {
+            keys.push_back(sorted[i]);
+            positions.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    size_t epsilon = EPSILON;
+    while (!keys.empty()) {
+        level_storage_.push_back(build_level(keys, positions, epsilon));
+        keys = level_storage_.back().keys;
+        if (keys.size() <= ROOT_SIZE) {
+            break;
+        }
+        positions.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            positions[i] = static_cast<uint32_t>(i);
+        }
+        epsilon = EPSILON_INTERNAL;
+    }
+    for (const LevelStorage& level : level_storage_) {
+        levels_.push_back({level.keys.data(), level.models.data(), level.keys.size()});
+    }
+}
+
+// Greedy shrinking cone: a segment is anchored at its first point and grows
+// while some slope keeps every point within epsilon of its position
+LearnedIndex::LevelStorage LearnedIndex::build_level(const std::vector<int>& keys, const std::vector<uint32_t>& positions, size_t epsilon)
+{
+    LevelStorage level;
+    auto close_segment = [&] (size_t start, size_t end, double slope) {
+        Model model{slope, positions[start], 0};
+        for (size_t i = start; i < end; ++i) {
+            // Same arithmetic as the lookup, so the error bound is exact
+            int64_t predicted = model.intercept + static_cast<int64_t>(slope * (int64_t(keys[i]) - keys[start]));
+            int64_t error = std::abs(predicted - int64_t(positions[i]));
+            model.max_error = std::max(model.max_error, static_cast<uint32_t>(error));
+        }
+        level.keys.push_back(keys[start]);
+        level.models.push_back(model);
+    };
+
+    size_t start = 0;
+    double slope_lo = 0, slope_hi = std::numeric_limits<double>::infinity();
+    for (size_t i = 1; i < keys.size(); ++i) {
+        double dx = double(keys[i]) - double(keys[start]);
+        double dy = double(positions[i]) - double(positions[start]);
+        double lo = std::max(slope_lo, (dy - epsilon) / dx);
+        double hi = std::min(slope_hi, (dy + epsilon) / dx);
+        if (lo > hi) {
+            close_segment(start, i, i - start > 1 ? (slope_lo + slope_hi) / 2 : 0);
+            start = i;
+            slope_lo = 0;
+            slope_hi = std::numeric_limits<double>::infinity();
+        } else {
+            slope_lo = lo;
+            slope_hi = hi;
+        }
+    }
+    if (!keys.empty()) {
+        close_segment(start, keys.size(), keys.size() - start > 1 ? (slope_lo + slope_hi) / 2 : 0);
+    }
+    return level;
+}
+
+// Positions [lo, hi) where segment seg of level places value, widened by the
+// segment error and clamped to the segment. size is the number of positions
+std::pair<size_t, size_t> LearnedIndex::window(size_t level, size_t seg, size_t size, int value) const
+{
+    const Level& segments = levels_[level];
+    const Model& model = segments.models[seg];
+    int64_t end = seg + 1 < segments.size ? segments.models[seg + 1].intercept : size;
+    int64_t predicted = model.intercept + static_cast<int64_t>(model.slope * (int64_t(value) - segments.keys[seg]));
+    predicted = std::clamp<int64_t>(predicted, model.intercept, end);
+    size_t lo = std::max<int64_t>(predicted - model.max_error, model.intercept);
+    size_t hi = std::min<int64_t>({predicted + model.max_error + 2, end + 1, int64_t(size)});
+    return {lo, hi};
+}
+
+size_t LearnedIndex::find_segment(size_t level, int value) const
+{
+    const Level& segments = levels_[level];
+    size_t lo = 0, hi = segments.size;
+    if (level + 1 < levels_.size()) {
+        std::tie(lo, hi) = window(level + 1, find_segment(level + 1, value), segments.size, value);
+    }
+    // Segment keys are distinct, so the window holds the first key > value
+    size_t count = lo + count_not_greater(segments.keys + lo, hi - lo, value);
+    return count == 0 ? 0 : count - 1;
+}
+
+size_t LearnedIndex::lower_bound(int value) const
+{
+    if (levels_.empty()) {
+        return 0;
+    }
+    const int * data = data_;
+    size_t size = size_;
+    auto [lo, hi] = window(0, find_segment(0, value), size, value);
+    size_t pos = lo + count_less(data + lo, hi - lo, value);
+    if (pos == hi && hi < size && data[hi] < value) {
+        // Only after a run of duplicates longer than the error: positions of
+        // the models are first occurrences, gallop over the rest of the run
+        size_t step = 1;
+        while (hi + step < size && data[hi + step] < value) {
+            step <<= 1;
+        }
+        pos = std::lower_bound(data + hi + step / 2, data + std::min(hi + step, size), value) - data;
+    }
+    return pos;
+}
+
+bool LearnedIndex::contains(int value) const
+{
+    size_t pos = lower_bound(value);
+    return pos < size_ && data_[pos] == value;
+}
+
+// LearnedIndex file: an IndexFileHeader and an IndexFileLevel per level, then
+// the sorted keys, then the segment keys and models of every level, host byte
+// order. Every section starts on a cache line at its offset in the file, so
+// the mapping serves aligned vector loads as the heap copy does
+struct alignas(64) IndexFileHeader
+{
+    char magic[8];
+    uint64_t size;
+    uint64_t data_offset;
+    uint32_t levels;
+};
+
+struct IndexFileLevel
+{
+    uint64_t keys_offset;
+    uint64_t models_offset;
+    uint64_t size;
+};
+
+constexpr char INDEX_FILE_MAGIC[8] = {'L', 'R', 'N', 'I', 'D', 'X', '0', '1'};
+// Far more than 2^32 keys ever need with ROOT_SIZE at the top
+constexpr uint32_t INDEX_FILE_MAX_LEVELS = 64;
+
+static uint64_t index_file_align(uint64_t offset)
+{
+    return (offset + CACHE_LINE_SIZE - 1) & ~uint64_t(CACHE_LINE_SIZE - 1);
+}
+
+void LearnedIndex::save(const std::string& path) const
+{
+    IndexFileHeader header = {};
+    std::memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.size = size_;
+    header.levels = static_cast<uint32_t>(levels_.size());
+    std::vector<IndexFileLevel> table(levels_.size());
+    uint64_t offset = index_file_align(sizeof(header) + table.size() * sizeof(IndexFileLevel));
+    header.data_offset = offset;
+    offset = index_file_align(offset + size_ * sizeof(int));
+    for (size_t i = 0; i < levels_.size(); ++i) {
+        table[i].size = levels_[i].size;
+        table[i].keys_offset = offset;
+        offset = index_file_align(offset + levels_[i].size * sizeof(int));
+        table[i].models_offset = offset;
+        offset = index_file_align(offset + levels_[i].size * sizeof(Model));
+    }
+
+    // Written next to path and renamed over it, readers never map a partial file
+    std::string temporary = path + ".tmp";
+    std::FILE * file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("Cannot create index " + temporary);
+    }
+    uint64_t written = 0;
+    bool ok = true;
+    auto write = [&] (uint64_t at, const void * bytes, size_t size) {
+        static const char ZEROS[CACHE_LINE_SIZE] = {};
+        ok = ok && std::fwrite(ZEROS, 1, at - written, file) == at - written &&
+             std::fwrite(bytes, 1, size, file) == size;
+        written = at + size;
+    };
+    write(0, &header, sizeof(header));
+    write(sizeof(header), table.data(), table.size() * sizeof(IndexFileLevel));
+    write(header.data_offset, data_, size_ * sizeof(int));
+    for (size_t i = 0; i < levels_.size(); ++i) {
+        write(table[i].keys_offset, levels_[i].keys, levels_[i].size * sizeof(int));
+        write(table[i].models_offset, levels_[i].models, levels_[i].size * sizeof(Model));
+    }
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Cannot write index " + path);
+    }
+}
+
+LearnedIndex LearnedIndex::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open index " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(IndexFileHeader)) {
+        ::close(fd);
+        throw std::runtime_error("Not an index " + path);
+    }
+    size_t length = st.st_size;
+    void * mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Cannot map index " + path);
+    }
+    LearnedIndex index;
+    index.mapping_ = std::shared_ptr<const void>(mapped, [length] (const void * ptr) {
+        munmap(const_cast<void*>(ptr), length);
+    });
+    const char * bytes = static_cast<const char*>(mapped);
+    // Sections must be aligned and inside the file, their content is trusted
+    auto section = [&] (uint64_t offset, uint64_t count, size_t item) -> const char * {
+        if (offset % CACHE_LINE_SIZE != 0 || offset > length || count > (length - offset) / item) {
+            throw std::runtime_error("Corrupt index " + path);
+        }
+        return bytes + offset;
+    };
+    const IndexFileHeader * header = reinterpret_cast<const IndexFileHeader*>(bytes);
+    if (std::memcmp(header->magic, INDEX_FILE_MAGIC, sizeof(INDEX_FILE_MAGIC)) != 0 ||
+        header->levels > INDEX_FILE_MAX_LEVELS) {
+        throw std::runtime_error("Not an index " + path);
+    }
+    const IndexFileLevel * table = reinterpret_cast<const IndexFileLevel*>(
+        section(0, sizeof(IndexFileHeader) + header->levels * sizeof(IndexFileLevel), 1) + sizeof(IndexFileHeader));
+    index.size_ = header->size;
+    index.data_ = reinterpret_cast<const int*>(section(header->data_offset, header->size, sizeof(int)));
+    for (uint32_t i = 0; i < header->levels; ++i) {
+        index.levels_.push_back({
+            reinterpret_cast<const int*>(section(table[i].keys_offset, table[i].size, sizeof(int))),
+            reinterpret_cast<const Model*>(section(table[i].models_offset, table[i].size, sizeof(Model))),
+            table[i].size,
+        });
+    }
+    // Every lookup is a handful of random lines
+    madvise(mapped, length, MADV_RANDOM);
+    return index;
+}
+
+
+
+// Elements before the answer: less than value for lower_bound, not greater for upper_bound
+template <bool UPPER>
+static size_t count_before(const int * data, size_t size, int value)
+{
+    return UPPER ? count_not_greater(data, size, value) : count_less(data, size, value);
+}
+
+// The same interpolation guess, gallop and bisection as search(), but exact
+// about where a run of value starts (lower_bound) or ends (upper_bound)
+template <bool UPPER>
+static size_t interpolation_bound(const int * data, size_t size, int value)
+{
+    auto before = [value] (int x) { return UPPER ? x <= value : x < value; };
+    if (size == 0 || !before(data[0])) {
+        return 0;
+    }
+    if (before(data[size - 1])) {
+        return size;
+    }
+    // Here before(data[0]) and !before(data[size - 1]), so data[0] < data[size - 1]
+    int64_t first = data[0], last = data[size - 1];
+    int64_t guess = (static_cast<int64_t>(size - 1) * (value - first)) / (last - first);
+
+    // Gallop away from the guess until before(data[lower]) and !before(data[upper])
+    int64_t lower = guess, upper = guess;
+    int64_t step = 2;
+    if (before(data[guess])) {
+        while (before(data[upper])) {
+            lower = upper;
+            if (upper + step < static_cast<int64_t>(size) - 1) {
+                upper += step;
+                step <<= 1;
+            } else {
+                upper = size - 1;
+            }
+        }
+    } else {
+        while (!before(data[lower])) {
+            upper = lower;
+            if (lower > step) {
+                lower -= step;
+                step <<= 1;
+            } else {
+                lower = 0;
+            }
+        }
+    }
+
+    while (lower + LINE_SEARCH_SIZE < upper) {
+        int64_t mid = (upper + lower) >> 1;
+        if (before(data[mid])) {
+            lower = mid;
+        } else {
+            upper = mid;
+        }
+    }
+    return lower + 1 + count_before<UPPER>(data + lower + 1, upper - lower - 1, value);
+}
+
+size_t lower_bound(const std::vector<int>& vec, int value)
+{
+    return interpolation_bound<false>(vec.data(), vec.size(), value);
+}
+
+size_t upper_bound(const std::vector<int>& vec, int value)
+{
+    return interpolation_bound<true>(vec.data(), vec.size(), value);
+}
+
+constexpr size_t EQUAL_RUN_SCAN_SIZE = 32;
+
+std::pair<size_t, size_t> equal_range(const std::vector<int>& vec, int value)
+{
+    const int * data = vec.data();
+    size_t size = vec.size();
+    size_t first = interpolation_bound<false>(data, size, value);
+    // Most runs end within a few vectors of their start, count them directly
+    size_t window = std::min(EQUAL_RUN_SCAN_SIZE, size - first);
+    size_t last = first + count_not_greater(data + first, window, value);
+    if (last == first + window && last < size) {
+        // A long run: gallop to bracket its end
+        size_t step = 1;
+        while (last + step < size && data[last + step] <= value) {
+            step <<= 1;
+        }
+        size_t from = last + step / 2;
+        last = from + interpolation_bound<true>(data + from, std::min(last + step, size) - from, value);
+    }
+    return {first, last};
+}
+
+
+
+// Search instead of merging when one set is this many times larger than the other
+constexpr size_t SEARCH_RATIO = 64;
+
+template <bool MATERIALIZE>
+static size_t intersect_merge_scalar(const int * a, size_t a_size, const int * b, size_t b_size, int * out)
+{
+    size_t count = 0;
+    size_t i = 0, j = 0;
+    while (i < a_size && j < b_size) {
+        if (a[i] == b[j]) {
+            if (MATERIALIZE) {
+                out[count] = a[i];
+            }
+            ++count;
+        }
+        int a_value = a[i], b_value = b[j];
+        i += a_value <= b_value;
+        j += b_value <= a_value;
+    }
+    return count;
+}
+
+// Lookups of the small set are prefetched this many elements ahead
+constexpr size_t INTERSECT_PREFETCH = 8;
+
+// Elements of the small set are looked up one after another with the
+// interpolation guess and gallop of search(). On uniform keys a guess is off
+// by about sqrt(size) positions, but neighbouring keys are off by nearly the
+// same amount, the keys drift away from a straight line slowly. So each
+// guess is moved by how far the previous search landed from its own guess,
+// and the gallop starts a few steps shorter. The bounds of large are the
+// same for every search, so a guess is a multiply by a precomputed scale,
+// and the scan kernel is picked once. Chained this way the searches no
+// longer overlap their misses, the guess a few elements ahead is prefetched
+template <bool MATERIALIZE>
+static size_t intersect_search(const int * small, size_t small_size, const int * large, size_t large_size, int * out)
+{
+    if (large_size == 0) {
+        return 0;
+    }
+    SearchSmall kernel = search_small_kernel.get();
+    int64_t size = static_cast<int64_t>(large_size);
+    int64_t lower = large[0], upper = large[large_size - 1];
+    double scale = static_cast<double>(size) / std::max<int64_t>(upper - lower, 1);
+    auto guess = [lower, scale] (int value) { return static_cast<int64_t>((value - lower) * scale); };
+    // Where the previous search landed relative to its guess
+    int64_t drift = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < small_size; ++i) {
+        int value = small[i];
+        if (value > upper) {
+            break;
+        }
+        if (i + INTERSECT_PREFETCH < small_size) {
+            __builtin_prefetch(large + std::clamp<int64_t>(guess(small[i + INTERSECT_PREFETCH]) + drift, 0, size - 1));
+        }
+        if (value < lower) {
+            continue;
+        }
+        int64_t guess_idx = guess(value);
+        int64_t at = guess_idx;
+        bool found = value == upper
+            || search_from(kernel, large, size, std::clamp<int64_t>(guess_idx + drift, 0, size - 1), value, &at);
+        drift = at - guess_idx;
+        if (found) {
+            if (MATERIALIZE) {
+                out[count] = value;
+            }
+            ++count;
+        }
+    }
+    return count;
+}
+
+// COMPRESS[mask] moves the lanes selected by mask to the front
+struct CompressTable {
+    alignas(32) int idx[256][8];
+
+    constexpr CompressTable() : idx() {
+        for (int mask = 0; mask < 256; ++mask) {
+            int lane = 0;
+            for (int bit = 0; bit < 8; ++bit) {
+                if (mask & (1 << bit)) {
+                    idx[mask][lane++] = bit;
+                }
+            }
+        }
+    }
+};
+static constexpr CompressTable COMPRESS;
+
+// Blocks of 8 from both sets are compared all against all: b is rotated
+// through every lane, so the OR of 8 equality masks marks the lanes of a
+// present in the block of b. The block with the smaller maximum is consumed,
+// both on a tie
+template <bool MATERIALIZE>
+__attribute__((target("avx2,popcnt")))
+static size_t intersect_merge_avx2(const int * a, size_t a_size, const int * b, size_t b_size, int * out)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m256i) / sizeof(int);
+    const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    size_t count = 0;
+    size_t i = 0, j = 0;
+    while (i + INTS_IN_VEC <= a_size && j + INTS_IN_VEC <= b_size) {
+        __m256i vec_a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vec_b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        __m256i found = _mm256_cmpeq_epi32(vec_a, vec_b);
+        for (size_t k = 1; k < INTS_IN_VEC; ++k) {
+            vec_b = _mm256_permutevar8x32_epi32(vec_b, rotate);
+            found = _mm256_or_si256(found, _mm256_cmpeq_epi32(vec_a, vec_b));
+        }
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(found));
+        size_t matched = __builtin_popcount(mask);
+        if (MATERIALIZE) {
+            __m256i idx = _mm256_load_si256(reinterpret_cast<const __m256i*>(COMPRESS.idx[mask]));
+            __m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(TAIL_MASK + INTS_IN_VEC - matched));
+            // Only the matched lanes are written, out never overflows
+            _mm256_maskstore_epi32(out + count, lanes, _mm256_permutevar8x32_epi32(vec_a, idx));
+        }
+        count += matched;
+        int a_max = a[i + INTS_IN_VEC - 1], b_max = b[j + INTS_IN_VEC - 1];
+        i += (a_max <= b_max) * INTS_IN_VEC;
+        j += (b_max <= a_max) * INTS_IN_VEC;
+    }
+    return count + intersect_merge_scalar<MATERIALIZE>(a + i, a_size - i, b + j, b_size - j, MATERIALIZE ? out + count : out);
+}
+
+using IntersectMerge = size_t (*)(const int * a, size_t a_size, const int * b, size_t b_size, int * out);
+
+// SSE has no lane permute to rotate a block through, the scalar merge wins
+template <bool MATERIALIZE>
+static constexpr IsaDispatch<IntersectMerge> intersect_merge(
+    intersect_merge_scalar<MATERIALIZE>, intersect_merge_avx2<MATERIALIZE>, intersect_merge_avx2<MATERIALIZE>);
+
+template <bool MATERIALIZE>
+static size_t intersect_sets(const std::vector<int>& a, const std::vector<int>& b, int * out)
+{
+    const std::vector<int>& small = a.size() <= b.size() ? a : b;
+    const std::vector<int>& large = a.size() <= b.size() ? b : a;
+    if (small.size() * SEARCH_RATIO < large.size()) {
+        return intersect_search<MATERIALIZE>(small.data(), small.size(), large.data(), large.size(), out);
+    }
+    return intersect_merge<MATERIALIZE>(a.data(), a.size(), b.data(), b.size(), out);
+}
+
+size_t intersect_count(const std::vector<int>& a, const std::vector<int>& b)
+{
+    return intersect_sets<false>(a, b, nullptr);
+}
+
+size_t intersect(const std::vector<int>& a, const std::vector<int>& b, int * out)
+{
+    return intersect_sets<true>(a, b, out);
+}
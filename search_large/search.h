@@ -1,3 +1,136 @@
 #include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "huge_page.h"
 
 bool search(const std::vector<int>& data, int value);
+
+// Positions in the sorted vector with the meaning of the std:: algorithms,
+// found by the same interpolation search. Runs of duplicates may be of any length
+size_t lower_bound(const std::vector<int>& data, int value);
+size_t upper_bound(const std::vector<int>& data, int value);
+std::pair<size_t, size_t> equal_range(const std::vector<int>& data, int value);
+
+// Looks up n keys at once: out[i] = search(data, keys[i]).
+// Searches advance in lockstep in batches of branchless bisections, so their
+// cache misses overlap
+void search_many(const std::vector<int>& data, const int * keys, size_t n, bool * out);
+
+// Intersection of two sorted sets (strictly increasing, no duplicates).
+// When one set is much smaller, its elements are searched in the larger one
+// in order, each guess corrected by how far off the previous one was; otherwise
+// both are merged 8x8 elements at a time with SIMD all-pairs comparison
+size_t intersect_count(const std::vector<int>& a, const std::vector<int>& b);
+// Writes the common elements to out in increasing order and returns their number.
+// out needs room for min(a.size(), b.size()) elements
+size_t intersect(const std::vector<int>& a, const std::vector<int>& b, int * out);
+
+// Sorted array in Eytzinger (BFS) layout: node k has children 2k and 2k+1.
+// Built once from a sorted vector, then every lookup is a branchless descent
+// where the 16 descendants 4 levels below the current node share one cache
+// line and are prefetched ahead of time. Does not depend on key distribution.
+class EytzingerIndex
+{
+public:
+    // The tree lives on huge pages, on numa_node if one is given
+    explicit EytzingerIndex(const std::vector<int>& sorted, int numa_node = NUMA_NODE_ANY);
+
+    bool contains(int value) const;
+    // Position of the first element >= value in the original sorted vector, size() if none
+    size_t lower_bound(int value) const;
+    size_t size() const { return size_; }
+
+private:
+    // Eytzinger node of the first element >= value, 0 if none
+    size_t lower_bound_node(int value) const;
+    size_t build(const std::vector<int>& sorted, size_t idx, size_t node);
+
+    size_t size_;
+    // 1-based, tree_[0] is unused. Cache line aligned, so nodes 16k..16k+15 are one line
+    HugeVector<int> tree_;
+    // Position in the sorted vector of every node
+    HugeVector<uint32_t> rank_;
+};
+
+// Piecewise-linear learned index (PGM-style). The sorted keys are split into
+// segments, each a linear model key -> position with a known max error, so a
+// lookup is a model evaluation and a scan of at most 2 * error + 2 elements.
+// Segment first keys are indexed the same way, level by level, until a
+// handful of segments is left at the root. Adapts to the key distribution
+// instead of betting on a single global interpolation.
+class LearnedIndex
+{
+public:
+    // Max error of the models over the data and over the segment keys
+    static constexpr size_t EPSILON = 32;
+    static constexpr size_t EPSILON_INTERNAL = 8;
+
+    // The data copy lives on huge pages, on numa_node if one is given
+    explicit LearnedIndex(const std::vector<int>& sorted, int numa_node = NUMA_NODE_ANY);
+
+    // Writes the keys and the models to path, see IndexFileHeader in
+    // search.cpp. Throws std::runtime_error if the file cannot be written
+    void save(const std::string& path) const;
+    // The index saved at path, mapped read-only: opening reads the header,
+    // lookups use the keys and models in place from the page cache. Throws
+    // std::runtime_error on a missing or malformed file
+    static LearnedIndex open(const std::string& path);
+
+    // Levels point into the storage, which moves along
+    LearnedIndex(LearnedIndex&&) = default;
+    LearnedIndex& operator=(LearnedIndex&&) = delete;
+
+    bool contains(int value) const;
+    // Position of the first element >= value in the original sorted vector, size() if none
+    size_t lower_bound(int value) const;
+    size_t size() const { return size_; }
+    // The sorted keys, on huge pages or in the mapping
+    const int * data() const { return data_; }
+    // Number of segments over the data
+    size_t segments() const { return levels_.empty() ? 0 : levels_.front().size; }
+
+private:
+    struct Model {
+        double slope;
+        // Position of the segment first key
+        uint32_t intercept;
+        uint32_t max_error;
+    };
+
+    // Segments over points (keys[i], positions[i]), keys strictly increasing
+    struct Level {
+        // First key of every segment
+        const int * keys;
+        const Model * models;
+        size_t size;
+    };
+
+    // Levels of an index built in memory
+    struct LevelStorage {
+        std::vector<int> keys;
+        std::vector<Model> models;
+    };
+
+    LearnedIndex() = default;
+
+    static LevelStorage build_level(const std::vector<int>& keys, const std::vector<uint32_t>& positions, size_t epsilon);
+    // Positions [lo, hi) below segment seg of level that may hold the answer for value
+    std::pair<size_t, size_t> window(size_t level, size_t seg, size_t size, int value) const;
+    // Index of the last segment of level with first key <= value, 0 if none
+    size_t find_segment(size_t level, int value) const;
+
+    const int * data_ = nullptr;
+    size_t size_ = 0;
+    // levels_[0] is over the data, every next one over the keys of the previous one
+    std::vector<Level> levels_;
+
+    // Built in memory: the data copy and the levels
+    HugeVector<int> data_storage_;
+    std::vector<LevelStorage> level_storage_;
+    // Opened from a file: the mapping, unmapped with the last reference
+    std::shared_ptr<const void> mapping_;
+};
@@ -0,0 +1,212 @@
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+#include "stree.h"
+#include "search.h"
+#include "bench.h"
+
+size_t lower_bound_stl(const std::vector<int>& data, int value)
+{
+    return std::lower_bound(data.begin(), data.end(), value) - data.begin();
+}
+
+template <typename F>
+benchmark::Stats bench_best(const std::string& name, const F& lower_bound, const std::vector<int>& sorted, const std::vector<int>& unsorted)
+{
+    size_t nlookups = std::max(1000UL, unsorted.size());
+    nlookups = std::min(nlookups, 1UL<<16);
+    return benchmark::measure(name, {{"n", sorted.size()}}, [&] {
+        size_t checksum = 0;
+        for (size_t i = 0; i < nlookups; ++i) {
+            checksum += lower_bound(sorted, unsorted[i % unsorted.size()]);
+        }
+        benchmark::do_not_optimize(checksum);
+    }, nlookups);
+}
+
+// Adaptive index against std::lower_bound, on any key distribution
+void bench_adaptive(const std::string& name, const std::vector<int>& sorted, const std::vector<int>& unsorted)
+{
+    SortedIndex index(sorted);
+    auto lower_bound_index = [&] (const std::vector<int>&, int value) {
+        return index.lower_bound(value);
+    };
+    double basic = bench_best("std::lower_bound " + name, lower_bound_stl, sorted, unsorted).min;
+    auto stats = bench_best("SortedIndex " + name, lower_bound_index, sorted, unsorted);
+    double adaptive = stats.min;
+    double ratio = basic / adaptive;
+    std::cout << "Search in " << sorted.size() << " " << name << " elements.";
+    std::cout << " std::lower_bound " << basic << "ns per search.";
+    std::cout << " Adaptive (" << strategy_name(index.strategy()) << ") " << adaptive << "ns per search.";
+    std::cout << " Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
+    // Tiny arrays are dominated by the call itself, it only must not lose there
+    assert(ratio > (sorted.size() < 512 ? 0.8 : 1.2));
+}
+
+void bench(const std::vector<int>& sorted, const std::vector<int>& unsorted)
+{
+    STree tree(sorted);
+    auto lower_bound_stree = [&] (const std::vector<int>&, int value) {
+        return tree.lower_bound(value);
+    };
+    double basic = bench_best("std::lower_bound", lower_bound_stl, sorted, unsorted).min;
+    auto stats = bench_best("STree", lower_bound_stree, sorted, unsorted);
+    double stree = stats.min;
+    double ratio = basic / stree;
+    std::cout << "Search in " << sorted.size() << " elements.";
+    std::cout << " std::lower_bound " << basic << "ns per search.";
+    std::cout << " S-tree " << stree << "ns per search. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
+    // Below a few hundred elements both are a handful of compares and the
+    // call dominates, the tree only must not lose there
+    assert(ratio > (sorted.size() < 512 ? 0.8 : 1.5));
+}
+
+void test_performance(int n)
+{
+    std::vector<int> data(n);
+    std::vector<int> sdata(n);
+    std::random_device device;
+    std::mt19937 mt(device());
+    for (int i = 0; i < n; ++i) {
+        data[i] = mt();
+        sdata[i] = data[i];
+    }
+    std::sort(sdata.begin(), sdata.end());
+    bench(sdata, data);
+}
+
+// Values are drawn from [0, modulo), so small modulo gives many duplicates
+void validate(int n, int modulo)
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    std::vector<int> sdata(n);
+    for (int i = 0; i < n; ++i) {
+        sdata[i] = mt() % modulo;
+    }
+    std::sort(sdata.begin(), sdata.end());
+    STree tree(sdata);
+    assert(tree.size() == sdata.size());
+    std::vector<SortedIndex> indexes;
+    for (auto strategy : {Strategy::kSplitter, Strategy::kInterpolation, Strategy::kSTree}) {
+        indexes.emplace_back(sdata, strategy);
+    }
+    // Linear scan is quadratic over the whole test, keep it to small sizes
+    if (n < 4096) {
+        indexes.emplace_back(sdata, Strategy::kLinear);
+    }
+    indexes.emplace_back(sdata);
+    for (int i = 0; i < 2 * n + 10; ++i) {
+        int v = static_cast<int>(mt() % (modulo + 2)) - 1;
+        size_t expected = lower_bound_stl(sdata, v);
+        bool found = std::binary_search(sdata.begin(), sdata.end(), v);
+        assert(tree.lower_bound(v) == expected);
+        assert(tree.contains(v) == found);
+        for (const auto& index : indexes) {
+            assert(index.lower_bound(v) == expected);
+            assert(index.contains(v) == found);
+        }
+    }
+}
+
+void test_correctness()
+{
+    benchmark::for_each_isa([] (Isa) {
+        for (int i = 0; i < 600; ++i) {
+            validate(i, 2 * i + 1);
+            validate(i, 1 << 30);
+        }
+        for (int i = 10; i < 21; ++i) {
+            validate((1 << i) + 7, 1 << 30);
+            validate((1 << i) - 3, 1 << (i / 2));
+        }
+    });
+    std::vector<int> extremes = {std::numeric_limits<int>::min(), 0, std::numeric_limits<int>::max()};
+    STree tree(extremes);
+    assert(tree.lower_bound(std::numeric_limits<int>::min()) == 0);
+    assert(tree.lower_bound(std::numeric_limits<int>::max()) == 2);
+    assert(tree.contains(std::numeric_limits<int>::max()));
+    std::cout << "test_correctness PASSED" << std::endl;
+}
+
+// Keys heavily skewed towards small values
+std::vector<int> generate_lognormal(int n, std::mt19937& mt)
+{
+    std::lognormal_distribution<double> dist(0., 3.);
+    std::vector<int> data(n);
+    for (int i = 0; i < n; ++i) {
+        data[i] = static_cast<int>(std::min(1000 * dist(mt), 2e9));
+    }
+    return data;
+}
+
+void test_performance_adaptive()
+{
+    const auto& calibration = search_calibration();
+    std::cout << "Calibrated cutoffs: linear up to " << calibration.linear_max_size;
+    std::cout << ", splitter up to " << calibration.splitter_max_size;
+    std::cout << ", interpolation from " << calibration.interpolation_min_size << std::endl;
+    std::random_device device;
+    std::mt19937 mt(device());
+    for (int i = 3; i < 25; i += 3) {
+        std::vector<int> uniform(1<<i);
+        for (auto& v : uniform) {
+            v = mt();
+        }
+        for (auto& [name, data] : {std::pair{"uniform", uniform}, std::pair{"lognormal", generate_lognormal(1<<i, mt)}}) {
+            std::vector<int> sdata = data;
+            std::sort(sdata.begin(), sdata.end());
+            bench_adaptive(name, sdata, data);
+        }
+    }
+    std::cout << "test_performance_adaptive PASSED" << std::endl;
+}
+
+void test_performance()
+{
+    for (int i = 4; i < 25; i += 2) {
+        test_performance(1<<i);
+    }
+    std::cout << "test_performance PASSED" << std::endl;
+}
+
+// The S-tree node rank per ISA, on a tree too large for the cache
+void test_performance_isa()
+{
+    int n = 1 << 20;
+    std::vector<int> data(n);
+    std::random_device device;
+    std::mt19937 mt(device());
+    for (auto& v : data) {
+        v = mt();
+    }
+    std::vector<int> sdata = data;
+    std::sort(sdata.begin(), sdata.end());
+    STree tree(sdata);
+    auto lower_bound_stree = [&] (const std::vector<int>&, int value) {
+        return tree.lower_bound(value);
+    };
+    std::cout << "S-tree search in " << n << " elements.";
+    benchmark::for_each_isa([&] (Isa isa) {
+        double good = bench_best(std::string("STree ") + isa_name(isa), lower_bound_stree, sdata, data).min;
+        std::cout << " " << isa_name(isa) << " " << good << "ns";
+    });
+    std::cout << " per search." << std::endl;
+    std::cout << "test_performance_isa PASSED" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    benchmark::init(argc, argv);
+    test_correctness();
+    test_performance();
+    test_performance_adaptive();
+    test_performance_isa();
+}
@@ -0,0 +1,344 @@
+#include "search.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+
+#include <immintrin.h>
+
+#include "cpu_dispatch.h"
+
+// Ranges at most this long are finished by the linear kernel
+constexpr size_t LINE_SEARCH_SIZE = 32;
+
+// The linear and splitter kernels come in a variant per ISA, picked on first
+// use, see cpu_dispatch.h
+
+__attribute__((target("avx512f")))
+static size_t lower_bound_linear_avx512(const int * data, size_t size, int value)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m512i) / sizeof(int);
+    __m512i vec_value = _mm512_set1_epi32(value);
+    size_t result = 0;
+    size_t idx = 0;
+    for (; idx + INTS_IN_VEC <= size; idx += INTS_IN_VEC) {
+        result += __builtin_popcount(_mm512_cmpgt_epi32_mask(vec_value, _mm512_loadu_si512(data + idx)));
+    }
+    // Masked out lanes are neither loaded nor counted
+    __mmask16 lanes = static_cast<__mmask16>((1u << (size - idx)) - 1);
+    __m512i chunk = _mm512_maskz_loadu_epi32(lanes, data + idx);
+    return result + __builtin_popcount(_mm512_mask_cmpgt_epi32_mask(lanes, vec_value, chunk));
+}
+
+__attribute__((target("avx2")))
+static size_t lower_bound_linear_avx2(const int * data, size_t size, int value)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m256i) / sizeof(int);
+    __m256i vec_value = _mm256_set1_epi32(value);
+    size_t result = 0;
+    size_t idx = 0;
+    for (; idx + INTS_IN_VEC <= size; idx += INTS_IN_VEC) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + idx));
+        __m256i less = _mm256_cmpgt_epi32(vec_value, chunk);
+        result += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+    for (; idx < size; ++idx) {
+        result += data[idx] < value;
+    }
+    return result;
+}
+
+static size_t lower_bound_linear_sse(const int * data, size_t size, int value)
+{
+    constexpr size_t INTS_IN_VEC = sizeof(__m128i) / sizeof(int);
+    __m128i vec_value = _mm_set1_epi32(value);
+    size_t result = 0;
+    size_t idx = 0;
+    for (; idx + INTS_IN_VEC <= size; idx += INTS_IN_VEC) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + idx));
+        __m128i less = _mm_cmpgt_epi32(vec_value, chunk);
+        result += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+    for (; idx < size; ++idx) {
+        result += data[idx] < value;
+    }
+    return result;
+}
+
+using LowerBound = size_t (*)(const int * data, size_t size, int value);
+
+static constexpr IsaDispatch<LowerBound> lower_bound_linear_kernel(
+    lower_bound_linear_sse, lower_bound_linear_avx2, lower_bound_linear_avx512);
+
+size_t lower_bound_linear(const int * data, size_t size, int value)
+{
+    return lower_bound_linear_kernel(data, size, value);
+}
+
+constexpr size_t SPLITTERS = 8;
+static_assert(LINE_SEARCH_SIZE > SPLITTERS, "Every splitter needs its own part");
+
+// Number of the 8 splitters less than value, splitter j is data[lower - 1 + (j + 1) * step]
+__attribute__((target("avx2")))
+static inline size_t splitters_less_avx2(const int * data, size_t lower, size_t step, __m256i vec_value)
+{
+    const __m256i offsets = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+    __m256i idx = _mm256_add_epi32(
+        _mm256_set1_epi32(static_cast<int>(lower) - 1),
+        _mm256_mullo_epi32(offsets, _mm256_set1_epi32(static_cast<int>(step))));
+    __m256i splitters = _mm256_i32gather_epi32(data, idx, sizeof(int));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vec_value, splitters)));
+    return __builtin_popcount(mask);
+}
+
+// No gather before AVX2, the splitters are loaded one by one
+static inline size_t splitters_less_sse(const int * data, size_t lower, size_t step, __m128i vec_value)
+{
+    const int * first = data + lower - 1;
+    __m128i lo = _mm_setr_epi32(first[step], first[2 * step], first[3 * step], first[4 * step]);
+    __m128i hi = _mm_setr_epi32(first[5 * step], first[6 * step], first[7 * step], first[8 * step]);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vec_value, lo)))
+             | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vec_value, hi))) << 4;
+    return __builtin_popcount(mask);
+}
+
+// Splitters are sorted, so the ones less than value form a prefix: narrows
+// [lower, upper] to the part right after the last of them
+static inline void split(size_t less, size_t step, size_t& lower, size_t& upper)
+{
+    size_t new_lower = lower + less * step;
+    upper = less < SPLITTERS ? lower + (less + 1) * step - 1 : upper;
+    lower = new_lower;
+}
+
+__attribute__((target("avx2")))
+static size_t lower_bound_splitter_avx2(const int * data, size_t size, int value)
+{
+    __m256i vec_value = _mm256_set1_epi32(value);
+    // The answer is in [lower, upper]
+    size_t lower = 0, upper = size;
+    while (upper - lower > LINE_SEARCH_SIZE) {
+        // Splitter j is the last element of part j, parts are step long
+        size_t step = (upper - lower) / (SPLITTERS + 1);
+        split(splitters_less_avx2(data, lower, step, vec_value), step, lower, upper);
+    }
+    return lower + lower_bound_linear(data + lower, upper - lower, value);
+}
+
+static size_t lower_bound_splitter_sse(const int * data, size_t size, int value)
+{
+    __m128i vec_value = _mm_set1_epi32(value);
+    size_t lower = 0, upper = size;
+    while (upper - lower > LINE_SEARCH_SIZE) {
+        size_t step = (upper - lower) / (SPLITTERS + 1);
+        split(splitters_less_sse(data, lower, step, vec_value), step, lower, upper);
+    }
+    return lower + lower_bound_linear(data + lower, upper - lower, value);
+}
+
+// 8 splitters fill an AVX2 gather, AVX-512 has nothing to add here
+static constexpr IsaDispatch<LowerBound> lower_bound_splitter_kernel(
+    lower_bound_splitter_sse, lower_bound_splitter_avx2, lower_bound_splitter_avx2);
+
+size_t lower_bound_splitter(const int * data, size_t size, int value)
+{
+    return lower_bound_splitter_kernel(data, size, value);
+}
+
+size_t lower_bound_interpolation(const int * data, size_t size, int value)
+{
+    if (size == 0 || value <= data[0]) {
+        return 0;
+    }
+    if (value > data[size - 1]) {
+        return size;
+    }
+    // Here data[0] < value <= data[size - 1]
+    int64_t first = data[0], last = data[size - 1];
+    size_t guess = static_cast<size_t>(double(value - first) / double(last - first) * (size - 1));
+
+    // Gallop away from the guess until data[lower] < value <= data[upper]
+    size_t lower = 0, upper = size - 1;
+    size_t step = 1;
+    if (data[guess] < value) {
+        lower = guess;
+        while (guess + step < size - 1 && data[guess + step] < value) {
+            lower = guess + step;
+            step <<= 1;
+        }
+        upper = std::min(guess + step, size - 1);
+    } else {
+        upper = guess;
+        while (step < guess && data[guess - step] >= value) {
+            upper = guess - step;
+            step <<= 1;
+        }
+        lower = step < guess ? guess - step : 0;
+    }
+
+    while (upper - lower > LINE_SEARCH_SIZE) {
+        size_t mid = lower + (upper - lower) / 2;
+        if (data[mid] < value) {
+            lower = mid;
+        } else {
+            upper = mid;
+        }
+    }
+    return lower + 1 + lower_bound_linear(data + lower + 1, upper - lower - 1, value);
+}
+
+const char * strategy_name(Strategy strategy)
+{
+    switch (strategy) {
+        case Strategy::kLinear: return "linear";
+        case Strategy::kSplitter: return "splitter";
+        case Strategy::kInterpolation: return "interpolation";
+        case Strategy::kSTree: return "S-tree";
+    }
+    return "unknown";
+}
+
+// Best of a few runs, ns per lookup
+template <typename F>
+static double time_lookups(const F& lower_bound, const std::vector<int>& keys)
+{
+    double best = std::numeric_limits<double>::max();
+    for (int run = 0; run < 5; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = 0;
+        for (int key : keys) {
+            checksum += lower_bound(key);
+        }
+        asm volatile("" :: "r" (checksum));
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+    }
+    return best / keys.size();
+}
+
+static SearchCalibration calibrate()
+{
+    constexpr size_t LOOKUPS = 4096;
+    constexpr size_t MAX_SIZE = 1 << 18;
+    std::mt19937 mt(42);
+    SearchCalibration result{0, 0, std::numeric_limits<size_t>::max()};
+    bool interpolation_wins = false;
+
+    for (size_t size = 8; size <= MAX_SIZE; size *= 2) {
+        std::vector<int> data(size);
+        for (auto& v : data) {
+            v = mt();
+        }
+        std::vector<int> keys(LOOKUPS);
+        for (auto& key : keys) {
+            key = data[mt() % size];
+        }
+        std::sort(data.begin(), data.end());
+        STree stree(data);
+
+        double stree_ns = time_lookups([&] (int key) { return stree.lower_bound(key); }, keys);
+        double interpolation_ns = time_lookups([&] (int key) { return lower_bound_interpolation(data.data(), size, key); }, keys);
+        // Linear and splitter searches only compete where they can still win
+        if (size <= 1 << 12) {
+            double linear_ns = time_lookups([&] (int key) { return lower_bound_linear(data.data(), size, key); }, keys);
+            double splitter_ns = time_lookups([&] (int key) { return lower_bound_splitter(data.data(), size, key); }, keys);
+            if (linear_ns <= std::min(splitter_ns, stree_ns)) {
+                result.linear_max_size = size;
+            }
+            if (splitter_ns <= stree_ns) {
+                result.splitter_max_size = size;
+            }
+        }
+        // Interpolation must keep winning up to the largest measured size
+        if (interpolation_ns < stree_ns) {
+            if (!interpolation_wins) {
+                result.interpolation_min_size = size;
+            }
+            interpolation_wins = true;
+        } else {
+            interpolation_wins = false;
+            result.interpolation_min_size = std::numeric_limits<size_t>::max();
+        }
+    }
+    result.splitter_max_size = std::max(result.splitter_max_size, result.linear_max_size);
+    return result;
+}
+
+const SearchCalibration& search_calibration()
+{
+    static const SearchCalibration calibration = calibrate();
+    return calibration;
+}
+
+// Keys look uniform if interpolation lands within a few standard deviations
+// of uniform random noise, measured on evenly spaced samples
+static bool looks_uniform(const std::vector<int>& sorted)
+{
+    constexpr size_t SAMPLES = 64;
+    size_t size = sorted.size();
+    int64_t first = sorted.front(), last = sorted.back();
+    if (first == last) {
+        return false;
+    }
+    double total_error = 0;
+    for (size_t sample = 0; sample < SAMPLES; ++sample) {
+        size_t idx = sample * (size - 1) / (SAMPLES - 1);
+        double guess = double(sorted[idx] - first) / double(last - first) * (size - 1);
+        total_error += std::abs(guess - double(idx));
+    }
+    return total_error / SAMPLES <= 4 * std::sqrt(double(size));
+}
+
+Strategy SortedIndex::choose_strategy(const std::vector<int>& sorted)
+{
+    const SearchCalibration& calibration = search_calibration();
+    size_t size = sorted.size();
+    if (size <= std::max(calibration.linear_max_size, LINE_SEARCH_SIZE)) {
+        return Strategy::kLinear;
+    }
+    if (size <= calibration.splitter_max_size) {
+        return Strategy::kSplitter;
+    }
+    if (size >= calibration.interpolation_min_size && looks_uniform(sorted)) {
+        return Strategy::kInterpolation;
+    }
+    return Strategy::kSTree;
+}
+
+SortedIndex::SortedIndex(std::vector<int> sorted)
+    : data_(std::move(sorted))
+    , strategy_(choose_strategy(data_))
+{
+    if (strategy_ == Strategy::kSTree) {
+        stree_.emplace(data_);
+    }
+}
+
+SortedIndex::SortedIndex(std::vector<int> sorted, Strategy strategy)
+    : data_(std::move(sorted))
+    , strategy_(strategy)
+{
+    if (strategy_ == Strategy::kSTree) {
+        stree_.emplace(data_);
+    }
+}
+
+size_t SortedIndex::lower_bound(int value) const
+{
+    switch (strategy_) {
+        case Strategy::kLinear: return lower_bound_linear(data_.data(), data_.size(), value);
+        case Strategy::kSplitter: return lower_bound_splitter(data_.data(), data_.size(), value);
+        case Strategy::kInterpolation: return lower_bound_interpolation(data_.data(), data_.size(), value);
+        case Strategy::kSTree: return stree_->lower_bound(value);
+    }
+    return data_.size();
+}
+
+bool SortedIndex::contains(int value) const
+{
+    size_t pos = lower_bound(value);
+    return pos < data_.size() && data_[pos] == value;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <optional>
+#include <cstddef>
+
+#include "stree.h"
+
+// Lower bound kernels over a sorted array: position of the first element
+// >= value, size if none. Each one is the best choice for some size band.
+
+// Branchless SIMD count of elements less than value over the whole array
+size_t lower_bound_linear(const int * data, size_t size, int value);
+// k-ary search: 8 splitters gathered and compared at once per level
+size_t lower_bound_splitter(const int * data, size_t size, int value);
+// Interpolation guess, galloping to bracket the answer, then bisection
+size_t lower_bound_interpolation(const int * data, size_t size, int value);
+
+enum class Strategy {
+    kLinear,
+    kSplitter,
+    kInterpolation,
+    kSTree,
+};
+
+const char * strategy_name(Strategy strategy);
+
+// Size cutoffs between strategies, measured by a micro-benchmark on this machine
+struct SearchCalibration {
+    // Linear scan up to this size
+    size_t linear_max_size;
+    // Splitter search up to this size, S-tree or interpolation above
+    size_t splitter_max_size;
+    // Interpolation replaces the S-tree from this size on if keys look uniform
+    size_t interpolation_min_size;
+};
+
+// Runs the micro-benchmark on first call (a few milliseconds), cached afterwards
+const SearchCalibration& search_calibration();
+
+// Sorted array with the search strategy chosen by its size and key distribution.
+// Works for any size, from a handful of elements to 10^8 and more
+class SortedIndex
+{
+public:
+    explicit SortedIndex(std::vector<int> sorted);
+    // Forces a strategy, for benchmarks and tests
+    SortedIndex(std::vector<int> sorted, Strategy strategy);
+
+    bool contains(int value) const;
+    // Position of the first element >= value, size() if none
+    size_t lower_bound(int value) const;
+
+    size_t size() const { return data_.size(); }
+    Strategy strategy() const { return strategy_; }
+
+private:
+    static Strategy choose_strategy(const std::vector<int>& sorted);
+
+    std::vector<int> data_;
+    Strategy strategy_;
+    // Built only for Strategy::kSTree
+    std::optional<STree> stree_;
+};
@@ -0,0 +1,139 @@
+#include "stree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <new>
+
+#include <immintrin.h>
+
+#include "cpu_dispatch.h"
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+static_assert(STree::B * sizeof(int) == CACHE_LINE_SIZE, "Node must fill exactly one cache line");
+
+void STree::AlignedDelete::operator()(int * ptr) const
+{
+    ::operator delete(ptr, std::align_val_t(CACHE_LINE_SIZE));
+}
+
+// Layer h + 1 needs one key per child of its nodes except the leftmost one
+size_t STree::layer_keys(size_t n, size_t h)
+{
+    size_t blocks = (n + B - 1) / B;
+    for (; h > 0; --h) {
+        size_t keys = (blocks + B) / (B + 1) * B;
+        blocks = (keys + B - 1) / B;
+    }
+    return blocks * B;
+}
+
+STree::STree(const std::vector<int>& sorted)
+    : size_(sorted.size())
+    , height_(1)
+{
+    // Keep at least one leaf so lookups never need a special case
+    size_t n = std::max<size_t>(size_, 1);
+    offset_.push_back(0);
+    while (layer_keys(n, height_ - 1) > B) {
+        offset_.push_back(offset_.back() + layer_keys(n, height_ - 1));
+        ++height_;
+    }
+    size_t total = offset_.back() + layer_keys(n, height_ - 1);
+    tree_.reset(static_cast<int*>(::operator new(total * sizeof(int), std::align_val_t(CACHE_LINE_SIZE))));
+
+    std::copy(sorted.begin(), sorted.end(), tree_.get());
+    std::fill(tree_.get() + size_, tree_.get() + layer_keys(n, 0), std::numeric_limits<int>::max());
+
+    for (size_t h = 1; h < height_; ++h) {
+        size_t keys = layer_keys(n, h);
+        for (size_t idx = 0; idx < keys; ++idx) {
+            // Key j of node k separates children j and j + 1:
+            // take the leftmost leaf of the subtree rooted at child j + 1
+            size_t node = idx / B, j = idx % B;
+            size_t child = node * (B + 1) + j + 1;
+            for (size_t l = 1; l < h; ++l) {
+                child *= B + 1;
+            }
+            tree_[offset_[h] + idx] = child * B < size_ ? tree_[child * B] : std::numeric_limits<int>::max();
+        }
+    }
+}
+
+// Number of keys in the node that are less than value. One compare of the
+// whole node with AVX-512, two with AVX2, four with SSE
+__attribute__((target("avx512f")))
+static inline unsigned rank_avx512(__m512i value, const int * node)
+{
+    return __builtin_popcount(_mm512_cmpgt_epi32_mask(value, _mm512_load_si512(node)));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned rank_avx2(__m256i value, const int * node)
+{
+    __m256i lo = _mm256_load_si256(reinterpret_cast<const __m256i*>(node));
+    __m256i hi = _mm256_load_si256(reinterpret_cast<const __m256i*>(node + 8));
+    unsigned mask_lo = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(value, lo)));
+    unsigned mask_hi = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(value, hi)));
+    return __builtin_popcount(mask_lo | (mask_hi << 8));
+}
+
+static inline unsigned rank_sse(__m128i value, const int * node)
+{
+    unsigned mask = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        __m128i keys = _mm_load_si128(reinterpret_cast<const __m128i*>(node + 4 * i));
+        mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(value, keys))) << (4 * i);
+    }
+    return __builtin_popcount(mask);
+}
+
+// Descent from the root to the leaf, the same in every variant but for the
+// rank. Position of the first key >= value among the padded leaves
+__attribute__((target("avx512f")))
+static size_t descend_avx512(const int * tree, const size_t * offset, size_t height, int value)
+{
+    __m512i vec_value = _mm512_set1_epi32(value);
+    // Key offset of the current node inside its layer
+    size_t k = 0;
+    for (size_t h = height - 1; h > 0; --h) {
+        k = k * (STree::B + 1) + rank_avx512(vec_value, tree + offset[h] + k) * STree::B;
+    }
+    return k + rank_avx512(vec_value, tree + k);
+}
+
+__attribute__((target("avx2")))
+static size_t descend_avx2(const int * tree, const size_t * offset, size_t height, int value)
+{
+    __m256i vec_value = _mm256_set1_epi32(value);
+    size_t k = 0;
+    for (size_t h = height - 1; h > 0; --h) {
+        k = k * (STree::B + 1) + rank_avx2(vec_value, tree + offset[h] + k) * STree::B;
+    }
+    return k + rank_avx2(vec_value, tree + k);
+}
+
+static size_t descend_sse(const int * tree, const size_t * offset, size_t height, int value)
+{
+    __m128i vec_value = _mm_set1_epi32(value);
+    size_t k = 0;
+    for (size_t h = height - 1; h > 0; --h) {
+        k = k * (STree::B + 1) + rank_sse(vec_value, tree + offset[h] + k) * STree::B;
+    }
+    return k + rank_sse(vec_value, tree + k);
+}
+
+using Descend = size_t (*)(const int * tree, const size_t * offset, size_t height, int value);
+
+static constexpr IsaDispatch<Descend> descend(descend_sse, descend_avx2, descend_avx512);
+
+size_t STree::lower_bound(int value) const
+{
+    return std::min(descend(tree_.get(), offset_.data(), height_, value), size_);
+}
+
+bool STree::contains(int value) const
+{
+    size_t pos = lower_bound(value);
+    return pos < size_ && tree_[pos] == value;
+}
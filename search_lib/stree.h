@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+// Static B+-tree (S+-tree) over a sorted array of ints.
+// Every node is 16 keys in one 64-byte aligned cache line, so a level costs a
+// single cache miss and is resolved with SIMD compares and a popcount.
+// Leaves are the sorted keys themselves (padded with INT_MAX), internal node
+// keys are the smallest keys of the child subtrees to their right.
+// Works for any size, from a few elements (one leaf) to ~10^9.
+class STree
+{
+public:
+    static constexpr size_t B = 16;
+
+    explicit STree(const std::vector<int>& sorted);
+
+    // Position of the first element >= value in the sorted vector, size() if none
+    size_t lower_bound(int value) const;
+    bool contains(int value) const;
+    size_t size() const { return size_; }
+
+private:
+    struct AlignedDelete {
+        void operator()(int * ptr) const;
+    };
+
+    // Number of keys in layer h, layer 0 being the leaves
+    static size_t layer_keys(size_t n, size_t h);
+
+    size_t size_;
+    // Number of layers including leaves
+    size_t height_;
+    // Key offset of each layer in tree_, leaves first
+    std::vector<size_t> offset_;
+    std::unique_ptr<int[], AlignedDelete> tree_;
+};
@@ -3,10 +3,12 @@
 #include <algorithm>
 #include <unordered_set>
 #include <cassert>
-#include <chrono>
 #include <cstdlib>
+#include <memory>
+#include <string>
 
 #include "search.h"
+#include "bench.h"
 
 bool search_stl(const std::vector<int>& data, int value)
 {
@@ -14,49 +16,110 @@ bool search_stl(const std::vector<int>& data, int value)
 }
 
 template <typename F>
-long bench_single(const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted, size_t nlookups)
+benchmark::Stats bench_best(const std::string& name, const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted)
 {
-    auto start = std::chrono::high_resolution_clock::now();
+    size_t nlookups = std::max(1000UL, unsorted.size());
+    nlookups = std::min(nlookups, 1UL<<16);
     auto lookup = [&] (size_t i) {
         if (!binsearch(sorted, unsorted[i])) {
             std::cout << "Fail binsearch" << std::endl;
         }
     };
-    for (size_t j = 0; j < nlookups / unsorted.size(); ++j) {
-        for (size_t i = 0; i < unsorted.size(); ++i) {
+    return benchmark::measure(name, {{"n", sorted.size()}}, [&] {
+        for (size_t j = 0; j < nlookups / unsorted.size(); ++j) {
+            for (size_t i = 0; i < unsorted.size(); ++i) {
+                lookup(i);
+            }
+        }
+        for (size_t i = 0; i < nlookups % unsorted.size(); ++i) {
             lookup(i);
         }
-    }
-    for (size_t i = 0; i < nlookups % unsorted.size(); ++i) {
-        lookup(i);
-    }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    return duration;
+    }, nlookups);
 }
 
-template <typename F>
-double bench_best(const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted)
+void bench(const std::vector<int>& sorted, const std::vector<int>& unsorted)
+{
+    double basic = bench_best("std::binary_search", search_stl, sorted, unsorted).min;
+    auto stats = bench_best("search", search, sorted, unsorted);
+    double good = stats.min;
+    double ratio = basic / good;
+    std::cout << "Search in " << sorted.size() << " elements.";
+    std::cout << " std::binary_search " << basic << "ns per search.";
+    std::cout << " Your " << good << "ns per search. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
+    assert(ratio > 3);
+}
+
+void bench_many(const std::vector<int>& sorted, const std::vector<int>& unsorted)
 {
     size_t nlookups = std::max(1000UL, unsorted.size());
     nlookups = std::min(nlookups, 1UL<<16);
-    auto best = bench_single(binsearch, sorted, unsorted, nlookups);
-    for (int i = 0; i < 10; ++i) {
-        asm volatile ("");
-        best = std::min(best, bench_single(binsearch, sorted, unsorted, nlookups));
+    std::vector<int> keys(nlookups);
+    for (size_t i = 0; i < nlookups; ++i) {
+        keys[i] = unsorted[i % unsorted.size()];
+    }
+    std::unique_ptr<bool[]> found(new bool[nlookups]);
+    auto stats = benchmark::measure("search_many", {{"n", sorted.size()}}, [&] {
+        search_many(sorted, keys.data(), nlookups, found.get());
+    }, nlookups);
+    double many = stats.min;
+    for (size_t i = 0; i < nlookups; ++i) {
+        if (!found[i]) {
+            std::cout << "Fail search_many" << std::endl;
+        }
     }
-    return double(best) / nlookups;
+    double single = bench_best("search", search, sorted, unsorted).min;
+    std::cout << "Search " << nlookups << " keys in " << sorted.size() << " elements.";
+    std::cout << " One by one " << single << "ns per search.";
+    std::cout << " search_many " << many << "ns per search. Speedup: " << single / many << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
 }
 
-void bench(const std::vector<int>& sorted, const std::vector<int>& unsorted)
+// Position searches against the std:: algorithm doing the same. Keys are a
+// long random sequence: a short one repeated in the same order is learned
+// by the branch predictor and flatters branchy searches
+template <typename F>
+double bench_positions(const std::string& name, const F& bound, const std::vector<int>& sorted, const std::vector<int>& keys)
 {
-    double basic = bench_best(search_stl, sorted, unsorted);
-    double good = bench_best(search, sorted, unsorted);
-    double ratio = basic / good;
-    std::cout << "Search in " << sorted.size() << " elements.";
-    std::cout << " std::binary_search " << basic << "ns per search.";
-    std::cout << " Your " << good << "ns per search. Speedup: " << ratio << std::endl;
-    assert(ratio > 3);
+    return benchmark::measure(name, {{"n", sorted.size()}}, [&] {
+        size_t checksum = 0;
+        for (int key : keys) {
+            checksum += bound(sorted, key);
+        }
+        benchmark::do_not_optimize(checksum);
+    }, keys.size()).min;
+}
+
+void bench_bounds(const std::string& name, const std::vector<int>& sorted, std::mt19937& mt, double min_speedup)
+{
+    std::vector<int> keys(1 << 16);
+    for (auto& key : keys) {
+        key = sorted[mt() % sorted.size()];
+    }
+    auto std_lower = [] (const std::vector<int>& data, int value) {
+        return size_t(std::lower_bound(data.begin(), data.end(), value) - data.begin());
+    };
+    auto std_upper = [] (const std::vector<int>& data, int value) {
+        return size_t(std::upper_bound(data.begin(), data.end(), value) - data.begin());
+    };
+    auto std_range = [] (const std::vector<int>& data, int value) {
+        auto range = std::equal_range(data.begin(), data.end(), value);
+        return size_t((range.first - data.begin()) + (range.second - data.begin()));
+    };
+    auto fast_range = [] (const std::vector<int>& data, int value) {
+        auto range = equal_range(data, value);
+        return range.first + range.second;
+    };
+    double lower_ratio = bench_positions("std::lower_bound " + name, std_lower, sorted, keys)
+        / bench_positions("lower_bound " + name, lower_bound, sorted, keys);
+    double upper_ratio = bench_positions("std::upper_bound " + name, std_upper, sorted, keys)
+        / bench_positions("upper_bound " + name, upper_bound, sorted, keys);
+    double range_ratio = bench_positions("std::equal_range " + name, std_range, sorted, keys)
+        / bench_positions("equal_range " + name, fast_range, sorted, keys);
+    std::cout << "Bounds in " << sorted.size() << " " << name << " elements. Speedup over std::";
+    std::cout << " lower_bound " << lower_ratio << ", upper_bound " << upper_ratio;
+    std::cout << ", equal_range " << range_ratio << std::endl;
+    assert(std::min({lower_ratio, upper_ratio, range_ratio}) > min_speedup);
 }
 
 void test_performance(int n)
@@ -71,6 +134,15 @@ void test_performance(int n)
     }
     std::sort(sdata.begin(), sdata.end());
     bench(sdata, data);
+    bench_many(sdata, data);
+    bench_bounds("distinct", sdata, mt, 1.2);
+    // Runs of 16 equal elements on average. Few distinct keys are easy on
+    // the branch predictor, std:: catches up on small arrays
+    for (int i = 0; i < n; ++i) {
+        sdata[i] = static_cast<int>(mt() % (n / 16));
+    }
+    std::sort(sdata.begin(), sdata.end());
+    bench_bounds("duplicate", sdata, mt, 0.8);
 }
 
 void validate(int n)
@@ -93,13 +165,50 @@ void validate(int n)
         int v = mt();
         assert(search(sdata, v) == (map.find(v) != map.end()));
     }
+    std::vector<int> keys = data;
+    for (int i = 0; i < n; ++i) {
+        keys.push_back(mt());
+    }
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    search_many(sdata, keys.data(), keys.size(), found.get());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(found[i] == (map.find(keys[i]) != map.end()));
+    }
+}
+
+// Values are drawn from [0, modulo), so small modulo gives long runs of duplicates
+void validate_bounds(int n, int modulo)
+{
+    std::random_device device;
+    std::mt19937 mt(device());
+    std::vector<int> sdata(n);
+    for (int i = 0; i < n; ++i) {
+        sdata[i] = mt() % modulo;
+    }
+    std::sort(sdata.begin(), sdata.end());
+    for (int i = 0; i < 2 * n + 10; ++i) {
+        int v = static_cast<int>(mt() % (modulo + 2)) - 1;
+        size_t first = std::lower_bound(sdata.begin(), sdata.end(), v) - sdata.begin();
+        size_t last = std::upper_bound(sdata.begin(), sdata.end(), v) - sdata.begin();
+        assert(lower_bound(sdata, v) == first);
+        assert(upper_bound(sdata, v) == last);
+        assert(equal_range(sdata, v) == std::make_pair(first, last));
+    }
 }
 
 void test_correctness()
 {
-    for (int i = 0; i < 100; ++i) {
-        validate(i);
+    benchmark::for_each_isa([] (Isa) {
+        for (int i = 0; i < 100; ++i) {
+            validate(i);
+        }
+    });
+    for (int i = 0; i < 300; ++i) {
+        validate_bounds(i, 2 * i + 1);
+        validate_bounds(i, 1 << 30);
     }
+    validate_bounds(1 << 16, 1 << 6);
+    validate_bounds(1 << 16, 1 << 30);
     std::cout << "test_correctness PASSED" << std::endl; 
 }
 
@@ -111,8 +220,9 @@ void test_performance()
     std::cout << "test_performance PASSED" << std::endl; 
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    benchmark::init(argc, argv);
     test_correctness();
     test_performance();
 }
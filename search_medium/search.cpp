@@ -1,43 +1,19 @@
 #include "search.h"
 #include <cstdint>
+#include <algorithm>
 #include <iostream>
 
 #include <immintrin.h>
 
-#define _i_vec_t        __m256i
-#define _i_init_vec     _mm256_set1_epi32
-#define _i_cmpeq_vec    _mm256_cmpeq_epi32
-#define _i_cast_vec     _mm256_movemask_epi8
-
-constexpr uint8_t INTS_IN_VEC_INT = sizeof(_i_vec_t) / sizeof(int);
-
-bool search_small(const int * data, uint8_t size, int value)
-{
-    const _i_vec_t * _vec_data  = reinterpret_cast< const _i_vec_t * > ( data );
-    const _i_vec_t   _vec_value = _i_init_vec( value );
-
-    for (   uint8_t n_checked = 0;
-            n_checked < size;
-            n_checked += INTS_IN_VEC_INT, _vec_data += 1  // shift pointer to the next element
-    ) {
-        // WARNING! Would cause out of bounds for INTS_IN_VEC_INT bytes for some inputs, but we don't care
-        if ( _i_cast_vec( _i_cmpeq_vec( *_vec_data, _vec_value ) ) == 0 ) {
-            continue;  // likely
-        } else {
-            return true;
-        }
-    }
-    return false;
-}
-
+#include "simd_scan.h"
 
 constexpr uint32_t LINE_SEARCH_SIZE = 1 << 6;
-static_assert(LINE_SEARCH_SIZE < 256, "Line search size too big");
 static_assert(LINE_SEARCH_SIZE > 10, "Line search size too small");
 
 
 
-bool search(const std::vector<int>& vec, int value)
+// The scan kernel is a parameter so that search_many() picks it only once
+static bool search_with(SearchSmall kernel, const std::vector<int>& vec, int value)
 {
     uint32_t lower = 0, upper = static_cast<uint32_t>(vec.size()) - 1;
     uint32_t step = 0;
@@ -79,9 +55,134 @@ bool search(const std::vector<int>& vec, int value)
         }
     }
 
-    return search_small(vec.data() + lower, static_cast<uint8_t>(upper - lower + 1), value);
+    return search_small(kernel, vec.data() + lower, upper - lower + 1, value);
+}
+
+bool search(const std::vector<int>& vec, int value)
+{
+    return search_with(search_small_kernel.get(), vec, value);
+}
+
+
+// Number of elements before the answer in a short range: less than value
+// for lower_bound, not greater for upper_bound. Vectorized by the compiler
+template <bool UPPER>
+static size_t count_before(const int * data, size_t size, int value)
+{
+    uint32_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += UPPER ? data[i] <= value : data[i] < value;
+    }
+    return count;
+}
+
+// Counting is cheaper than one more splitter step only for a couple of vectors
+constexpr size_t BOUND_SCAN_SIZE = 16;
+constexpr size_t EQUAL_RUN_SCAN_SIZE = 32;
+
+// Same 4-splitter narrowing as search(), but tracking the exact bounds of
+// the answer instead of a range to scan for equality
+template <bool UPPER>
+static size_t bound(const int * data, size_t size, int value)
+{
+    const __m128i vec_value = _mm_set1_epi32(value);
+    // The answer is in [lower, upper]
+    size_t lower = 0, upper = size;
+    while (upper - lower > BOUND_SCAN_SIZE) {
+        // Splitter j is the last element of part j, parts are step long
+        size_t step = (upper - lower) / 5;
+        size_t last = lower + step - 1;
+        __m128i vec_split = _mm_setr_epi32(data[last], data[last + step], data[last + 2 * step], data[last + 3 * step]);
+        // Splitters are sorted, so the ones before the answer form a prefix
+        size_t before = UPPER
+            ? 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vec_split, vec_value))))
+            : __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vec_value, vec_split))));
+        upper = before < 4 ? lower + (before + 1) * step - 1 : upper;
+        lower += before * step;
+    }
+    return lower + count_before<UPPER>(data + lower, upper - lower, value);
+}
+
+size_t lower_bound(const std::vector<int>& vec, int value)
+{
+    return bound<false>(vec.data(), vec.size(), value);
 }
 
+size_t upper_bound(const std::vector<int>& vec, int value)
+{
+    return bound<true>(vec.data(), vec.size(), value);
+}
+
+std::pair<size_t, size_t> equal_range(const std::vector<int>& vec, int value)
+{
+    const int * data = vec.data();
+    size_t size = vec.size();
+    size_t first = bound<false>(data, size, value);
+    // Most runs end within a few vectors of their start, count them directly
+    size_t window = std::min(EQUAL_RUN_SCAN_SIZE, size - first);
+    size_t last = first + count_before<true>(data + first, window, value);
+    if (last == first + window && last < size) {
+        // A long run: gallop to bracket its end
+        size_t step = 1;
+        while (last + step < size && data[last + step] <= value) {
+            step <<= 1;
+        }
+        size_t from = last + step / 2;
+        last = from + bound<true>(data + from, std::min(last + step, size) - from, value);
+    }
+    return {first, last};
+}
+
+
+constexpr size_t BATCH_SIZE = 16;
+// Below this size the array is L1 resident and one-by-one splitter search is faster
+constexpr size_t LOCKSTEP_MIN_SIZE = 1 << 11;
+
+// Branchless lower_bound for up to BATCH_SIZE keys advancing in lockstep:
+// all searches over one array take the same number of halving steps, so
+// the probes of one step are independent loads and their misses overlap
+static void lower_bound_batch(const int * data, size_t size, const int * keys, size_t count, size_t * out)
+{
+    const int * base[BATCH_SIZE];
+    for (size_t i = 0; i < count; ++i) {
+        base[i] = data;
+    }
+    size_t len = size;
+    while (len > 1) {
+        size_t half = len / 2;
+        size_t next_half = (len - half) / 2;
+        for (size_t i = 0; i < count; ++i) {
+            base[i] += (base[i][half - 1] < keys[i]) * half;
+            // Issue the next probe of this search while the others compute
+            __builtin_prefetch(base[i] + next_half - 1);
+        }
+        len -= half;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = (base[i] - data) + (size > 0 && *base[i] < keys[i]);
+    }
+}
+
+void search_many(const std::vector<int>& vec, const int * keys, size_t n, bool * out)
+{
+    if (vec.size() < LOCKSTEP_MIN_SIZE) {
+        SearchSmall kernel = search_small_kernel.get();
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = search_with(kernel, vec, keys[i]);
+        }
+        return;
+    }
+    size_t pos[BATCH_SIZE];
+    for (size_t start = 0; start < n; start += BATCH_SIZE) {
+        size_t count = std::min(BATCH_SIZE, n - start);
+        lower_bound_batch(vec.data(), vec.size(), keys + start, count, pos);
+        for (size_t i = 0; i < count; ++i) {
+            out[start + i] = pos[i] < vec.size() && vec[pos[i]] == keys[start + i];
+        }
+    }
+}
+
+
 
 
 
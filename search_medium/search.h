@@ -1,3 +1,16 @@
 #include <vector>
+#include <cstddef>
+#include <utility>
 
 bool search(const std::vector<int>& data, int value);
+
+// Positions in the sorted vector with the meaning of the std:: algorithms,
+// found by the same splitter search. Runs of duplicates may be of any length
+size_t lower_bound(const std::vector<int>& data, int value);
+size_t upper_bound(const std::vector<int>& data, int value);
+std::pair<size_t, size_t> equal_range(const std::vector<int>& data, int value);
+
+// Looks up n keys at once: out[i] = search(data, keys[i]).
+// Arrays too large for L1 are searched in lockstep batches, so the cache
+// misses of a batch overlap; smaller ones one key at a time by search()
+void search_many(const std::vector<int>& data, const int * keys, size_t n, bool * out);
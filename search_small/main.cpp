@@ -3,10 +3,12 @@
 #include <algorithm>
 #include <unordered_set>
 #include <cassert>
-#include <chrono>
 #include <cstdlib>
+#include <memory>
+#include <string>
 
 #include "search.h"
+#include "bench.h"
 
 bool search_stl(const std::vector<int>& data, int value)
 {
@@ -14,51 +16,65 @@ bool search_stl(const std::vector<int>& data, int value)
 }
 
 template <typename F>
-long bench_single(const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted, size_t nlookups)
+benchmark::Stats bench_best(const std::string& name, const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted)
 {
-    auto start = std::chrono::high_resolution_clock::now();
+    size_t nlookups = std::max(1000UL, unsorted.size());
+    nlookups = std::min(nlookups, 1UL<<16);
     auto lookup = [&] (size_t i) {
         if (!binsearch(sorted, unsorted[i])) {
             std::cout << "Fail binsearch" << std::endl;
         }
     };
-    for (size_t j = 0; j < nlookups / unsorted.size(); ++j) {
-        for (size_t i = 0; i < unsorted.size(); ++i) {
+    return benchmark::measure(name, {{"n", sorted.size()}}, [&] {
+        for (size_t j = 0; j < nlookups / unsorted.size(); ++j) {
+            for (size_t i = 0; i < unsorted.size(); ++i) {
+                lookup(i);
+            }
+        }
+        for (size_t i = 0; i < nlookups % unsorted.size(); ++i) {
             lookup(i);
         }
-    }
-    for (size_t i = 0; i < nlookups % unsorted.size(); ++i) {
-        lookup(i);
-    }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    return duration;
-}
-
-template <typename F>
-double bench_best(const F& binsearch, const std::vector<int>& sorted, const std::vector<int>& unsorted)
-{
-    size_t nlookups = std::max(1000UL, unsorted.size());
-    nlookups = std::min(nlookups, 1UL<<16);
-    auto best = bench_single(binsearch, sorted, unsorted, nlookups);
-    for (int i = 0; i < 10; ++i) {
-        asm volatile ("");
-        best = std::min(best, bench_single(binsearch, sorted, unsorted, nlookups));
-    }
-    return double(best) / nlookups;
+    }, nlookups);
 }
 
 void bench(const std::vector<int>& sorted, const std::vector<int>& unsorted)
 {
-    double basic = bench_best(search_stl, sorted, unsorted);
-    double good = bench_best(search, sorted, unsorted);
+    double basic = bench_best("std::binary_search", search_stl, sorted, unsorted).min;
+    auto stats = bench_best("search", search, sorted, unsorted);
+    double good = stats.min;
     double ratio = basic / good;
     std::cout << "Search in " << sorted.size() << " elements.";
     std::cout << " std::binary_search " << basic << "ns per search.";
-    std::cout << " Your " << good << "ns per search. Speedup: " << ratio << std::endl;
+    std::cout << " Your " << good << "ns per search. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
     assert(ratio > 1.5);
 }
 
+void bench_many(const std::vector<int>& sorted, const std::vector<int>& unsorted)
+{
+    size_t nlookups = std::max(1000UL, unsorted.size());
+    nlookups = std::min(nlookups, 1UL<<16);
+    std::vector<int> keys(nlookups);
+    for (size_t i = 0; i < nlookups; ++i) {
+        keys[i] = unsorted[i % unsorted.size()];
+    }
+    std::unique_ptr<bool[]> found(new bool[nlookups]);
+    auto stats = benchmark::measure("search_many", {{"n", sorted.size()}}, [&] {
+        search_many(sorted, keys.data(), nlookups, found.get());
+    }, nlookups);
+    double many = stats.min;
+    for (size_t i = 0; i < nlookups; ++i) {
+        if (!found[i]) {
+            std::cout << "Fail search_many" << std::endl;
+        }
+    }
+    double single = bench_best("search", search, sorted, unsorted).min;
+    std::cout << "Search " << nlookups << " keys in " << sorted.size() << " elements.";
+    std::cout << " One by one " << single << "ns per search.";
+    std::cout << " search_many " << many << "ns per search. Speedup: " << single / many << ".";
+    std::cout << benchmark::format_counters(stats, "search") << std::endl;
+}
+
 void test_performance(int n)
 {
     std::vector<int> data(n);
@@ -71,6 +87,7 @@ void test_performance(int n)
     }
     std::sort(sdata.begin(), sdata.end());
     bench(sdata, data);
+    bench_many(sdata, data);
 }
 
 void validate(int n)
@@ -93,13 +110,24 @@ void validate(int n)
         int v = mt();
         assert(search(sdata, v) == (map.find(v) != map.end()));
     }
+    std::vector<int> keys = data;
+    for (int i = 0; i < n; ++i) {
+        keys.push_back(mt());
+    }
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    search_many(sdata, keys.data(), keys.size(), found.get());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(found[i] == (map.find(keys[i]) != map.end()));
+    }
 }
 
 void test_correctness()
 {
-    for (int i = 0; i < 100; ++i) {
-        validate(i);
-    }
+    benchmark::for_each_isa([] (Isa) {
+        for (int i = 0; i < 100; ++i) {
+            validate(i);
+        }
+    });
     std::cout << "test_correctness PASSED" << std::endl; 
 }
 
@@ -111,8 +139,31 @@ void test_performance()
     std::cout << "test_performance PASSED" << std::endl; 
 }
 
-int main()
+// The scan variants side by side, the widest one is what search() runs
+void test_performance_isa()
+{
+    int n = 49;
+    std::vector<int> data(n);
+    std::random_device device;
+    std::mt19937 mt(device());
+    for (auto& v : data) {
+        v = mt();
+    }
+    std::vector<int> sdata = data;
+    std::sort(sdata.begin(), sdata.end());
+    std::cout << "Search in " << n << " elements.";
+    benchmark::for_each_isa([&] (Isa isa) {
+        double good = bench_best(std::string("search ") + isa_name(isa), search, sdata, data).min;
+        std::cout << " " << isa_name(isa) << " " << good << "ns";
+    });
+    std::cout << " per search." << std::endl;
+    std::cout << "test_performance_isa PASSED" << std::endl;
+}
+
+int main(int argc, char** argv)
 {
+    benchmark::init(argc, argv);
     test_correctness();
     test_performance();
+    test_performance_isa();
 }
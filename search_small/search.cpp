@@ -3,37 +3,21 @@
 
 #include <immintrin.h>
 
-#define _i_vec_t        __m256i
-#define _i_init_vec     _mm256_set1_epi32
-#define _i_cmpeq_vec    _mm256_cmpeq_epi32
-#define _i_cast_vec     _mm256_movemask_epi8
-
-constexpr uint8_t INTS_IN_VEC_INT = sizeof(_i_vec_t) / sizeof(int);
-
+#include "simd_scan.h"
 
 bool search(const std::vector<int>& vec, int value)
 {
-    const _i_vec_t * _vec_data  = reinterpret_cast< const _i_vec_t * > ( vec.data() );
-    const _i_vec_t   _vec_value = _i_init_vec( value );
-
-    uint8_t size = static_cast<uint8_t>( vec.size() );
-
-    for (   uint8_t n_checked = 0;
-            n_checked < size;
-            n_checked += INTS_IN_VEC_INT, _vec_data += 1  // shift pointer to the next element
-    ) {
-
-        // WARNING! Would cause out of bounds for INTS_IN_VEC_INT bytes for some inputs, but we don't care
-        if ( _i_cast_vec( _i_cmpeq_vec( *_vec_data, _vec_value ) ) == 0 ) {
-
-            continue;  // likely
-
-        } else {
+    return search_small(vec.data(), vec.size(), value);
+}
 
-            return true;
 
-        }
 
+// The whole array sits in L1, there are no cache misses for a lockstep
+// search to overlap, and the SIMD scan already beats a branchless bisection
+void search_many(const std::vector<int>& vec, const int * keys, size_t n, bool * out)
+{
+    SearchSmall kernel = search_small_kernel.get();
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = search_small(kernel, vec.data(), vec.size(), keys[i]);
     }
-    return false;
 }
@@ -1,3 +1,8 @@
 #include <vector>
+#include <cstddef>
 
 bool search(const std::vector<int>& data, int value);
+
+// Looks up n keys at once: out[i] = search(data, keys[i]).
+// The array sits in L1, each key is a SIMD scan of it with the kernel picked once
+void search_many(const std::vector<int>& data, const int * keys, size_t n, bool * out);
@@ -2,38 +2,72 @@
 #include <random>
 #include <algorithm>
 #include <cassert>
-#include <chrono>
+#include <string>
 #include <set>
+#include <unordered_map>
+#include <memory>
+#include <stdexcept>
+#include <cstdio>
+
+#include <unistd.h>
 
 #include "set.h"
+#include "map.h"
+#include "workload.h"
+#include "bench.h"
 
-struct StlSet
+template <typename K>
+struct BasicStlSet
 {
-    void insert(int v) {set_.insert(v);}
-    bool contains(int v) {return set_.find(v) != set_.end();}
-    void erase(int v) {set_.erase(v);}
+    using key_type = K;
+
+    void insert(K v) {set_.insert(v);}
+    bool contains(K v) {return set_.find(v) != set_.end();}
+    void erase(K v) {set_.erase(v);}
     size_t size() {return set_.size();}
-    int min() {return *set_.begin();}
-    int max() {return *set_.rbegin();}
+    K min() {return *set_.begin();}
+    K max() {return *set_.rbegin();}
 
 private:
-    std::set<int> set_;
+    std::set<K> set_;
 };
 
-enum class Command {
-    kInsert,
-    kErase,
-    kFind,
-    kMin,
-    kMax
+using StlSet = BasicStlSet<int>;
+
+// A 16-byte key: an ID scoped by its tenant
+struct TenantKey
+{
+    uint64_t tenant;
+    uint64_t id;
+
+    bool operator==(const TenantKey& other) const {return tenant == other.tenant && id == other.id;}
+    bool operator<(const TenantKey& other) const {
+        return tenant < other.tenant || (tenant == other.tenant && id < other.id);
+    }
 };
 
-struct Item
+template <>
+struct std::numeric_limits<TenantKey>
 {
-    Command command;
-    int data;
+    static TenantKey min() {return {0, 0};}
+    static TenantKey max() {return {UINT64_MAX, UINT64_MAX};}
 };
 
+// The schedules draw int keys, wider keys are made from them one to one:
+// uint64_t IDs spread over all 64 bits, tenants of a few hundred keys
+template <typename K>
+K to_key(int32_t data)
+{
+    uint64_t wide = uint64_t(uint32_t(data)) * 0xd6e8feb86659fd93;
+    if constexpr (std::is_same_v<K, uint64_t>) {
+        return wide;
+    } else if constexpr (std::is_same_v<K, TenantKey>) {
+        return {uint32_t(data) >> 8, wide};
+    } else {
+        return data;
+    }
+}
+
 std::vector<Item> generate_schedule(int n, int k)
 {
     std::random_device device;
@@ -128,22 +162,61 @@ std::pair<std::vector<Item>, std::vector<Item>> generate_ro_schedule(int n, int
     return {schedule, find_schedule};
 }
 
+// Map interface over std::unordered_map, the reference for Map
+template <typename V>
+struct StlMap
+{
+    V * find(int k) {auto it = map_.find(k); return it == map_.end() ? nullptr : &it->second;}
+    template <typename... Args>
+    std::pair<V*, bool> try_emplace(int k, Args&&... args) {
+        auto [it, inserted] = map_.try_emplace(k, std::forward<Args>(args)...);
+        return {&it->second, inserted};
+    }
+    template <typename M>
+    bool insert_or_assign(int k, M&& v) {return map_.insert_or_assign(k, std::forward<M>(v)).second;}
+    bool erase(int k) {return map_.erase(k) > 0;}
+    size_t size() {return map_.size();}
+
+private:
+    std::unordered_map<int, V> map_;
+};
+
+// The small struct of a typical lookup, stored inline by Map
+struct Record
+{
+    int32_t id;
+    int32_t flags;
+    int64_t counter;
+};
+
+static_assert(sizeof(Record) <= MAP_INLINE_VALUE_SIZE, "Record must be inline");
+
+// Too large to be inline, boxed by Map
+struct LargeRecord
+{
+    int32_t id;
+    int32_t payload[15];
+};
+
 template<typename T>
 void execute(T& container, Item item)
 {
+    auto key = to_key<typename T::key_type>(item.data);
     if (item.command == Command::kInsert) {
-        container.insert(item.data);
+        container.insert(key);
     } else if (item.command == Command::kErase) {
-        container.erase(item.data);
+        container.erase(key);
     }
 }
 
-template<typename T>
-void validate(T& container, StlSet ethalon, const std::vector<Item> schedule)
+// Schedule is any range of Item: a vector or a mapped Trace
+template<typename T, typename Schedule>
+void validate(T& container, BasicStlSet<typename T::key_type> ethalon, const Schedule& schedule)
 {
     for (auto& item : schedule) {
         if (item.command == Command::kFind) {
-            assert(container.contains(item.data) == ethalon.contains(item.data));
+            auto key = to_key<typename T::key_type>(item.data);
+            assert(container.contains(key) == ethalon.contains(key));
         } else if (item.command == Command::kMax) {
             assert (container.size() == ethalon.size());
             if (container.size() > 0) {
@@ -161,13 +234,13 @@ void validate(T& container, StlSet ethalon, const std::vector<Item> schedule)
     }
 }
 
-template<typename T>
-int execute_schedule(T& container, const std::vector<Item> schedule)
+template<typename T, typename Schedule>
+int execute_schedule(T& container, const Schedule& schedule)
 {
     int result = 0;
     for (auto& item : schedule) {
         if (item.command == Command::kFind) {
-            if (container.contains(item.data)) {
+            if (container.contains(to_key<typename T::key_type>(item.data))) {
                 ++result;
             }
         } else {
@@ -177,57 +250,66 @@ int execute_schedule(T& container, const std::vector<Item> schedule)
     return result;
 }
 
+// Every run replays a fresh shuffle of the schedule into an empty set
 template <typename T>
-void bench_run(const std::vector<Item>& schedule)
+benchmark::Stats bench_best(const std::string& name, int n, std::vector<Item>& schedule)
 {
-    T s;
-    auto result = execute_schedule(s, schedule);
-    asm volatile("" :: "r" (result));
+    std::random_device device;
+    std::mt19937 mt(device());
+    auto stats = benchmark::measure_with_setup(name, {{"n", n}, {"operations", schedule.size()}},
+        [&] { std::shuffle(schedule.begin(), schedule.end(), mt); },
+        [&] {
+            T s;
+            benchmark::do_not_optimize(execute_schedule(s, schedule));
+        });
+    return stats;
 }
 
-template <typename T>
-long bench_single(const std::vector<Item>& schedule)
+// Replays the schedule in order, temporal locality included, into an empty set
+template <typename T, typename Schedule>
+benchmark::Stats bench_replay(const std::string& name, const benchmark::Params& params, const Schedule& schedule)
 {
-    auto start = std::chrono::high_resolution_clock::now();
-    bench_run<T>(schedule);
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    return duration;
+    return benchmark::measure(name, params, [&] {
+        T s;
+        benchmark::do_not_optimize(execute_schedule(s, schedule));
+    });
 }
 
-template <typename T>
-double bench_best(std::vector<Item>& schedule)
+// Set against std::set on one operation stream, ns per operation
+template <typename Schedule>
+double bench_stream(const std::string& name, const benchmark::Params& params, const Schedule& schedule)
 {
-    std::random_device device;
-    std::mt19937 mt(device());
-    auto best = bench_single<T>(schedule);
-    for (int i = 0; i < 10; ++i) {
-        std::shuffle(schedule.begin(), schedule.end(), mt);
-        best = std::min(best, bench_single<T>(schedule));
-    }
-    return double(best);
+    auto basic = bench_replay<StlSet>("std::set " + name, params, schedule);
+    auto good = bench_replay<Set>("Set " + name, params, schedule);
+    double ratio = basic.min / good.min;
+    std::cout << "Replayed " << schedule.size() << " " << name << " set operations.";
+    std::cout << " std::set int " << basic.min / schedule.size() << "ns, your " << good.min / schedule.size()
+              << "ns per operation. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(good.per(schedule.size()), "operation") << std::endl;
+    return ratio;
 }
 
-void bench(int n, std::vector<Item>& schedule, double bound)
+void bench(const std::string& name, int n, std::vector<Item>& schedule, double bound)
 {
-    double basic = bench_best<StlSet>(schedule);
-    double good = bench_best<Set>(schedule);
-    double ratio = basic/good;
+    auto basic = bench_best<StlSet>("std::set " + name, n, schedule);
+    auto good = bench_best<Set>("Set " + name, n, schedule);
+    double ratio = basic.min / good.min;
     std::cout << "Executed " << schedule.size() << " set operations on " << n << " elements.";
-    std::cout << " std::set int " << basic << "ns. Your in " << good << "ns. Speedup: " << ratio << std::endl;
+    std::cout << " std::set int " << basic.min << "ns. Your in " << good.min << "ns. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(good.per(schedule.size()), "operation") << std::endl;
     assert(ratio > bound); 
 }
 
 void test_performance(int n, int k)
 {
     auto schedule = generate_schedule(n, k);
-    bench(n, schedule, 1.5);
+    bench("uniform", n, schedule, 1.5);
 }
 
 void test_performance_minmax(int n, int k)
 {
     auto schedule = generate_schedule_minmax(n, k);
-    bench(n, schedule, 0.5);
+    bench("minmax", n, schedule, 0.5);
 }
 
 void validate(int n, int k)
@@ -238,11 +320,292 @@ void validate(int n, int k)
     validate(a, b, schedule);
 }
 
-void test_correctness()
+template <typename V, typename Make, typename Equal>
+void validate_map(const std::vector<Item>& schedule, const Make& make, const Equal& equal)
 {
-    for (int i = 1; i < 1000; ++i) {
-        validate(i, 10);
+    Map<int, V> map;
+    StlMap<V> ethalon;
+    for (size_t i = 0; i < schedule.size(); ++i) {
+        int key = schedule[i].data;
+        switch (schedule[i].command) {
+            case Command::kInsert:
+                if (i % 2) {
+                    assert(map.insert_or_assign(key, make(key, i)) == ethalon.insert_or_assign(key, make(key, i)));
+                } else {
+                    auto [value, inserted] = map.try_emplace(key, make(key, i));
+                    auto [expected, expected_inserted] = ethalon.try_emplace(key, make(key, i));
+                    assert(inserted == expected_inserted && equal(*value, *expected));
+                }
+                break;
+            case Command::kErase:
+                assert(map.erase(key) == ethalon.erase(key));
+                break;
+            default: {
+                V * value = map.find(key);
+                V * expected = ethalon.find(key);
+                assert((value == nullptr) == (expected == nullptr));
+                assert(value == nullptr || equal(*value, *expected));
+                assert(map.contains(key) == (expected != nullptr));
+            }
+        }
+        assert(map.size() == ethalon.size());
+    }
+    // Moved from maps are empty and destroy cleanly
+    Map<int, V> moved = std::move(map);
+    assert(moved.size() == ethalon.size() && map.size() == 0);
+    map = std::move(moved);
+    assert(map.size() == ethalon.size());
+}
+
+void validate_maps(const std::vector<Item>& schedule)
+{
+    validate_map<Record>(schedule, [] (int key, size_t i) {
+        return Record{key, int32_t(i), int64_t(i) << 32};
+    }, [] (const Record& a, const Record& b) {
+        return a.id == b.id && a.flags == b.flags && a.counter == b.counter;
+    });
+    validate_map<LargeRecord>(schedule, [] (int key, size_t i) {
+        LargeRecord record{key, {}};
+        record.payload[14] = int32_t(i);
+        return record;
+    }, [] (const LargeRecord& a, const LargeRecord& b) {
+        return a.id == b.id && std::equal(a.payload, a.payload + 15, b.payload);
+    });
+    // Move-only values
+    validate_map<std::unique_ptr<int>>(schedule, [] (int, size_t i) {
+        return std::make_unique<int>(int(i));
+    }, [] (const std::unique_ptr<int>& a, const std::unique_ptr<int>& b) {
+        return *a == *b;
+    });
+}
+
+// Value whose constructor throws on a negative argument, Size bytes large
+template <size_t Size>
+struct ThrowingValue {
+    explicit ThrowingValue(int value)
+        : value(value)
+    {
+        if (value < 0) {
+            throw std::invalid_argument("Negative value");
+        }
     }
+
+    int value;
+    char padding[Size - sizeof(int)];
+};
+
+// A failed try_emplace leaves the map as it was
+template <typename V>
+void validate_map_throwing()
+{
+    Map<int, V> map;
+    // Enough keys to fill the table Blocks and chain more
+    for (int key = 0; key < 1 << 16; ++key) {
+        bool thrown = false;
+        try {
+            map.try_emplace(key, key % 3 == 0 ? -1 : key);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown == (key % 3 == 0));
+    }
+    assert(map.size() == (1 << 16) - ((1 << 16) + 2) / 3);
+    for (int key = 0; key < 1 << 16; ++key) {
+        V * value = map.find(key);
+        assert((value == nullptr) == (key % 3 == 0));
+        assert(value == nullptr || value->value == key);
+        if (key % 2 != 0) {
+            assert(map.erase(key) == (key % 3 != 0));
+        } else {
+            // The key is free again, a value constructed for it is found
+            assert(map.try_emplace(key, key).second == (key % 3 == 0));
+            assert(map.find(key)->value == key);
+        }
+    }
+}
+
+WorkloadConfig workload_config(KeyDistribution distribution, size_t keys, size_t operations)
+{
+    WorkloadConfig config;
+    config.distribution = distribution;
+    config.keys = keys;
+    config.operations = operations;
+    config.reuse = 0.2;
+    std::random_device device;
+    config.seed = device();
+    return config;
+}
+
+constexpr KeyDistribution DISTRIBUTIONS[] = {
+    KeyDistribution::kUniform, KeyDistribution::kZipf, KeyDistribution::kSequential,
+    KeyDistribution::kClustered, KeyDistribution::kAdversarial,
+};
+
+template <typename S>
+void validate_set(const std::vector<Item>& schedule)
+{
+    // The table is 4MB, too big for a second one on the stack
+    auto a = std::make_unique<S>();
+    BasicStlSet<typename S::key_type> b;
+    validate(*a, b, schedule);
+}
+
+// Every key width with every hash policy
+void validate_key_types(const std::vector<Item>& schedule)
+{
+    validate_set<BasicSet<int32_t, DummyHash>>(schedule);
+    validate_set<BasicSet<int32_t, Crc32Hash<int32_t>>>(schedule);
+    validate_set<BasicSet<uint64_t>>(schedule);
+    validate_set<BasicSet<uint64_t, Crc32Hash<uint64_t>>>(schedule);
+    validate_set<BasicSet<TenantKey>>(schedule);
+    validate_set<BasicSet<TenantKey, Crc32Hash<TenantKey>>>(schedule);
+}
+
+void validate_workloads()
+{
+    for (auto distribution : DISTRIBUTIONS) {
+        for (size_t keys : {1, 100, 1 << 12}) {
+            auto config = workload_config(distribution, keys, 1 << 14);
+            config.min_share = config.max_share = 0.01;
+            auto schedule = generate_workload(config);
+            Set a;
+            StlSet b;
+            validate(a, b, schedule);
+            validate_key_types(schedule);
+            validate_maps(schedule);
+        }
+    }
+}
+
+void validate_trace()
+{
+    char path[] = "/tmp/set_trace_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    auto schedule = generate_workload(workload_config(KeyDistribution::kZipf, 1 << 10, 1 << 14));
+    save_trace(path, schedule);
+    {
+        Trace trace(path);
+        assert(trace.size() == schedule.size());
+        assert(std::equal(trace.begin(), trace.end(), schedule.begin(), [] (const Item& a, const Item& b) {
+            return a.command == b.command && a.data == b.data;
+        }));
+        Set a;
+        StlSet b;
+        validate(a, b, trace);
+    }
+    save_trace(path, {});
+    assert(Trace(path).size() == 0);
+    std::FILE * file = std::fopen(path, "wb");
+    std::fputs("not a trace, just text", file);
+    std::fclose(file);
+    bool thrown = false;
+    try {
+        Trace trace(path);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    // A closed trace takes neither records nor another close
+    TraceWriter writer(path);
+    writer.close();
+    thrown = false;
+    try {
+        writer.record(Command::kInsert, 1);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    thrown = false;
+    try {
+        writer.close();
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    unlink(path);
+    // Writes are buffered, a full disk shows up when the trace is closed
+    thrown = false;
+    try {
+        save_trace("/dev/full", {});
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+// The mapped copy of the set built by schedule answers like the set
+template <typename S>
+void validate_snapshot(const std::vector<Item>& schedule, const std::string& path)
+{
+    using K = typename S::key_type;
+    auto set = std::make_unique<S>();
+    execute_schedule(*set, schedule);
+    set->save(path);
+    auto mapped = S::open_mmap(path);
+    assert(mapped.size() == set->size());
+    for (auto& item : schedule) {
+        K key = to_key<K>(item.data);
+        assert(mapped.contains(key) == set->contains(key));
+        K other = to_key<K>(item.data + 1);
+        assert(mapped.contains(other) == set->contains(other));
+    }
+    if (set->size() > 0) {
+        assert(mapped.min() == set->min());
+        assert(mapped.max() == set->max());
+    }
+}
+
+void validate_snapshots()
+{
+    char path[] = "/tmp/set_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    validate_snapshot<Set>({}, path);
+    for (size_t keys : {1, 100, 1 << 14}) {
+        auto schedule = generate_workload(workload_config(KeyDistribution::kUniform, keys, 1 << 15));
+        validate_snapshot<Set>(schedule, path);
+        validate_snapshot<BasicSet<uint64_t, Crc32Hash<uint64_t>>>(schedule, path);
+        validate_snapshot<BasicSet<TenantKey>>(schedule, path);
+        // Chains hundreds of blocks long
+        auto adversarial = generate_workload(workload_config(KeyDistribution::kAdversarial, keys, 1 << 15));
+        validate_snapshot<BasicSet<int32_t, DummyHash>>(adversarial, path);
+    }
+    auto expect_throw = [&] (auto open) {
+        bool thrown = false;
+        try {
+            open();
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    };
+    // Another hash, another key type, not a snapshot, no file
+    expect_throw([&] { Set::open_mmap(path); });
+    expect_throw([&] { BasicSet<uint64_t, DummyHash>::open_mmap(path); });
+    std::FILE * file = std::fopen(path, "wb");
+    std::fputs("not a snapshot, just text", file);
+    std::fclose(file);
+    expect_throw([&] { Set::open_mmap(path); });
+    unlink(path);
+    expect_throw([&] { Set::open_mmap(path); });
+}
+
+void test_correctness()
+{
+    benchmark::for_each_isa([] (Isa) {
+        for (int i = 1; i < 1000; ++i) {
+            validate(i, 10);
+        }
+    });
+    validate_workloads();
+    // Inline and boxed values
+    validate_map_throwing<ThrowingValue<8>>();
+    validate_map_throwing<ThrowingValue<64>>();
+    validate_trace();
+    validate_snapshots();
     std::cout << "test_correctness PASSED" << std::endl; 
 }
 
@@ -262,9 +625,193 @@ void test_performance_minmax()
     std::cout << "test_performance_minmax PASSED" << std::endl; 
 }
 
-int main()
+// The block match variants side by side on the same schedule
+void test_performance_isa()
+{
+    int n = 1 << 16;
+    auto schedule = generate_schedule(n, 10);
+    std::cout << "Executed " << schedule.size() << " set operations on " << n << " elements.";
+    benchmark::for_each_isa([&] (Isa isa) {
+        auto good = bench_best<Set>(std::string("Set ") + isa_name(isa), n, schedule);
+        std::cout << " " << isa_name(isa) << " " << good.min << "ns";
+    });
+    std::cout << "." << std::endl;
+    std::cout << "test_performance_isa PASSED" << std::endl;
+}
+
+void test_performance_workloads()
+{
+    size_t keys = 1 << 16;
+    for (auto distribution : DISTRIBUTIONS) {
+        auto schedule = generate_workload(workload_config(distribution, keys, 1 << 20));
+        std::string name = distribution_name(distribution);
+        double ratio = bench_stream(name, {{"keys", keys}, {"operations", schedule.size()}}, schedule);
+        assert(ratio > 1.5);
+    }
+    std::cout << "test_performance_workloads PASSED" << std::endl;
+}
+
+// Set bucketed by Hash against std::set, per key width
+template <typename K, typename Hash>
+double bench_key_type(const std::string& name, const std::vector<Item>& schedule)
+{
+    benchmark::Params params{{"operations", schedule.size()}};
+    auto basic = bench_replay<BasicStlSet<K>>("std::set " + name, params, schedule);
+    auto good = bench_replay<BasicSet<K, Hash>>("Set " + name, params, schedule);
+    double ratio = basic.min / good.min;
+    std::cout << "Replayed " << schedule.size() << " set operations on " << name << " keys.";
+    std::cout << " std::set " << basic.min / schedule.size() << "ns, your " << good.min / schedule.size()
+              << "ns per operation. Speedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(good.per(schedule.size()), "operation") << std::endl;
+    return ratio;
+}
+
+void test_performance_key_types()
+{
+    for (auto distribution : {KeyDistribution::kUniform, KeyDistribution::kSequential}) {
+        auto schedule = generate_workload(workload_config(distribution, 1 << 16, 1 << 20));
+        std::string name = distribution_name(distribution);
+        std::vector<double> ratios = {
+            bench_key_type<int32_t, DummyHash>("int32 dummy " + name, schedule),
+            bench_key_type<int32_t, MultiplyShiftHash<int32_t>>("int32 multiply-shift " + name, schedule),
+            bench_key_type<int32_t, Crc32Hash<int32_t>>("int32 crc32 " + name, schedule),
+            bench_key_type<uint64_t, MultiplyShiftHash<uint64_t>>("uint64 multiply-shift " + name, schedule),
+            bench_key_type<uint64_t, Crc32Hash<uint64_t>>("uint64 crc32 " + name, schedule),
+            bench_key_type<TenantKey, MultiplyShiftHash<TenantKey>>("16-byte multiply-shift " + name, schedule),
+            bench_key_type<TenantKey, Crc32Hash<TenantKey>>("16-byte crc32 " + name, schedule),
+        };
+        for (double ratio : ratios) {
+            assert(ratio > 1.5);
+        }
+    }
+    // The keys DummyHash puts in a handful of buckets, spread by the others
+    auto schedule = generate_workload(workload_config(KeyDistribution::kAdversarial, 1 << 16, 1 << 14));
+    bench_key_type<int32_t, DummyHash>("int32 dummy adversarial", schedule);
+    double multiply_shift = bench_key_type<int32_t, MultiplyShiftHash<int32_t>>("int32 multiply-shift adversarial", schedule);
+    double crc32 = bench_key_type<int32_t, Crc32Hash<int32_t>>("int32 crc32 adversarial", schedule);
+    assert(multiply_shift > 1.5 && crc32 > 1.5);
+    std::cout << "test_performance_key_types PASSED" << std::endl;
+}
+
+// Warm start from a snapshot against rebuilding by insert, and lookups on the
+// mapping against the heap
+void test_performance_snapshot()
+{
+    char path[] = "/tmp/set_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    size_t n = 1 << 20;
+    std::mt19937 mt(std::random_device{}());
+    std::vector<int32_t> keys(n);
+    for (auto& key : keys) {
+        key = mt();
+    }
+    auto set = std::make_unique<Set>();
+    for (int32_t key : keys) {
+        set->insert(key);
+    }
+    set->save(path);
+    benchmark::Params params{{"n", n}};
+    auto rebuild = benchmark::measure("Set rebuild", params, [&] {
+        auto rebuilt = std::make_unique<Set>();
+        for (int32_t key : keys) {
+            rebuilt->insert(key);
+        }
+        benchmark::do_not_optimize(rebuilt->size());
+    });
+    auto open = benchmark::measure("Set open_mmap", params, [&] {
+        auto mapped = Set::open_mmap(path);
+        benchmark::do_not_optimize(mapped.contains(keys[0]));
+    });
+    std::shuffle(keys.begin(), keys.end(), mt);
+    auto heap = benchmark::measure("Set contains", params, [&] {
+        int found = 0;
+        for (int32_t key : keys) {
+            found += set->contains(key);
+        }
+        benchmark::do_not_optimize(found);
+    }, n);
+    auto mapped = Set::open_mmap(path);
+    auto file = benchmark::measure("MappedSet contains", params, [&] {
+        int found = 0;
+        for (int32_t key : keys) {
+            found += mapped.contains(key);
+        }
+        benchmark::do_not_optimize(found);
+    }, n);
+    std::cout << "Started a set of " << n << " keys. Rebuilt in " << rebuild.min / 1e6 << "ms, mapped in "
+              << open.min / 1e3 << "us. Speedup: " << rebuild.min / open.min << ".";
+    std::cout << " Lookups " << heap.min << "ns on the heap, " << file.min << "ns mapped." << std::endl;
+    assert(rebuild.min / open.min > 10);
+    assert(file.min < heap.min * 2);
+    unlink(path);
+    std::cout << "test_performance_snapshot PASSED" << std::endl;
+}
+
+template <typename M>
+int64_t execute_map_schedule(M& map, const std::vector<Item>& schedule)
+{
+    int64_t result = 0;
+    for (const Item& item : schedule) {
+        if (item.command == Command::kInsert) {
+            map.insert_or_assign(item.data, Record{item.data, 0, 1});
+        } else if (item.command == Command::kErase) {
+            map.erase(item.data);
+        } else if (const Record * record = map.find(item.data)) {
+            result += record->counter;
+        }
+    }
+    return result;
+}
+
+void test_performance_map()
+{
+    size_t keys = 1 << 16;
+    for (auto distribution : {KeyDistribution::kUniform, KeyDistribution::kZipf, KeyDistribution::kSequential}) {
+        auto schedule = generate_workload(workload_config(distribution, keys, 1 << 20));
+        std::string name = distribution_name(distribution);
+        benchmark::Params params{{"keys", keys}, {"operations", schedule.size()}};
+        auto basic = benchmark::measure("std::unordered_map " + name, params, [&] {
+            StlMap<Record> map;
+            benchmark::do_not_optimize(execute_map_schedule(map, schedule));
+        }, schedule.size());
+        auto good = benchmark::measure("Map " + name, params, [&] {
+            Map<int, Record> map;
+            benchmark::do_not_optimize(execute_map_schedule(map, schedule));
+        }, schedule.size());
+        double ratio = basic.min / good.min;
+        std::cout << "Replayed " << schedule.size() << " " << name << " map operations.";
+        std::cout << " std::unordered_map " << basic.min << "ns, your " << good.min << "ns per operation. Speedup: " << ratio << ".";
+        std::cout << benchmark::format_counters(good, "operation") << std::endl;
+        assert(ratio > 1.2);
+    }
+    std::cout << "test_performance_map PASSED" << std::endl;
+}
+
+// Traces given on the command line, recorded with TraceWriter
+void replay_traces()
+{
+    for (const std::string& path : benchmark::config().arguments) {
+        try {
+            Trace trace(path);
+            bench_stream(path, {{"trace", path}, {"operations", trace.size()}}, trace);
+        } catch (const std::runtime_error& error) {
+            std::cerr << error.what() << std::endl;
+        }
+    }
+}
+
+int main(int argc, char** argv)
 {
+    benchmark::init(argc, argv);
     test_correctness();
     test_performance();
     test_performance_minmax();
+    test_performance_isa();
+    test_performance_workloads();
+    test_performance_key_types();
+    test_performance_map();
+    test_performance_snapshot();
+    replay_traces();
 }
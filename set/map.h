@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "set.h"
+
+// Hash map from K to V on the Set engine: the same 64-byte key Blocks
+// chained per Hash bucket, matched with one SIMD compare. Values live in
+// a parallel array, one ValueBlock per key Block, so a probe reads nothing but
+// the key cache line and only a hit touches its value. Values up to
+// MAP_INLINE_VALUE_SIZE bytes sit in the slot itself, larger ones are boxed on
+// the heap so the value array stays dense.
+
+// Values at most this large are stored inline
+constexpr size_t MAP_INLINE_VALUE_SIZE = 16;
+
+template <typename K, typename V, typename Hash = MultiplyShiftHash<K>>
+class Map
+{
+    using Block = BasicBlock<K>;
+
+    static_assert(std::is_trivially_copyable_v<K>, "Keys are copied into blocks");
+    static_assert(sizeof(Block) == 64, "Block doesn't match cache line size");
+    static_assert(alignof(Block) == 64, "Block must start a cache line");
+
+    static constexpr bool INLINE = sizeof(V) <= MAP_INLINE_VALUE_SIZE && alignof(V) <= alignof(std::max_align_t);
+    using Stored = std::conditional_t<INLINE, V, std::unique_ptr<V>>;
+
+    // Slots are constructed and destroyed along the used bits of the Block
+    struct ValueBlock {
+        alignas(Stored) unsigned char slots[Block::SIZE][sizeof(Stored)];
+
+        Stored * slot(int idx) { return std::launder(reinterpret_cast<Stored*>(slots[idx])); }
+    };
+
+    // A chained Block with its values, keys first so the Block * converts back
+    struct Overflow {
+        Block keys;
+        ValueBlock values;
+    };
+
+public:
+    Map()
+        : keys_(new Block[TABLE_SIZE]())
+        , values_(new ValueBlock[TABLE_SIZE])
+    {   }
+
+    Map(Map&& other) noexcept
+        : keys_(std::move(other.keys_))
+        , values_(std::move(other.values_))
+        , size_(std::exchange(other.size_, 0))
+    {   }
+
+    Map& operator=(Map&& other) noexcept
+    {
+        if (this == &other) {
+            return *this;
+        }
+        destroy();
+        keys_ = std::move(other.keys_);
+        values_ = std::move(other.values_);
+        size_ = std::exchange(other.size_, 0);
+        return *this;
+    }
+
+    ~Map() {
+        destroy();
+    }
+
+    // Pointer to the value of key, nullptr if there is none
+    V * find(K key) {
+        Block * block = keys_.get() + Hash()(key);
+        for (; block != nullptr; block = block->next_) {
+            uint16_t found = block->match(key);
+            if (found != 0) {
+                return value(block, __builtin_ctz(found));
+            }
+        }
+        return nullptr;
+    }
+
+    const V * find(K key) const {
+        return const_cast<Map*>(this)->find(key);
+    }
+
+    bool contains(K key) const {
+        return find(key) != nullptr;
+    }
+
+    // Constructs V from args only if key is absent. The value of key and
+    // whether it was inserted
+    template <typename... Args>
+    std::pair<V*, bool> try_emplace(K key, Args&&... args) {
+        if (V * existing = find(key)) {
+            return {existing, false};
+        }
+        auto [block, idx] = emplace_key(key);
+        Stored * slot = values_of(block)->slot(idx);
+        // The key is already marked used, unmark it if there is no value for it
+        try {
+            if constexpr (INLINE) {
+                new (slot) V(std::forward<Args>(args)...);
+            } else {
+                new (slot) Stored(std::make_unique<V>(std::forward<Args>(args)...));
+            }
+        } catch (...) {
+            block->is_used_ &= ~(1u << idx);
+            throw;
+        }
+        ++size_;
+        return {value(block, idx), true};
+    }
+
+    // True if key was inserted, false if its value was assigned
+    template <typename M>
+    bool insert_or_assign(K key, M&& value) {
+        auto [existing, inserted] = try_emplace(key, std::forward<M>(value));
+        if (!inserted) {
+            *existing = std::forward<M>(value);
+        }
+        return inserted;
+    }
+
+    // True if key existed
+    bool erase(K key) {
+        Block * block = keys_.get() + Hash()(key);
+        for (; block != nullptr; block = block->next_) {
+            uint16_t found = block->match(key);
+            if (found != 0) {
+                values_of(block)->slot(__builtin_ctz(found))->~Stored();
+                block->is_used_ &= ~found;
+                --size_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    bool in_table(const Block * block) const {
+        return block >= keys_.get() && block < keys_.get() + TABLE_SIZE;
+    }
+
+    ValueBlock * values_of(Block * block) {
+        if (in_table(block)) {
+            return values_.get() + (block - keys_.get());
+        }
+        return &reinterpret_cast<Overflow*>(block)->values;
+    }
+
+    V * value(Block * block, int idx) {
+        Stored * slot = values_of(block)->slot(idx);
+        if constexpr (INLINE) {
+            return slot;
+        } else {
+            return slot->get();
+        }
+    }
+
+    // Slot for a key known to be absent, chaining a new Block if all are full
+    std::pair<Block*, int> emplace_key(K key) {
+        Block * block = keys_.get() + Hash()(key);
+        Block * prev_block = nullptr;
+        for (; block != nullptr; block = block->next_) {
+            int idx = block->emplace(key);
+            if (idx >= 0) /*likely*/ {
+                return {block, idx};
+            }
+            prev_block = block;
+        }
+        Overflow * overflow = new Overflow();
+        prev_block->next_ = &overflow->keys;
+        return {&overflow->keys, overflow->keys.emplace(key)};
+    }
+
+    // Destroys every value and chained Block, the table is left pointing to them
+    void destroy() {
+        if (keys_ == nullptr) {
+            return;
+        }
+        for (size_t bucket = 0; bucket < TABLE_SIZE; ++bucket) {
+            for (Block * block = keys_.get() + bucket; block != nullptr; ) {
+                if constexpr (!std::is_trivially_destructible_v<Stored>) {
+                    ValueBlock * values = values_of(block);
+                    for (uint16_t used = block->is_used_; used != 0; used &= used - 1) {
+                        values->slot(__builtin_ctz(used))->~Stored();
+                    }
+                }
+                Block * next = block->next_;
+                if (!in_table(block)) {
+                    delete reinterpret_cast<Overflow*>(block);
+                }
+                block = next;
+            }
+        }
+    }
+
+    // Key Blocks of the buckets, heap allocated so a Map moves in O(1)
+    std::unique_ptr<Block[]> keys_;
+    // Values of keys_[i] in values_[i]
+    std::unique_ptr<ValueBlock[]> values_;
+    size_t size_ = 0;
+};
@@ -1,100 +1,294 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <vector>
+#include <deque>
 #include <stack>
 #include <cmath>
 #include <limits>
+#include <type_traits>
+#include <stdexcept>
+#include <string>
+#include <cstdio>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// Intrusive node that fits into cache line
-struct Block {
-    static constexpr uint16_t SIZE = (64 - sizeof(Block*) - 4) / 4;
+#include <immintrin.h>
+
+#include "cpu_dispatch.h"
+
+
+// Intrusive node that fits into cache line: the list pointer, the two masks
+// and as many keys as the rest of the 64 bytes holds. 13 int32_t, 6 uint64_t,
+// 3 16-byte keys. Aligned so that a block never straddles two lines, also
+// when allocated on its own
+template <typename K>
+struct alignas(64) BasicBlock {
+    static constexpr uint16_t SIZE = (64 - sizeof(void*) - 4) / sizeof(K);
 
     // Intrusive list
-    Block * next_ = nullptr;
+    BasicBlock * next_ = nullptr;
     // The underlying data
-    int32_t data_[SIZE] = {0};
+    K data_[SIZE] = {};
     // bitmask of used indices
     uint16_t is_used_ = 0;
     // Index of the first element which has never been occupied (not necesserily the first free)
     uint16_t first_unoccupied_ = 0;
 
+    // Bitmask of used indices holding val
+    uint16_t match(K val) const;
+    // Same over any SIZE keys, for blocks stored outside BasicBlock
+    static uint16_t match(const K * data, uint16_t used, K val);
     // True if element exists
-    bool contains(int32_t val) const;
+    bool contains(K val) const;
     // False if there's no free space
     // WARNING : need to check whether element exists prior to insertion
-    bool insert(int32_t val);
+    bool insert(K val);
+    // Index val went to, -1 if there's no free space. Same warning as insert
+    int emplace(K val);
     // True if element existed
-    bool remove(int32_t val);
+    bool remove(K val);
 };
 
+using Block = BasicBlock<int32_t>;
+
 static_assert(sizeof(int) == 4, "Unsupported architecture");
-static_assert(sizeof(Block) == 64, "Block doesn't match cache line size");
+static_assert(Block::SIZE == 13, "The 32-bit match kernels load exactly 13 values");
+static_assert(BasicBlock<uint64_t>::SIZE == 6, "The 64-bit match kernels load exactly 6 values");
 
-bool Block::contains(int32_t value) const {
-    uint16_t current_msk = 1;
-    for (uint16_t idx = 0; idx < first_unoccupied_; ++idx, current_msk <<= 1) {
-        if ((is_used_ & current_msk) != 0 && data_[idx] == value) {
-            return true;
+// All values of the block are compared at once, in overlapping vectors that
+// stay inside data_. Bits past first_unoccupied_ are never set in used
+__attribute__((target("avx512f")))
+static uint16_t block_match32_avx512(const int32_t * data, uint16_t used, int32_t value) {
+    constexpr __mmask16 LANES = (1 << Block::SIZE) - 1;
+    __m512i values = _mm512_maskz_loadu_epi32(LANES, data);
+    return _mm512_mask_cmpeq_epi32_mask(LANES, values, _mm512_set1_epi32(value)) & used;
+}
+
+__attribute__((target("avx2")))
+static uint16_t block_match32_avx2(const int32_t * data, uint16_t used, int32_t value) {
+    __m256i vec_value = _mm256_set1_epi32(value);
+    auto match = [&] (size_t idx) __attribute__((target("avx2"))) {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + idx));
+        return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(values, vec_value))) << idx;
+    };
+    return (match(0) | match(Block::SIZE - 8)) & used;
+}
+
+static uint16_t block_match32_sse(const int32_t * data, uint16_t used, int32_t value) {
+    __m128i vec_value = _mm_set1_epi32(value);
+    auto match = [&] (size_t idx) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + idx));
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, vec_value))) << idx;
+    };
+    return (match(0) | match(4) | match(8) | match(Block::SIZE - 4)) & used;
+}
+
+__attribute__((target("avx512f")))
+static uint16_t block_match64_avx512(const int64_t * data, uint16_t used, int64_t value) {
+    constexpr __mmask8 LANES = (1 << BasicBlock<int64_t>::SIZE) - 1;
+    __m512i values = _mm512_maskz_loadu_epi64(LANES, data);
+    return _mm512_mask_cmpeq_epi64_mask(LANES, values, _mm512_set1_epi64(value)) & used;
+}
+
+__attribute__((target("avx2")))
+static uint16_t block_match64_avx2(const int64_t * data, uint16_t used, int64_t value) {
+    __m256i vec_value = _mm256_set1_epi64x(value);
+    auto match = [&] (size_t idx) __attribute__((target("avx2"))) {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + idx));
+        return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(values, vec_value))) << idx;
+    };
+    return (match(0) | match(BasicBlock<int64_t>::SIZE - 4)) & used;
+}
+
+static uint16_t block_match64_sse(const int64_t * data, uint16_t used, int64_t value) {
+    __m128i vec_value = _mm_set1_epi64x(value);
+    auto match = [&] (size_t idx) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + idx));
+        return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(values, vec_value))) << idx;
+    };
+    return (match(0) | match(2) | match(4)) & used;
+}
+
+using BlockMatch32 = uint16_t (*)(const int32_t * data, uint16_t used, int32_t value);
+using BlockMatch64 = uint16_t (*)(const int64_t * data, uint16_t used, int64_t value);
+
+static constexpr IsaDispatch<BlockMatch32> block_match32(block_match32_sse, block_match32_avx2, block_match32_avx512);
+static constexpr IsaDispatch<BlockMatch64> block_match64(block_match64_sse, block_match64_avx2, block_match64_avx512);
+
+// Integer keys go through the SIMD kernels of their width, other keys are
+// compared one by one with ==
+template <typename K>
+uint16_t BasicBlock<K>::match(const K * data, uint16_t used, K value) {
+    if constexpr (std::is_integral_v<K> && sizeof(K) == 4) {
+        return block_match32(reinterpret_cast<const int32_t*>(data), used, static_cast<int32_t>(value));
+    } else if constexpr (std::is_integral_v<K> && sizeof(K) == 8) {
+        return block_match64(reinterpret_cast<const int64_t*>(data), used, static_cast<int64_t>(value));
+    } else {
+        uint16_t found = 0;
+        for (uint16_t idx = 0; idx < SIZE; ++idx) {
+            found |= uint16_t(data[idx] == value) << idx;
         }
+        return found & used;
     }
-    return false;
 }
 
-bool Block::insert(int32_t value) {
+template <typename K>
+uint16_t BasicBlock<K>::match(K value) const {
+    return match(data_, is_used_, value);
+}
+
+template <typename K>
+bool BasicBlock<K>::contains(K value) const {
+    return match(value) != 0;
+}
+
+template <typename K>
+bool BasicBlock<K>::insert(K value) {
+    return emplace(value) >= 0;
+}
+
+template <typename K>
+int BasicBlock<K>::emplace(K value) {
     if (first_unoccupied_ < SIZE) {
         is_used_ |= (1 << first_unoccupied_);
         data_[first_unoccupied_] = value;
-        ++first_unoccupied_;
-        return true;
+        return first_unoccupied_++;
     }
     uint16_t current_msk = 1;
     for (uint16_t idx = 0; idx < SIZE; ++idx, current_msk <<= 1) {
         if ((is_used_ & current_msk) == 0) {
             is_used_ |= current_msk;
             data_[idx] = value;
-            return true;
+            return idx;
         }
     }
-    return false;
+    return -1;
 }
 
-bool Block::remove(int32_t value) {
-    uint16_t current_msk = 1;
-    for (uint16_t idx = 0; idx < first_unoccupied_; ++idx, current_msk <<= 1) {
-        if ((is_used_ & current_msk) != 0 && data_[idx] == value) {
-            is_used_ &= (~current_msk);
-            return true;
-        }
+template <typename K>
+bool BasicBlock<K>::remove(K value) {
+    uint16_t found = match(value);
+    if (found == 0) {
+        return false;
     }
-    return false;
+    // Values are unique, found has a single bit
+    is_used_ &= ~found;
+    return true;
 }
 
 
 
-constexpr size_t TABLE_SIZE = 1 << 16;
+constexpr size_t TABLE_BITS = 16;
+constexpr size_t TABLE_SIZE = 1 << TABLE_BITS;
 constexpr size_t HALF_SIZE  = TABLE_SIZE >> 1;
 
-// Best hash function for random inputs.
-// -mod < val % mod <= 0 for negative val
-// Maps all integers to the range [0, TABLE_SIZE  - 1]
-inline int32_t dummy_hash(int32_t val) {
-    return HALF_SIZE + (val % HALF_SIZE);
+// Hash policies map a key to its bucket in [0, TABLE_SIZE), NAME tells them
+// apart in snapshot files. Keys that are not
+// integers are hashed by their bytes, so they must not have padding: equal
+// keys need equal bytes
+
+// The key as zero padded 64-bit words
+template <typename K>
+constexpr size_t KEY_WORDS = (sizeof(K) + 7) / 8;
+
+template <typename K>
+inline void key_words(const K& key, uint64_t (&words)[KEY_WORDS<K>]) {
+    static_assert(std::has_unique_object_representations_v<K>, "Keys are hashed by their bytes");
+    std::fill(words, words + KEY_WORDS<K>, 0);
+    std::memcpy(words, &key, sizeof(K));
 }
 
+// The first hash of Set: best for random int inputs, but keys equal modulo
+// HALF_SIZE all share a bucket
+// -mod < val % mod <= 0 for negative val
+struct DummyHash {
+    static constexpr const char * NAME = "dummy";
+
+    size_t operator()(int32_t val) const {
+        return HALF_SIZE + (val % HALF_SIZE);
+    }
+};
+
+// Dietzfelbinger's multiply-shift: the top TABLE_BITS of the key times an odd
+// constant, summed over the words for wider keys. One multiplication per word
+template <typename K>
+struct MultiplyShiftHash {
+    static constexpr const char * NAME = "multiply-shift";
+
+    size_t operator()(const K& key) const {
+        static constexpr uint64_t MULTIPLIERS[] = {
+            0x9e3779b97f4a7c15, 0xc2b2ae3d27d4eb4f, 0x165667b19e3779f9, 0xd6e8feb86659fd93,
+        };
+        static_assert(KEY_WORDS<K> <= std::size(MULTIPLIERS), "Key too wide for MultiplyShiftHash");
+        uint64_t words[KEY_WORDS<K>];
+        key_words(key, words);
+        uint64_t hash = 0;
+        for (size_t i = 0; i < KEY_WORDS<K>; ++i) {
+            hash += words[i] * MULTIPLIERS[i];
+        }
+        return hash >> (64 - TABLE_BITS);
+    }
+};
+
+// The SSE4.2 crc32 instruction over the words of the key. A bijection on 32-bit
+// keys, 3 cycles of latency per word
+template <typename K>
+struct Crc32Hash {
+    static constexpr const char * NAME = "crc32";
+
+    size_t operator()(const K& key) const {
+        uint64_t words[KEY_WORDS<K>];
+        key_words(key, words);
+        uint64_t crc = 0;
+        for (size_t i = 0; i < KEY_WORDS<K>; ++i) {
+            crc = sizeof(K) <= 4 ? _mm_crc32_u32(crc, words[i]) : _mm_crc32_u64(crc, words[i]);
+        }
+        return crc >> (32 - TABLE_BITS);
+    }
+};
+
+
+template <typename K, typename Hash>
+class MappedSet;
+
+// Hash set of keys K bucketed by Hash, see the hash policies above. K is any
+// trivially copyable type with ==, at most 52 bytes; min and max also need <
+// and std::numeric_limits
+template <typename K, typename Hash = MultiplyShiftHash<K>>
+class BasicSet {
+    using Block = BasicBlock<K>;
+
+    static_assert(std::is_trivially_copyable_v<K>, "Keys are copied into blocks");
+    static_assert(sizeof(K) >= 4 && sizeof(K) <= 52, "A block holds between 1 and 13 keys");
+    static_assert(sizeof(Block) == 64, "Block doesn't match cache line size");
+    static_assert(alignof(Block) == 64, "Block must start a cache line");
 
-class Set {
 public:
-    Set();
-    ~Set();
+    using key_type = K;
+
+    BasicSet();
+    ~BasicSet();
 
-    void insert(int);
-    void erase(int);
+    void insert(K);
+    void erase(K);
 
-    bool contains(int) const;
+    bool contains(K) const;
     size_t size() const;
-    int min() const;
-    int max() const;
+    K min() const;
+    K max() const;
+
+    // Writes the set to path, see SnapshotHeader. The file is written next
+    // to path and renamed over it, readers never map a partial one. Throws
+    // std::runtime_error if it cannot be written
+    void save(const std::string& path) const;
+    // The set saved at path, read-only, used in place from the page cache
+    static MappedSet<K, Hash> open_mmap(const std::string& path);
 
 private:
     // Number of elements
@@ -105,11 +299,15 @@ private:
     std::deque<Block*> batches_used_;
 };
 
-Set::Set() : size_(0)
+using Set = BasicSet<int32_t>;
+
+template <typename K, typename Hash>
+BasicSet<K, Hash>::BasicSet() : size_(0)
 {   } 
 
-Set::~Set() {
-    for (const Block head : hash_table_) {
+template <typename K, typename Hash>
+BasicSet<K, Hash>::~BasicSet() {
+    for (const Block& head : hash_table_) {
         for (Block *next = head.next_, *to_delete = nullptr; next != nullptr; ) {
             to_delete = next;
             next = next->next_;
@@ -118,8 +316,9 @@ Set::~Set() {
     }
 }
 
-void Set::insert(int val) {
-    auto idx = dummy_hash(val);
+template <typename K, typename Hash>
+void BasicSet<K, Hash>::insert(K val) {
+    auto idx = Hash()(val);
     bool emplaced = false;
     Block * prev_block = nullptr;
     Block * current_block = hash_table_ + idx;
@@ -127,10 +326,11 @@ void Set::insert(int val) {
         // This condition can go off only once for each batch
         batches_used_.push_back(current_block);
     }
+    // An erase may have freed a slot in a block before the one holding val
+    if (contains(val)) {
+        return;
+    }
     for (; current_block != nullptr; current_block = current_block->next_) {
-        if (current_block->contains(val)) {
-            return;
-        }
         emplaced = current_block->insert(val);
         if (emplaced) /*likely*/ {
             ++size_;
@@ -145,8 +345,9 @@ void Set::insert(int val) {
     ++size_;
 }
 
-void Set::erase(int val) {
-    auto idx = dummy_hash(val);
+template <typename K, typename Hash>
+void BasicSet<K, Hash>::erase(K val) {
+    auto idx = Hash()(val);
     Block * current_block = hash_table_ + idx;
     for (; current_block != nullptr; current_block = current_block->next_) {
         if (current_block->remove(val)) {
@@ -156,8 +357,9 @@ void Set::erase(int val) {
     }
 }
 
-bool Set::contains(int val) const {
-    auto idx = dummy_hash(val);
+template <typename K, typename Hash>
+bool BasicSet<K, Hash>::contains(K val) const {
+    auto idx = Hash()(val);
     const Block * current_block = hash_table_ + idx;
     for (; current_block != nullptr; current_block = current_block->next_) {
         if (current_block->contains(val)) {
@@ -167,12 +369,14 @@ bool Set::contains(int val) const {
     return false;
 }
 
-size_t Set::size() const {
+template <typename K, typename Hash>
+size_t BasicSet<K, Hash>::size() const {
     return size_;
 }
 
-int Set::min() const {
-    int min = std::numeric_limits<int>::max();
+template <typename K, typename Hash>
+K BasicSet<K, Hash>::min() const {
+    K min = std::numeric_limits<K>::max();
     for (const Block * head : batches_used_) {
         for (const Block * current = head; current != nullptr; current = current->next_) {
             for (int16_t idx = 0; idx < current->first_unoccupied_; ++idx) {
@@ -185,8 +389,9 @@ int Set::min() const {
     return min;
 }
 
-int Set::max() const {
-    int max = std::numeric_limits<int>::min();
+template <typename K, typename Hash>
+K BasicSet<K, Hash>::max() const {
+    K max = std::numeric_limits<K>::min();
     for (const Block * head : batches_used_) {
         for (const Block * current = head; current != nullptr; current = current->next_) {
             for (int16_t idx = 0; idx < current->first_unoccupied_; ++idx) {
@@ -198,3 +403,193 @@ int Set::max() const {
     }
     return max;
 }
+
+// Set file: a SnapshotHeader, then the table Blocks in bucket order, then the
+// chained ones, host byte order. A SnapshotBlock is a Block with next_ turned
+// into the index of the next Block in the file, so a mapping at any address
+// reads as is. Chains only go forward: each next_ is past its own index, 0
+// ends the list
+struct alignas(64) SnapshotHeader
+{
+    char magic[8];
+    // Hash::NAME, the buckets are only valid under the same policy
+    char hash[16];
+    uint32_t key_size;
+    uint32_t table_bits;
+    // Keys in the set
+    uint64_t size;
+    // Blocks in the file, TABLE_SIZE of them are the table
+    uint64_t blocks;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'E', 'T', 'S', 'N', 'A', 'P', '1'};
+
+template <typename K>
+struct SnapshotBlock
+{
+    uint64_t next_;
+    K data_[BasicBlock<K>::SIZE];
+    uint16_t is_used_;
+    uint16_t first_unoccupied_;
+};
+
+template <typename K, typename Hash>
+void BasicSet<K, Hash>::save(const std::string& path) const {
+    static_assert(sizeof(SnapshotBlock<K>) == sizeof(Block), "Snapshot blocks keep the Block layout");
+    std::string temporary = path + ".tmp";
+    std::FILE * file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("Cannot create snapshot " + temporary);
+    }
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    std::strncpy(header.hash, Hash::NAME, sizeof(header.hash) - 1);
+    header.key_size = sizeof(K);
+    header.table_bits = TABLE_BITS;
+    header.size = size_;
+    header.blocks = TABLE_SIZE;
+    for (const Block& head : hash_table_) {
+        for (const Block * chained = head.next_; chained != nullptr; chained = chained->next_) {
+            ++header.blocks;
+        }
+    }
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    auto write = [&] (const Block& block, uint64_t next) {
+        SnapshotBlock<K> stored;
+        stored.next_ = next;
+        std::copy(block.data_, block.data_ + Block::SIZE, stored.data_);
+        stored.is_used_ = block.is_used_;
+        stored.first_unoccupied_ = block.first_unoccupied_;
+        written = written && std::fwrite(&stored, sizeof(stored), 1, file) == 1;
+    };
+    // The chain of bucket i takes the indices after the chains of buckets < i
+    uint64_t index = TABLE_SIZE;
+    for (const Block& head : hash_table_) {
+        write(head, head.next_ != nullptr ? index : 0);
+        for (const Block * chained = head.next_; chained != nullptr; chained = chained->next_) {
+            ++index;
+        }
+    }
+    // Then the chains themselves, each Block followed by the next of its list
+    index = TABLE_SIZE;
+    for (const Block& head : hash_table_) {
+        for (const Block * chained = head.next_; chained != nullptr; chained = chained->next_) {
+            ++index;
+            write(*chained, chained->next_ != nullptr ? index : 0);
+        }
+    }
+    written = std::fclose(file) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Cannot write snapshot " + path);
+    }
+}
+
+// A Set saved with BasicSet::save, mapped read-only. Opening reads the header
+// only, pages come in on first touch and are shared by every process mapping
+// the same file. Throws std::runtime_error on a missing or malformed file, or
+// one saved with another key type or hash
+template <typename K, typename Hash = MultiplyShiftHash<K>>
+class MappedSet
+{
+    using Block = SnapshotBlock<K>;
+
+public:
+    using key_type = K;
+
+    explicit MappedSet(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open snapshot " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Not a snapshot " + path);
+        }
+        length_ = st.st_size;
+        data_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data_ == MAP_FAILED) {
+            throw std::runtime_error("Cannot map snapshot " + path);
+        }
+        const SnapshotHeader * header = static_cast<const SnapshotHeader*>(data_);
+        if (std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            std::strncmp(header->hash, Hash::NAME, sizeof(header->hash)) != 0 ||
+            header->key_size != sizeof(K) || header->table_bits != TABLE_BITS ||
+            header->blocks < TABLE_SIZE ||
+            header->blocks > (length_ - sizeof(SnapshotHeader)) / sizeof(Block)) {
+            munmap(data_, length_);
+            throw std::runtime_error("Not a snapshot of this set type " + path);
+        }
+        size_ = header->size;
+        blocks_ = header->blocks;
+        // Lookups hit one random line per probe, readahead would only evict
+        madvise(data_, length_, MADV_RANDOM);
+    }
+
+    MappedSet(const MappedSet&) = delete;
+    MappedSet& operator=(const MappedSet&) = delete;
+
+    ~MappedSet()
+    {
+        munmap(data_, length_);
+    }
+
+    // Chains of a corrupt file end at the first next_ out of order or range
+    bool contains(K val) const {
+        const Block * blocks = begin();
+        for (uint64_t idx = Hash()(val); ; ) {
+            if (BasicBlock<K>::match(blocks[idx].data_, blocks[idx].is_used_, val) != 0) {
+                return true;
+            }
+            uint64_t next = blocks[idx].next_;
+            if (next <= idx || next >= blocks_) {
+                return false;
+            }
+            idx = next;
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // Scan every block, in file order
+    K min() const {
+        K min = std::numeric_limits<K>::max();
+        for (const Block * block = begin(); block != begin() + blocks_; ++block) {
+            for (uint16_t used = block->is_used_; used != 0; used &= used - 1) {
+                min = std::min(min, block->data_[__builtin_ctz(used)]);
+            }
+        }
+        return min;
+    }
+
+    K max() const {
+        K max = std::numeric_limits<K>::min();
+        for (const Block * block = begin(); block != begin() + blocks_; ++block) {
+            for (uint16_t used = block->is_used_; used != 0; used &= used - 1) {
+                max = std::max(max, block->data_[__builtin_ctz(used)]);
+            }
+        }
+        return max;
+    }
+
+private:
+    const Block * begin() const
+    {
+        return reinterpret_cast<const Block*>(static_cast<const char*>(data_) + sizeof(SnapshotHeader));
+    }
+
+    void * data_ = nullptr;
+    size_t length_ = 0;
+    size_t size_ = 0;
+    uint64_t blocks_ = 0;
+};
+
+template <typename K, typename Hash>
+MappedSet<K, Hash> BasicSet<K, Hash>::open_mmap(const std::string& path) {
+    return MappedSet<K, Hash>(path);
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "set.h"
+
+// Operation streams for the set benchmarks: generators shaped like real
+// traffic, and a binary trace format to record real traffic and replay it.
+
+enum class Command : uint32_t {
+    kInsert,
+    kErase,
+    kFind,
+    kMin,
+    kMax
+};
+
+// One operation, also the record of a trace file: 8 bytes, host byte order
+struct Item
+{
+    Command command;
+    int32_t data;
+};
+
+static_assert(sizeof(Item) == 8, "Item is the on-disk trace record");
+
+enum class KeyDistribution {
+    // Every key of the universe equally likely
+    kUniform,
+    // Key of popularity rank r drawn with probability ~ 1 / r^zipf_skew
+    kZipf,
+    // Runs of burst consecutive IDs from random starting points
+    kSequential,
+    // Keys within cluster_width of a few random centers
+    kClustered,
+    // Keys that all land in colliding_buckets buckets of DummyHash
+    kAdversarial,
+};
+
+inline const char * distribution_name(KeyDistribution distribution)
+{
+    switch (distribution) {
+        case KeyDistribution::kUniform: return "uniform";
+        case KeyDistribution::kZipf: return "zipf";
+        case KeyDistribution::kSequential: return "sequential";
+        case KeyDistribution::kClustered: return "clustered";
+        case KeyDistribution::kAdversarial: return "adversarial";
+    }
+    return "unknown";
+}
+
+struct WorkloadConfig
+{
+    KeyDistribution distribution = KeyDistribution::kUniform;
+    // Distinct keys the operations draw from
+    size_t keys = 1 << 16;
+    size_t operations = 1 << 20;
+    // Share of each operation, finds take the rest
+    double insert_share = 0.2;
+    double erase_share = 0.1;
+    double min_share = 0;
+    double max_share = 0;
+    // Temporal locality: chance to repeat one of the last reuse_window keys
+    double reuse = 0;
+    size_t reuse_window = 64;
+
+    double zipf_skew = 0.99;
+    size_t burst = 64;
+    size_t clusters = 16;
+    int32_t cluster_width = 1 << 12;
+    size_t colliding_buckets = 4;
+
+    uint32_t seed = 42;
+};
+
+// Draws keys of one distribution, see KeyDistribution
+class KeyGenerator
+{
+public:
+    explicit KeyGenerator(const WorkloadConfig& config)
+        : config_(config)
+        , mt_(config.seed)
+        , universe_(std::max<size_t>(config.keys, 1))
+    {
+        std::uniform_int_distribution<int32_t> any;
+        for (auto& key : universe_) {
+            key = any(mt_);
+        }
+        if (config_.distribution == KeyDistribution::kZipf) {
+            // Popularity ranks are the universe order, keys are random, so
+            // hot keys are not neighbours in the table
+            cdf_.resize(universe_.size());
+            double total = 0;
+            for (size_t rank = 0; rank < cdf_.size(); ++rank) {
+                total += 1 / std::pow(double(rank + 1), config_.zipf_skew);
+                cdf_[rank] = total;
+            }
+            for (double& p : cdf_) {
+                p /= total;
+            }
+        }
+        if (config_.distribution == KeyDistribution::kClustered) {
+            universe_.resize(std::max<size_t>(config_.clusters, 1));
+        }
+    }
+
+    int32_t next()
+    {
+        switch (config_.distribution) {
+            case KeyDistribution::kUniform:
+                return universe_[index(universe_.size())];
+            case KeyDistribution::kZipf: {
+                double p = std::uniform_real_distribution<double>(0, 1)(mt_);
+                size_t rank = std::lower_bound(cdf_.begin(), cdf_.end(), p) - cdf_.begin();
+                return universe_[std::min(rank, universe_.size() - 1)];
+            }
+            case KeyDistribution::kSequential:
+                if (left_in_burst_ == 0) {
+                    // IDs are allocated in order: the universe is [0, keys)
+                    next_id_ = static_cast<int32_t>(index(universe_.size()));
+                    left_in_burst_ = std::max<size_t>(config_.burst, 1);
+                }
+                --left_in_burst_;
+                return next_id_++;
+            case KeyDistribution::kClustered: {
+                // Wraps around past INT_MAX instead of overflowing
+                uint32_t center = static_cast<uint32_t>(universe_[index(universe_.size())]);
+                return static_cast<int32_t>(center + index(std::max<int32_t>(config_.cluster_width, 1)));
+            }
+            case KeyDistribution::kAdversarial: {
+                // DummyHash only looks at val % HALF_SIZE. Keys stay positive:
+                // at most 2^31 / HALF_SIZE of them share a bucket
+                size_t buckets = std::clamp<size_t>(config_.colliding_buckets, 1, HALF_SIZE);
+                size_t per_bucket = std::clamp<size_t>(universe_.size() / buckets, 1, (size_t(1) << 31) / HALF_SIZE);
+                return static_cast<int32_t>(index(buckets) + HALF_SIZE * index(per_bucket));
+            }
+        }
+        return 0;
+    }
+
+private:
+    size_t index(size_t size)
+    {
+        return std::uniform_int_distribution<size_t>(0, size - 1)(mt_);
+    }
+
+    WorkloadConfig config_;
+    std::mt19937 mt_;
+    std::vector<int32_t> universe_;
+    // Zipf: probability of the ranks up to and including each one
+    std::vector<double> cdf_;
+    // Sequential: the burst in progress
+    int32_t next_id_ = 0;
+    size_t left_in_burst_ = 0;
+};
+
+inline std::vector<Item> generate_workload(const WorkloadConfig& config)
+{
+    KeyGenerator keys(config);
+    std::mt19937 mt(config.seed + 1);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::deque<int32_t> recent;
+    std::vector<Item> schedule;
+    schedule.reserve(config.operations);
+    for (size_t i = 0; i < config.operations; ++i) {
+        int32_t key;
+        if (!recent.empty() && unit(mt) < config.reuse) {
+            key = recent[std::uniform_int_distribution<size_t>(0, recent.size() - 1)(mt)];
+        } else {
+            key = keys.next();
+            recent.push_back(key);
+            if (recent.size() > config.reuse_window) {
+                recent.pop_front();
+            }
+        }
+        double op = unit(mt);
+        Command command = Command::kFind;
+        if ((op -= config.insert_share) < 0) {
+            command = Command::kInsert;
+        } else if ((op -= config.erase_share) < 0) {
+            command = Command::kErase;
+        } else if ((op -= config.min_share) < 0) {
+            command = Command::kMin;
+        } else if ((op -= config.max_share) < 0) {
+            command = Command::kMax;
+        }
+        schedule.push_back({command, key});
+    }
+    return schedule;
+}
+
+// Trace file: a header, then Item records up to the end of the file
+struct TraceHeader
+{
+    char magic[8];
+    uint64_t count;
+};
+
+constexpr char TRACE_MAGIC[8] = {'S', 'E', 'T', 'T', 'R', 'A', 'C', '1'};
+
+// Appends operations as they happen, the header is completed on close.
+// Throws std::runtime_error if the file cannot be written
+class TraceWriter
+{
+public:
+    explicit TraceWriter(const std::string& path)
+        : file_(std::fopen(path.c_str(), "wb"))
+    {
+        if (file_ == nullptr) {
+            throw std::runtime_error("Cannot create trace " + path);
+        }
+        if (!write_header()) {
+            std::fclose(file_);
+            throw std::runtime_error("Cannot write trace " + path);
+        }
+    }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // Finishes a trace not closed, e.g. on an exception, dropping errors:
+    // call close() to get them
+    ~TraceWriter()
+    {
+        if (file_ != nullptr) {
+            try {
+                close();
+            } catch (const std::runtime_error&) {
+            }
+        }
+    }
+
+    // Throws std::runtime_error once the trace is closed
+    void record(Command command, int32_t data)
+    {
+        if (file_ == nullptr) {
+            throw std::runtime_error("Trace is closed");
+        }
+        Item item{command, data};
+        if (std::fwrite(&item, sizeof(item), 1, file_) != 1) {
+            throw std::runtime_error("Cannot write trace");
+        }
+        ++count_;
+    }
+
+    // Writes the final count and closes the file. Throws std::runtime_error
+    // if the trace did not make it to the file whole or is already closed
+    void close()
+    {
+        if (file_ == nullptr) {
+            throw std::runtime_error("Trace is closed");
+        }
+        bool written = std::fseek(file_, 0, SEEK_SET) == 0 && write_header();
+        written = std::fclose(file_) == 0 && written;
+        file_ = nullptr;
+        if (!written) {
+            throw std::runtime_error("Cannot write trace");
+        }
+    }
+
+private:
+    bool write_header()
+    {
+        TraceHeader header;
+        std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.count = count_;
+        return std::fwrite(&header, sizeof(header), 1, file_) == 1;
+    }
+
+    std::FILE * file_;
+    uint64_t count_ = 0;
+};
+
+inline void save_trace(const std::string& path, const std::vector<Item>& schedule)
+{
+    TraceWriter writer(path);
+    for (const Item& item : schedule) {
+        writer.record(item.command, item.data);
+    }
+    writer.close();
+}
+
+// A trace file mapped read-only, iterated like the schedule vector without
+// reading it into memory first. Throws std::runtime_error on a missing or
+// malformed file
+class Trace
+{
+public:
+    explicit Trace(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open trace " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(TraceHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Not a trace " + path);
+        }
+        size_ = st.st_size;
+        data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data_ == MAP_FAILED) {
+            throw std::runtime_error("Cannot map trace " + path);
+        }
+        const TraceHeader * header = static_cast<const TraceHeader*>(data_);
+        if (std::memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+            header->count > (size_ - sizeof(TraceHeader)) / sizeof(Item)) {
+            munmap(data_, size_);
+            throw std::runtime_error("Not a trace " + path);
+        }
+        count_ = header->count;
+        // Replay reads front to back
+        madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+
+    Trace(const Trace&) = delete;
+    Trace& operator=(const Trace&) = delete;
+
+    ~Trace()
+    {
+        munmap(data_, size_);
+    }
+
+    const Item * begin() const
+    {
+        return reinterpret_cast<const Item*>(static_cast<const char*>(data_) + sizeof(TraceHeader));
+    }
+
+    const Item * end() const { return begin() + count_; }
+    size_t size() const { return count_; }
+
+private:
+    void * data_ = nullptr;
+    size_t size_ = 0;
+    size_t count_ = 0;
+};
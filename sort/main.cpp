@@ -2,50 +2,42 @@
 #include <random>
 #include <algorithm>
 #include <cassert>
-#include <chrono>
 #include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "sort.h"
+#include "bench.h"
 
 void sort_stl(std::vector<int>& data)
 {
     std::sort(data.begin(), data.end());
 }
 
+// Each run sorts a fresh shuffle of the same data, the shuffle is not timed
 template <typename F>
-long bench_single(const F& sort, std::vector<int>& data)
-{
-    auto start = std::chrono::high_resolution_clock::now();
-    sort(data);
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    for (int i = 0; i < data.size() - 1; ++i) {
-        assert(data[i] <= data[i+1]);
-    }
-    return duration;
-}
-
-template <typename F>
-double bench_best(const F& sort, std::vector<int>& data)
+benchmark::Stats bench_best(const std::string& name, const F& sort, std::vector<int>& data)
 {
     std::random_device device;
     std::mt19937 mt(device());
-    std::shuffle(data.begin(), data.end(), mt);
-    auto best = bench_single(sort, data);
-    for (int i = 0; i < 10; ++i) {
-        std::shuffle(data.begin(), data.end(), mt);
-        best = std::min(best, bench_single(sort, data));
+    auto stats = benchmark::measure_with_setup(name, {{"n", data.size()}},
+        [&] { std::shuffle(data.begin(), data.end(), mt); },
+        [&] { sort(data); benchmark::do_not_optimize(data.data()); });
+    for (size_t i = 0; i + 1 < data.size(); ++i) {
+        assert(data[i] <= data[i+1]);
     }
-    return double(best);
+    return stats;
 }
 
 void bench(std::vector<int>& data)
 {
-    double basic = bench_best(sort_stl, data);
-    double good = bench_best(sort, data);
-    double ratio = basic / good;
+    auto basic = bench_best("std::sort", sort_stl, data);
+    auto good = bench_best("sort", [] (std::vector<int>& v) { sort(v); }, data);
+    double ratio = basic.min / good.min;
     std::cout << "Sort " << data.size() << " integers. ";
-    std::cout << " std::sort in " << basic << "ns. Your in " << good << "ns. Speeedup: " << ratio << std::endl; 
+    std::cout << " std::sort in " << basic.min << "ns. Your in " << good.min << "ns. Speeedup: " << ratio << ".";
+    std::cout << benchmark::format_counters(good.per(data.size()), "element") << std::endl;
     assert(ratio > 1.5);
 }
 
@@ -77,11 +69,133 @@ void validate(int n)
     }
 }
 
+// String corpora shaped like the keys we sort: URLs with long shared
+// prefixes, fixed-width identifiers, words of a Zipf-like vocabulary
+std::vector<std::string> generate_urls(size_t n, std::mt19937& mt)
+{
+    static const char * SEGMENTS[] = {"api", "v1", "v2", "users", "items", "search", "static", "img", "docs", "en"};
+    std::vector<std::string> data(n);
+    for (auto& url : data) {
+        url = (mt() % 4 ? "https://www." : "http://") + std::string("site") + std::to_string(mt() % 1000) + ".com";
+        for (size_t i = mt() % 5; i > 0; --i) {
+            url += '/';
+            url += SEGMENTS[mt() % std::size(SEGMENTS)];
+        }
+        if (mt() % 2) {
+            url += "?id=" + std::to_string(mt() % 1000000);
+        }
+    }
+    return data;
+}
+
+std::vector<std::string> generate_identifiers(size_t n, std::mt19937& mt)
+{
+    std::vector<std::string> data(n);
+    for (auto& id : data) {
+        std::string digits = std::to_string(mt() % 10000000000ull);
+        id = "order-" + std::string(10 - digits.size(), '0') + digits;
+    }
+    return data;
+}
+
+std::vector<std::string> generate_words(size_t n, std::mt19937& mt)
+{
+    std::vector<std::string> vocabulary(1 << 16);
+    for (auto& word : vocabulary) {
+        word.resize(3 + mt() % 10);
+        for (char& c : word) {
+            c = 'a' + mt() % 26;
+        }
+    }
+    std::vector<std::string> data(n);
+    for (auto& word : data) {
+        // Rank r drawn about as often as 1 / r
+        double rank = std::exp(std::uniform_real_distribution<double>(0, std::log(double(vocabulary.size())))(mt));
+        word = vocabulary[std::min(size_t(rank), vocabulary.size()) - 1];
+    }
+    return data;
+}
+
+// Bytes that order differently as signed char, zeros inside strings, strings
+// that are prefixes of others, long shared prefixes
+std::vector<std::string> generate_binary(size_t n, std::mt19937& mt)
+{
+    std::vector<std::string> data(n);
+    std::string shared(mt() % 40, 'x');
+    for (auto& key : data) {
+        key = mt() % 2 ? shared : "";
+        for (size_t i = mt() % 12; i > 0; --i) {
+            key += static_cast<char>(mt() % 4 == 0 ? 0 : 0x7e + mt() % 4);
+        }
+    }
+    return data;
+}
+
+// Keys that differ only after a prefix of prefix_length bytes. Runs of 'a'
+// before the last byte split one key off at a time, each one byte deeper
+std::vector<std::string> generate_shared_prefix(size_t n, size_t prefix_length, std::mt19937& mt)
+{
+    std::string prefix(prefix_length, 'p');
+    std::vector<std::string> data(n);
+    for (size_t i = 0; i < n; ++i) {
+        data[i] = prefix + std::string(i, 'a') + static_cast<char>('b' + mt() % 3);
+    }
+    std::shuffle(data.begin(), data.end(), mt);
+    return data;
+}
+
+// Offset/length records of data packed into one arena
+std::vector<StringRef> make_arena(const std::vector<std::string>& data, std::string& arena)
+{
+    arena.clear();
+    std::vector<StringRef> records;
+    for (const auto& s : data) {
+        records.push_back({static_cast<uint32_t>(arena.size()), static_cast<uint32_t>(s.size())});
+        arena += s;
+    }
+    return records;
+}
+
+void validate_strings(std::vector<std::string> data)
+{
+    std::string arena;
+    std::vector<StringRef> records = make_arena(data, arena);
+    std::vector<std::string> sdata = data;
+    std::sort(sdata.begin(), sdata.end());
+    std::vector<const char*> buffers;
+    for (const auto& s : data) {
+        buffers.push_back(s.data());
+    }
+    sort(data);
+    assert(data == sdata);
+    // Long strings moved without reallocation: their buffers are all still there
+    std::sort(buffers.begin(), buffers.end());
+    for (const auto& s : data) {
+        assert(s.size() < 16 || std::binary_search(buffers.begin(), buffers.end(), s.data()));
+    }
+    sort(records, arena.data());
+    for (size_t i = 0; i < records.size(); ++i) {
+        assert(std::string_view(arena.data() + records[i].offset, records[i].length) == sdata[i]);
+    }
+}
+
 void test_correctness()
 {
     validate(10);
     validate(1000);
     validate(100000);
+    std::mt19937 mt(std::random_device{}());
+    for (size_t n : {0, 1, 2, 17, 100, 1000, 5000, 100000}) {
+        validate_strings(generate_urls(n, mt));
+        validate_strings(generate_identifiers(n, mt));
+        validate_strings(generate_words(n, mt));
+        validate_strings(generate_binary(n, mt));
+    }
+    validate_strings(std::vector<std::string>(5000, "same"));
+    // Prefixes far longer than any stack of one frame per byte or window
+    validate_strings(generate_shared_prefix(200, 20000, mt));
+    validate_strings(generate_shared_prefix(40, 1 << 20, mt));
+    validate_strings(generate_shared_prefix(5000, 100, mt));
     std::cout << "test_correctness PASSED" << std::endl;
 }
 
@@ -93,8 +207,58 @@ void test_performance()
     std::cout << "test_performance PASSED" << std::endl;
 }
 
-int main()
+// Each run sorts a fresh shuffle, the shuffle is not timed
+template <typename T, typename F>
+benchmark::Stats bench_strings(const std::string& name, std::vector<T>& data, const F& sort)
+{
+    std::mt19937 mt(std::random_device{}());
+    return benchmark::measure_with_setup(name, {{"n", data.size()}},
+        [&] { std::shuffle(data.begin(), data.end(), mt); },
+        [&] { sort(data); benchmark::do_not_optimize(data.data()); }, data.size());
+}
+
+void bench_strings(const std::string& name, std::vector<std::string> data)
+{
+    auto basic = bench_strings("std::sort " + name, data, [] (std::vector<std::string>& v) {
+        std::sort(v.begin(), v.end());
+    });
+    auto good = bench_strings("sort " + name, data, [] (std::vector<std::string>& v) {
+        sort(v);
+    });
+    std::string arena;
+    std::vector<StringRef> records = make_arena(data, arena);
+    auto basic_arena = bench_strings("std::sort arena " + name, records, [&] (std::vector<StringRef>& v) {
+        std::sort(v.begin(), v.end(), [&] (const StringRef& a, const StringRef& b) {
+            return std::string_view(arena.data() + a.offset, a.length) < std::string_view(arena.data() + b.offset, b.length);
+        });
+    });
+    auto good_arena = bench_strings("sort arena " + name, records, [&] (std::vector<StringRef>& v) {
+        sort(v, arena.data());
+    });
+    double ratio = basic.min / good.min, arena_ratio = basic_arena.min / good_arena.min;
+    std::cout << "Sort " << data.size() << " " << name << " strings.";
+    std::cout << " std::sort " << basic.min << "ns, your " << good.min << "ns per string. Speedup: " << ratio << ".";
+    std::cout << " Arena std::sort " << basic_arena.min << "ns, your " << good_arena.min << "ns. Speedup: " << arena_ratio << ".";
+    std::cout << benchmark::format_counters(good, "string") << std::endl;
+    assert(ratio > 1.5);
+    assert(arena_ratio > 1.5);
+}
+
+void test_performance_strings()
+{
+    std::mt19937 mt(std::random_device{}());
+    for (size_t n : {1 << 16, 1 << 20}) {
+        bench_strings("url", generate_urls(n, mt));
+        bench_strings("identifier", generate_identifiers(n, mt));
+        bench_strings("word", generate_words(n, mt));
+    }
+    std::cout << "test_performance_strings PASSED" << std::endl;
+}
+
+int main(int argc, char** argv)
 {
+    benchmark::init(argc, argv);
     test_correctness();
     test_performance();
+    test_performance_strings();
 }
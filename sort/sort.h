@@ -1,3 +1,21 @@
 #include <vector>
+#include <string>
+#include <cstdint>
 
 void sort(std::vector<int>& data);
+
+// Sorts strings bytewise (unsigned bytes, a prefix before its extensions), the
+// order of std::string::compare. MSD radix on 8-bit digits read from a cached
+// 8-byte prefix of every key, multikey quicksort for small buckets.
+// The strings are moved into place, their buffers are never reallocated
+void sort(std::vector<std::string>& data);
+
+// A string of an arena: length bytes at arena + offset
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// Sorts records in the order of the strings they refer to, as above. The arena
+// is only read
+void sort(std::vector<StringRef>& records, const char * arena);
@@ -0,0 +1,228 @@
+#include "sort.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+
+// MSD radix sort of byte strings. The keys are sorted as small records, each
+// with a cache of 8 bytes of its string: digits are read from the record
+// array, sequentially, and the string itself is only touched once per 8
+// levels to refill the cache. Buckets too small for a 257-way pass go to a
+// multikey quicksort over the same 8-byte windows, and the smallest ones to
+// insertion sort.
+
+struct StringKey {
+    // Bytes [depth, depth + 8) of the string, big endian, zero past the end:
+    // comparing windows as integers compares the bytes
+    uint64_t prefix;
+    const char * data;
+    uint32_t length;
+    // Position of the string in the input
+    uint32_t index;
+};
+
+// Below this many keys the 257 counters of a radix pass cost more than they sort
+constexpr size_t RADIX_MIN_SIZE = 64;
+constexpr size_t INSERTION_SORT_SIZE = 16;
+constexpr size_t WINDOW = sizeof(uint64_t);
+
+static uint64_t load_prefix(const char * data, size_t length, size_t depth)
+{
+    uint64_t word = 0;
+    if (depth + WINDOW <= length) {
+        std::memcpy(&word, data + depth, WINDOW);
+    } else if (depth < length) {
+        std::memcpy(&word, data + depth, length - depth);
+    }
+    return __builtin_bswap64(word);
+}
+
+static void load_prefixes(StringKey * keys, size_t n, size_t depth)
+{
+    for (size_t i = 0; i < n; ++i) {
+        keys[i].prefix = load_prefix(keys[i].data, keys[i].length, depth);
+    }
+}
+
+// Keys that share their first depth bytes and have their window at depth
+// loaded. Equal windows of keys ending inside them mean one is a prefix of
+// the other: the shorter goes first
+static bool less_from(const StringKey& a, const StringKey& b, size_t depth)
+{
+    if (a.prefix != b.prefix) {
+        return a.prefix < b.prefix;
+    }
+    if (a.length <= depth + WINDOW || b.length <= depth + WINDOW) {
+        return a.length < b.length;
+    }
+    size_t common = std::min(a.length, b.length) - depth - WINDOW;
+    int order = std::memcmp(a.data + depth + WINDOW, b.data + depth + WINDOW, common);
+    return order != 0 ? order < 0 : a.length < b.length;
+}
+
+static void insertion_sort(StringKey * keys, size_t n, size_t depth)
+{
+    for (size_t i = 1; i < n; ++i) {
+        StringKey key = keys[i];
+        size_t j = i;
+        for (; j > 0 && less_from(key, keys[j - 1], depth); --j) {
+            keys[j] = keys[j - 1];
+        }
+        keys[j] = key;
+    }
+}
+
+// Bentley-Sedgewick multikey quicksort with 8-byte characters: three-way
+// partition on the window, the equal part moves on to the next window. The
+// two smaller parts are sorted by recursion and the largest by the loop, so
+// the stack stays within log2(n) frames however long the shared prefixes
+static void multikey_quicksort(StringKey * keys, size_t n, size_t depth)
+{
+    while (n > INSERTION_SORT_SIZE) {
+        uint64_t a = keys[0].prefix, b = keys[n / 2].prefix, c = keys[n - 1].prefix;
+        uint64_t pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+        // [0, lt) < pivot, [lt, i) == pivot, [gt, n) > pivot
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            if (keys[i].prefix < pivot) {
+                std::swap(keys[lt++], keys[i++]);
+            } else if (keys[i].prefix > pivot) {
+                std::swap(keys[i], keys[--gt]);
+            } else {
+                ++i;
+            }
+        }
+        // Equal windows: keys ending inside them are ordered by length alone,
+        // the rest continue with the next window
+        StringKey * equal = keys + lt;
+        StringKey * longer = std::partition(equal, keys + gt, [depth] (const StringKey& key) {
+            return key.length <= depth + WINDOW;
+        });
+        std::sort(equal, longer, [] (const StringKey& x, const StringKey& y) { return x.length < y.length; });
+        size_t longer_size = keys + gt - longer;
+        load_prefixes(longer, longer_size, depth + WINDOW);
+        size_t greater_size = n - gt;
+        if (lt >= longer_size && lt >= greater_size) {
+            multikey_quicksort(longer, longer_size, depth + WINDOW);
+            multikey_quicksort(keys + gt, greater_size, depth);
+            n = lt;
+        } else if (longer_size >= greater_size) {
+            multikey_quicksort(keys, lt, depth);
+            multikey_quicksort(keys + gt, greater_size, depth);
+            keys = longer;
+            n = longer_size;
+            depth += WINDOW;
+        } else {
+            multikey_quicksort(keys, lt, depth);
+            multikey_quicksort(longer, longer_size, depth + WINDOW);
+            keys += gt;
+            n = greater_size;
+        }
+    }
+    insertion_sort(keys, n, depth);
+}
+
+// Buckets of byte offset byte of the windows at depth, one pass per byte.
+// Bucket 0 holds keys that end before that byte, all equal. Every bucket but
+// the largest is sorted by recursion, the largest by the loop: a recursive
+// call gets at most half of the keys, and a shared prefix is only passes
+// of the loop
+static void radix_sort(StringKey * keys, StringKey * buffer, size_t n, size_t depth, size_t byte)
+{
+    while (n >= RADIX_MIN_SIZE) {
+        size_t position = depth + byte;
+        int shift = 8 * (WINDOW - 1 - byte);
+        auto digit = [position, shift] (const StringKey& key) -> size_t {
+            return key.length <= position ? 0 : 1 + ((key.prefix >> shift) & 0xff);
+        };
+        // Keys sharing bytes up to position + 1 are sorted from the next byte,
+        // past the last cached one the windows are refilled from the strings
+        size_t next_depth = byte + 1 == WINDOW ? depth + WINDOW : depth;
+        size_t next_byte = byte + 1 == WINDOW ? 0 : byte + 1;
+        auto refill = [next_depth, next_byte] (StringKey * bucket, size_t size) {
+            if (next_byte == 0 && size >= RADIX_MIN_SIZE) {
+                load_prefixes(bucket, size, next_depth);
+            }
+        };
+
+        size_t offsets[258] = {};
+        for (size_t i = 0; i < n; ++i) {
+            ++offsets[digit(keys[i]) + 1];
+        }
+        size_t largest = std::max_element(offsets + 1, offsets + 258) - offsets - 1;
+        // Shared prefixes make passes with a single bucket, nothing to move
+        if (offsets[largest + 1] < n) {
+            for (size_t d = 1; d < 258; ++d) {
+                offsets[d] += offsets[d - 1];
+            }
+            size_t starts[257];
+            std::copy(offsets, offsets + 257, starts);
+            for (size_t i = 0; i < n; ++i) {
+                buffer[offsets[digit(keys[i])]++] = keys[i];
+            }
+            std::copy(buffer, buffer + n, keys);
+            for (size_t d = 1; d < 257; ++d) {
+                size_t size = offsets[d] - starts[d];
+                if (d != largest && size > 1) {
+                    refill(keys + starts[d], size);
+                    radix_sort(keys + starts[d], buffer, size, next_depth, next_byte);
+                }
+            }
+            keys += starts[largest];
+            n = offsets[largest] - starts[largest];
+        }
+        if (largest == 0) {
+            return;
+        }
+        refill(keys, n);
+        depth = next_depth;
+        byte = next_byte;
+    }
+    if (n > 1) {
+        // Quicksort compares whole windows, start one at the current byte
+        load_prefixes(keys, n, depth + byte);
+        multikey_quicksort(keys, n, depth + byte);
+    }
+}
+
+static void sort_keys(std::vector<StringKey>& keys)
+{
+    load_prefixes(keys.data(), keys.size(), 0);
+    if (keys.size() >= RADIX_MIN_SIZE) {
+        std::vector<StringKey> buffer(keys.size());
+        radix_sort(keys.data(), buffer.data(), keys.size(), 0, 0);
+    } else {
+        multikey_quicksort(keys.data(), keys.size(), 0);
+    }
+}
+
+void sort(std::vector<std::string>& data)
+{
+    std::vector<StringKey> keys(data.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+        keys[i] = {0, data[i].data(), static_cast<uint32_t>(data[i].size()), static_cast<uint32_t>(i)};
+    }
+    sort_keys(keys);
+    // Moving keeps every heap buffer where it is, only short strings are copied
+    std::vector<std::string> sorted;
+    sorted.reserve(data.size());
+    for (const StringKey& key : keys) {
+        sorted.push_back(std::move(data[key.index]));
+    }
+    data.swap(sorted);
+}
+
+void sort(std::vector<StringRef>& records, const char * arena)
+{
+    std::vector<StringKey> keys(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        keys[i] = {0, arena + records[i].offset, records[i].length, static_cast<uint32_t>(i)};
+    }
+    sort_keys(keys);
+    std::vector<StringRef> sorted(records.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        sorted[i] = records[keys[i].index];
+    }
+    records.swap(sorted);
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+// Single-Producer-Single-Consumer ring of variable-size records stored inline.
+//
+// Every record is an 8-byte header (payload length + kind) followed by the
+// payload, padded to 8 bytes. A record never wraps: if it does not fit before
+// the end of the ring, the producer fills the rest with a padding record and
+// starts over at offset 0, so the payload is always one contiguous range that
+// can be serialized into and parsed in place.
+//
+// The control block and data live in one position-independent region (no
+// pointers, only offsets), so the ring can be placed in shared memory and
+// used by a producer and a consumer in different processes. Cached copies of
+// the other side's index live in the per-process handle.
+class ByteQueue
+{
+public:
+    static constexpr size_t RECORD_ALIGN = 8;
+
+    // Private ring in process memory. Capacity in bytes is rounded up to a power of two
+    explicit ByteQueue(size_t capacity);
+    // Creates (or truncates) a shared memory object `name` and places a ring there
+    static ByteQueue create_shm(const std::string& name, size_t capacity);
+    // Attaches to a ring created by create_shm, possibly in another process
+    static ByteQueue open_shm(const std::string& name);
+
+    ByteQueue(ByteQueue&& other);
+    ByteQueue& operator=(ByteQueue&& other) = delete;
+    ByteQueue(const ByteQueue&) = delete;
+    ByteQueue& operator=(const ByteQueue&) = delete;
+    ~ByteQueue();
+
+    // Producer side. Returns a buffer of `size` bytes inside the ring to
+    // serialize the record into, or nullptr if there is not enough space yet.
+    // The record is published by commit(actual), actual <= size
+    void * reserve(size_t size);
+    void commit(size_t size);
+    // Copying convenience wrapper around reserve/commit
+    bool push(const void * data, size_t size);
+
+    // Consumer side. The oldest record stays valid until release()
+    struct Record {
+        const void * data;
+        size_t size;
+    };
+    // Record with data == nullptr if the queue is empty
+    Record peek();
+    void release();
+
+    size_t capacity() const { return mask_ + 1; }
+    // Largest payload that is guaranteed to fit
+    size_t max_record_size() const { return capacity() / 2 - sizeof(RecordHeader); }
+
+private:
+    static constexpr uint64_t MAGIC = 0x53505343'42595445;  // "SPSCBYTE"
+
+    struct RecordHeader {
+        enum Kind : uint32_t { DATA = 1, PADDING = 2 };
+        uint32_t size;
+        Kind kind;
+    };
+    static_assert(sizeof(RecordHeader) == RECORD_ALIGN, "Record header must keep payloads aligned");
+
+    // Beginning of the shared region, data follows on the next cache line
+    struct Control {
+        std::atomic<uint64_t> magic;
+        uint64_t capacity;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs address-free atomics");
+
+    static size_t round_up_pow2(size_t val);
+    static size_t record_size(size_t payload) {
+        return (sizeof(RecordHeader) + payload + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+    }
+    static void * map_shm(int fd, size_t size);
+
+    ByteQueue(Control * control, size_t mapped_size);
+
+    RecordHeader * header_at(uint64_t pos) {
+        return reinterpret_cast<RecordHeader*>(data_ + (pos & mask_));
+    }
+
+    Control * control_;
+    char * data_;
+    size_t mask_;
+    // Size of the mmap'ed region, 0 if the ring is on the heap
+    size_t mapped_size_;
+
+    // Producer-local state
+    uint64_t cached_head_;
+    // Start of the reserved record (after padding, if any) and its capacity
+    uint64_t reserved_pos_ = 0;
+    size_t reserved_size_ = 0;
+
+    // Consumer-local state
+    uint64_t cached_tail_;
+    // Position of the record returned by the last peek()
+    uint64_t peeked_pos_ = 0;
+};
+
+inline size_t ByteQueue::round_up_pow2(size_t val) {
+    size_t result = CACHE_LINE_SIZE;
+    while (result < val) {
+        result <<= 1;
+    }
+    return result;
+}
+
+inline ByteQueue::ByteQueue(Control * control, size_t mapped_size)
+    : control_(control)
+    , data_(reinterpret_cast<char*>(control) + sizeof(Control))
+    , mask_(control->capacity - 1)
+    , mapped_size_(mapped_size)
+    , cached_head_(control->head.load(std::memory_order_acquire))
+    , cached_tail_(control->tail.load(std::memory_order_acquire))
+{   }
+
+inline ByteQueue::ByteQueue(size_t capacity)
+    : ByteQueue(
+        new (::operator new(sizeof(Control) + round_up_pow2(capacity), std::align_val_t(CACHE_LINE_SIZE)))
+            Control{{MAGIC}, round_up_pow2(capacity), {0}, {0}},
+        0)
+{   }
+
+inline ByteQueue::ByteQueue(ByteQueue&& other)
+    : control_(std::exchange(other.control_, nullptr))
+    , data_(other.data_)
+    , mask_(other.mask_)
+    , mapped_size_(other.mapped_size_)
+    , cached_head_(other.cached_head_)
+    , reserved_pos_(other.reserved_pos_)
+    , reserved_size_(other.reserved_size_)
+    , cached_tail_(other.cached_tail_)
+    , peeked_pos_(other.peeked_pos_)
+{   }
+
+inline ByteQueue::~ByteQueue() {
+    if (control_ == nullptr) {
+        return;
+    }
+    if (mapped_size_ != 0) {
+        munmap(control_, mapped_size_);
+    } else {
+        control_->~Control();
+        ::operator delete(control_, std::align_val_t(CACHE_LINE_SIZE));
+    }
+}
+
+inline void * ByteQueue::map_shm(int fd, size_t size) {
+    void * addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error(std::string("mmap failed: ") + strerror(error));
+    }
+    return addr;
+}
+
+inline ByteQueue ByteQueue::create_shm(const std::string& name, size_t capacity) {
+    capacity = round_up_pow2(capacity);
+    size_t size = sizeof(Control) + capacity;
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("shm_open " + name + " failed: " + strerror(errno));
+    }
+    if (ftruncate(fd, size) != 0) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("ftruncate " + name + " failed: " + strerror(error));
+    }
+    auto control = new (map_shm(fd, size)) Control{{0}, capacity, {0}, {0}};
+    // Readers of the magic see a fully initialized control block
+    control->magic.store(MAGIC, std::memory_order_release);
+    return ByteQueue(control, size);
+}
+
+inline ByteQueue ByteQueue::open_shm(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        throw std::runtime_error("shm_open " + name + " failed: " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Control)) {
+        close(fd);
+        throw std::runtime_error("shared memory " + name + " is not a ByteQueue");
+    }
+    auto control = static_cast<Control*>(map_shm(fd, st.st_size));
+    if (control->magic.load(std::memory_order_acquire) != MAGIC
+            || sizeof(Control) + control->capacity != static_cast<size_t>(st.st_size)) {
+        munmap(control, st.st_size);
+        throw std::runtime_error("shared memory " + name + " is not a ByteQueue");
+    }
+    return ByteQueue(control, st.st_size);
+}
+
+inline void * ByteQueue::reserve(size_t size) {
+    assert(size <= max_record_size());
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    size_t total = record_size(size);
+    size_t to_end = capacity() - (tail & mask_);
+    // Records never wrap, the rest of the ring is skipped with a padding record
+    size_t needed = total <= to_end ? total : to_end + total;
+    // Written as used > free so a handle whose cached_head_ lags by more than
+    // a lap (it has not produced before) refreshes instead of underflowing
+    if (tail - cached_head_ > capacity() - needed) {
+        cached_head_ = control_->head.load(std::memory_order_acquire);
+        if (tail - cached_head_ > capacity() - needed) {
+            return nullptr;
+        }
+    }
+    if (total > to_end) {
+        *header_at(tail) = {static_cast<uint32_t>(to_end - sizeof(RecordHeader)), RecordHeader::PADDING};
+        tail += to_end;
+    }
+    reserved_pos_ = tail;
+    reserved_size_ = size;
+    return header_at(tail) + 1;
+}
+
+inline void ByteQueue::commit(size_t size) {
+    assert(size <= reserved_size_);
+    *header_at(reserved_pos_) = {static_cast<uint32_t>(size), RecordHeader::DATA};
+    control_->tail.store(reserved_pos_ + record_size(size), std::memory_order_release);
+}
+
+inline bool ByteQueue::push(const void * data, size_t size) {
+    void * buffer = reserve(size);
+    if (buffer == nullptr) {
+        return false;
+    }
+    memcpy(buffer, data, size);
+    commit(size);
+    return true;
+}
+
+inline ByteQueue::Record ByteQueue::peek() {
+    uint64_t head = control_->head.load(std::memory_order_relaxed);
+    while (true) {
+        // Signed difference: cached_tail_ may lag behind head in a handle
+        // that has not consumed before
+        if (static_cast<int64_t>(cached_tail_ - head) <= 0) {
+            cached_tail_ = control_->tail.load(std::memory_order_acquire);
+            if (cached_tail_ == head) {
+                return {nullptr, 0};
+            }
+        }
+        const RecordHeader * header = header_at(head);
+        if (header->kind == RecordHeader::DATA) {
+            peeked_pos_ = head;
+            return {header + 1, header->size};
+        }
+        // Padding is published together with the record after it
+        head += record_size(header->size);
+    }
+}
+
+inline void ByteQueue::release() {
+    control_->head.store(peeked_pos_ + record_size(header_at(peeked_pos_)->size), std::memory_order_release);
+}
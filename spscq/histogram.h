@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// HDR-style log-linear histogram of non-negative integer samples.
+// Values are grouped by their highest set bit, and each power-of-two range is
+// split into 2^SUB_BITS equal sub-buckets, so the relative error of any
+// reported value is below 2^-SUB_BITS regardless of magnitude.
+// Recording is a couple of bit operations and one increment, no allocation.
+class Histogram
+{
+public:
+    static constexpr int SUB_BITS = 7;
+    static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+
+    Histogram() : counts_((64 - SUB_BITS + 1) * SUB_COUNT, 0) {}
+
+    void record(uint64_t value) {
+        ++counts_[bucket(value)];
+        ++total_;
+        max_ = std::max(max_, value);
+    }
+
+    // Upper bound of the bucket containing the q-quantile, q in [0, 1]
+    uint64_t percentile(double q) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total_ + 0.5));
+        uint64_t seen = 0;
+        for (size_t idx = 0; idx < counts_.size(); ++idx) {
+            seen += counts_[idx];
+            if (seen >= rank) {
+                return std::min(max_, upper_bound(idx));
+            }
+        }
+        return max_;
+    }
+
+    uint64_t max() const { return max_; }
+    uint64_t count() const { return total_; }
+
+private:
+    // Values below SUB_COUNT get exact buckets, above that the magnitude
+    // selects a row of SUB_COUNT buckets indexed by the next SUB_BITS bits
+    static size_t bucket(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        int magnitude = 63 - __builtin_clzll(value);
+        int shift = magnitude - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT);
+    }
+
+    static uint64_t upper_bound(size_t idx) {
+        if (idx < SUB_COUNT) {
+            return idx;
+        }
+        int shift = idx / SUB_COUNT - 1;
+        uint64_t sub = idx % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+};
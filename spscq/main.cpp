@@ -3,18 +3,80 @@
 #include <cstdlib>
 #include <thread>
 #include <cassert>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <fstream>
+#include <string>
+#include <cstring>
+
+#include <immintrin.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <x86intrin.h>
 
 #include "queue.h"
+#include "mpmc_queue.h"
+#include "histogram.h"
+#include "byte_queue.h"
+#include "bench.h"
+
+// Baseline for the multi-producer queues
+template <typename T>
+struct MutexQueue
+{
+    bool push(T val) {
+        std::lock_guard guard(mtx_);
+        queue_.push_back(std::move(val));
+        return true;
+    }
+
+    std::optional<T> pop() {
+        std::lock_guard guard(mtx_);
+        if (queue_.empty()) {
+            return std::nullopt;
+        }
+        T val = std::move(queue_.front());
+        queue_.pop_front();
+        return val;
+    }
+
+private:
+    std::mutex mtx_;
+    std::deque<T> queue_;
+};
+
+// Spin for a while, then give the core away: the other side may be
+// scheduled on the same CPU and would never make progress otherwise
+inline void backoff(int& spins)
+{
+    if (++spins < 128) {
+        _mm_pause();
+    } else {
+        spins = 0;
+        std::this_thread::yield();
+    }
+}
 
 template <typename T>
 void validate(T& queue, int n)
 {
     auto producer = std::thread([&] {
+        int spins = 0;
         for (int i = 0; i < n; ++i) {
-            while (!queue.push(i));
+            while (!queue.push(i)) {
+                backoff(spins);
+            }
         }
     });
     auto consumer = std::thread([&] {
+        int spins = 0;
         for (int i = 0; i < n; ++i) {
             while (true) {
                 auto v = queue.pop();
@@ -22,6 +84,7 @@ void validate(T& queue, int n)
                     assert(*v == i);
                     break;
                 }
+                backoff(spins);
             }
         }
     });
@@ -30,37 +93,276 @@ void validate(T& queue, int n)
     consumer.join();
 }
 
+// Producer and consumer move values in batches of up to `batch` with push_bulk/pop_bulk
 template <typename T>
-long bench_single(T& queue, int n)
+void validate_bulk(T& queue, int n, int batch)
 {
-    auto start = std::chrono::high_resolution_clock::now();
-    validate(queue, n);
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-    return duration;
+    auto producer = std::thread([&] {
+        std::vector<int> buf(batch);
+        int spins = 0;
+        for (int i = 0; i < n; ) {
+            int count = std::min(batch, n - i);
+            for (int j = 0; j < count; ++j) {
+                buf[j] = i + j;
+            }
+            for (int sent = 0; sent < count; ) {
+                size_t pushed = queue.push_bulk(buf.data() + sent, count - sent);
+                if (pushed == 0) {
+                    backoff(spins);
+                }
+                sent += pushed;
+            }
+            i += count;
+        }
+    });
+    auto consumer = std::thread([&] {
+        std::vector<int> buf(batch);
+        int spins = 0;
+        for (int i = 0; i < n; ) {
+            size_t popped = queue.pop_bulk(buf.data(), std::min(batch, n - i));
+            if (popped == 0) {
+                backoff(spins);
+            }
+            for (size_t j = 0; j < popped; ++j, ++i) {
+                assert(buf[j] == i);
+            }
+        }
+    });
+
+    producer.join();
+    consumer.join();
 }
 
+// Same as validate_bulk, but values are written and read in place in the ring slots
 template <typename T>
-double bench_best(T& queue, int n)
+void validate_span(T& queue, int n, int batch)
+{
+    auto producer = std::thread([&] {
+        int spins = 0;
+        for (int i = 0; i < n; ) {
+            auto span = queue.reserve_write(std::min(batch, n - i));
+            if (span.size == 0) {
+                backoff(spins);
+            }
+            for (size_t j = 0; j < span.size; ++j, ++i) {
+                span.data[j] = i;
+            }
+            queue.commit_write(span.size);
+        }
+    });
+    auto consumer = std::thread([&] {
+        int spins = 0;
+        for (int i = 0; i < n; ) {
+            auto span = queue.peek_read(std::min(batch, n - i));
+            if (span.size == 0) {
+                backoff(spins);
+            }
+            for (size_t j = 0; j < span.size; ++j, ++i) {
+                assert(span.data[j] == i);
+            }
+            queue.release_read(span.size);
+        }
+    });
+
+    producer.join();
+    consumer.join();
+}
+
+// Same as validate, but both sides block with push_wait/pop_wait
+template <typename T>
+void validate_wait(T& queue, int n)
+{
+    auto producer = std::thread([&] {
+        for (int i = 0; i < n; ++i) {
+            queue.push_wait(i);
+        }
+    });
+    auto consumer = std::thread([&] {
+        for (int i = 0; i < n; ++i) {
+            int v = queue.pop_wait();
+            assert(v == i);
+        }
+    });
+
+    producer.join();
+    consumer.join();
+}
+
+// Each of `producers` threads pushes n values tagged with its id, `consumers`
+// threads drain the queue until they get a stop marker pushed after all
+// producers finished. Every consumer must see each producer's values in order
+template <typename T>
+void validate_many(T& queue, int producers, int consumers, int n)
+{
+    constexpr int ID_SHIFT = 24;
+    constexpr int STOP = -1;
+    assert(n < (1 << ID_SHIFT));
+    auto push = [&] (int v) {
+        int spins = 0;
+        while (!queue.push(v)) {
+            backoff(spins);
+        }
+    };
+
+    std::vector<std::thread> producer_threads;
+    for (int id = 0; id < producers; ++id) {
+        producer_threads.emplace_back([&, id] {
+            for (int i = 0; i < n; ++i) {
+                push((id << ID_SHIFT) | i);
+            }
+        });
+    }
+    std::atomic<long> received = 0;
+    std::vector<std::thread> consumer_threads;
+    for (int c = 0; c < consumers; ++c) {
+        consumer_threads.emplace_back([&] {
+            std::vector<int> last_seen(producers, -1);
+            long count = 0;
+            int spins = 0;
+            while (true) {
+                auto v = queue.pop();
+                if (!v.has_value()) {
+                    backoff(spins);
+                    continue;
+                }
+                if (*v == STOP) {
+                    break;
+                }
+                int id = *v >> ID_SHIFT;
+                int i = *v & ((1 << ID_SHIFT) - 1);
+                assert(id < producers && i > last_seen[id]);
+                last_seen[id] = i;
+                ++count;
+            }
+            received.fetch_add(count, std::memory_order_relaxed);
+        });
+    }
+
+    for (auto& thread : producer_threads) {
+        thread.join();
+    }
+    for (int c = 0; c < consumers; ++c) {
+        push(STOP);
+    }
+    for (auto& thread : consumer_threads) {
+        thread.join();
+    }
+    assert(received.load() == long(producers) * n);
+}
+
+// Payload of record i: its size varies from 16 bytes to 4KB
+size_t record_payload_size(int i)
+{
+    return 16 + (i * 7919L) % (4096 - 16 + 1);
+}
+
+void produce_records(ByteQueue& queue, int n)
+{
+    int spins = 0;
+    for (int i = 0; i < n; ++i) {
+        size_t size = record_payload_size(i);
+        unsigned char * buffer = nullptr;
+        while (!(buffer = static_cast<unsigned char*>(queue.reserve(size)))) {
+            backoff(spins);
+        }
+        for (size_t j = 0; j < size; ++j) {
+            buffer[j] = i + j;
+        }
+        queue.commit(size);
+    }
+}
+
+void consume_records(ByteQueue& queue, int n)
+{
+    int spins = 0;
+    for (int i = 0; i < n; ++i) {
+        ByteQueue::Record record;
+        while (!(record = queue.peek()).data) {
+            backoff(spins);
+        }
+        assert(record.size == record_payload_size(i));
+        auto data = static_cast<const unsigned char*>(record.data);
+        for (size_t j = 0; j < record.size; ++j) {
+            assert(data[j] == static_cast<unsigned char>(i + j));
+        }
+        queue.release();
+    }
+}
+
+void validate_bytes(ByteQueue& queue, int n)
+{
+    auto producer = std::thread([&] { produce_records(queue, n); });
+    auto consumer = std::thread([&] { consume_records(queue, n); });
+    producer.join();
+    consumer.join();
+}
+
+// Producer is a forked child attached to the ring by name
+void validate_bytes_shm(int n)
 {
-    auto best = bench_single(queue, n);
-    for (int i = 0; i < 10; ++i) {
-        best = std::min(best, bench_single(queue, n));
+    std::string name = "/spscq_test_" + std::to_string(getpid());
+    auto queue = ByteQueue::create_shm(name, 1 << 14);
+    pid_t child = fork();
+    if (child == 0) {
+        auto producer_queue = ByteQueue::open_shm(name);
+        produce_records(producer_queue, n);
+        _exit(0);
     }
-    return double(best);
+    consume_records(queue, n);
+    int status = 0;
+    waitpid(child, &status, 0);
+    shm_unlink(name.c_str());
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+long now_ns()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+double cpu_time_ns(const rusage& usage)
+{
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
 }
 
 void test_correctness()
 {
     SPSCQueue<int> q;
     validate(q, 10000);
+    for (int batch : {1, 3, 64, 1000}) {
+        SPSCQueue<int> small(256);
+        validate(small, 10000);
+        validate_bulk(small, 10000, batch);
+        validate_span(small, 10000, batch);
+    }
+    for (int producers : {1, 2, 4}) {
+        MPSCQueue<int> mpsc(256);
+        validate_many(mpsc, producers, 1, 10000);
+        for (int consumers : {1, 2, 4}) {
+            MPMCQueue<int> mpmc(256);
+            validate_many(mpmc, producers, consumers, 10000);
+        }
+    }
+    for (size_t capacity : {1 << 14, 1 << 16}) {
+        ByteQueue bytes(capacity);
+        validate_bytes(bytes, 10000);
+    }
+    validate_bytes_shm(10000);
+    SPSCQueue<int, SpinWait> spin(256);
+    validate_wait(spin, 10000);
+    SPSCQueue<int, FutexWait> futex(256);
+    validate_wait(futex, 100000);
+    SPSCQueue<int, EventfdWait> event(256);
+    validate_wait(event, 100000);
     std::cout << "test_correctness PASSED" << std::endl;
 }
 
 void test_performance(int n)
 {
     SPSCQueue<int> q;
-    double r = bench_best(q, n);
+    double r = benchmark::measure("SPSCQueue", {{"n", n}}, [&] { validate(q, n); }).min;
     double throughput = n*sizeof(int)/r * (1000000000./(1<<30));
     std::cout << "Pushed " << n << " values. Throughput: " << throughput << "GB/s" << std::endl;
     assert(throughput > 0.1);
@@ -74,8 +376,309 @@ void test_performance()
     std::cout << "test_performance PASSED" << std::endl;
 }
 
-int main()
+void test_performance_batch(int n, int batch)
+{
+    SPSCQueue<int> q;
+    double bulk = benchmark::measure("SPSCQueue bulk", {{"n", n}, {"batch", batch}}, [&] { validate_bulk(q, n, batch); }).min;
+    double span = benchmark::measure("SPSCQueue zero-copy", {{"n", n}, {"batch", batch}}, [&] { validate_span(q, n, batch); }).min;
+    double bulk_throughput = n*sizeof(int)/bulk * (1000000000./(1<<30));
+    double span_throughput = n*sizeof(int)/span * (1000000000./(1<<30));
+    std::cout << "Pushed " << n << " values in batches of " << batch << ".";
+    std::cout << " Bulk throughput: " << bulk_throughput << "GB/s.";
+    std::cout << " Zero-copy throughput: " << span_throughput << "GB/s" << std::endl;
+    assert(bulk_throughput > 0.1);
+    assert(span_throughput > 0.1);
+}
+
+void test_performance_batch()
+{
+    for (int batch = 1; batch <= 1024; batch *= 4) {
+        test_performance_batch(1<<21, batch);
+    }
+    std::cout << "test_performance_batch PASSED" << std::endl;
+}
+
+void test_performance_many(int producers, int consumers, int n)
+{
+    auto throughput = [&] (double r) {
+        return long(producers)*n*sizeof(int)/r * (1000000000./(1<<30));
+    };
+    MutexQueue<int> mutex_queue;
+    benchmark::Params params = {{"producers", producers}, {"consumers", consumers}, {"n", n}};
+    double basic = throughput(benchmark::measure("MutexQueue", params, [&] { validate_many(mutex_queue, producers, consumers, n); }).min);
+    MPMCQueue<int> mpmc;
+    double good = throughput(benchmark::measure("MPMCQueue", params, [&] { validate_many(mpmc, producers, consumers, n); }).min);
+    std::cout << producers << " producers, " << consumers << " consumers.";
+    std::cout << " Mutex+deque " << basic << "GB/s.";
+    if (consumers == 1) {
+        MPSCQueue<int> mpsc;
+        double mpsc_throughput = throughput(benchmark::measure("MPSCQueue", params, [&] { validate_many(mpsc, producers, consumers, n); }).min);
+        std::cout << " MPSC " << mpsc_throughput << "GB/s.";
+        assert(mpsc_throughput > 0.01);
+    }
+    std::cout << " MPMC " << good << "GB/s" << std::endl;
+    assert(good > 0.01);
+}
+
+void test_performance_many()
+{
+    for (int producers : {1, 2, 4}) {
+        for (int consumers : {1, 2, 4}) {
+            test_performance_many(producers, consumers, (1<<20) / producers);
+        }
+    }
+    std::cout << "test_performance_many PASSED" << std::endl;
+}
+
+// Messages of fixed `size` serialized in place, the consumer checks the sequence number
+void transfer_messages(ByteQueue& producer_queue, ByteQueue& consumer_queue, int n, size_t size, bool fork_producer)
+{
+    auto produce = [&] {
+        std::vector<char> message(size, 'x');
+        int spins = 0;
+        for (long i = 0; i < n; ++i) {
+            char * buffer = nullptr;
+            while (!(buffer = static_cast<char*>(producer_queue.reserve(size)))) {
+                backoff(spins);
+            }
+            memcpy(buffer, message.data(), size);
+            memcpy(buffer, &i, sizeof(i));
+            producer_queue.commit(size);
+        }
+    };
+    auto consume = [&] {
+        int spins = 0;
+        for (long i = 0; i < n; ++i) {
+            ByteQueue::Record record;
+            while (!(record = consumer_queue.peek()).data) {
+                backoff(spins);
+            }
+            assert(*static_cast<const long*>(record.data) == i);
+            consumer_queue.release();
+        }
+    };
+    if (fork_producer) {
+        pid_t child = fork();
+        if (child == 0) {
+            produce();
+            _exit(0);
+        }
+        consume();
+        waitpid(child, nullptr, 0);
+    } else {
+        auto producer = std::thread(produce);
+        auto consumer = std::thread(consume);
+        producer.join();
+        consumer.join();
+    }
+}
+
+void test_performance_bytes(size_t size)
+{
+    int n = (1 << 30) / size / 8;
+    auto throughput = [&] (double r) {
+        return n*size/r * (1000000000./(1<<30));
+    };
+    ByteQueue local(1 << 20);
+    double in_process = throughput(benchmark::measure("ByteQueue threads", {{"n", n}, {"size", size}}, [&] {
+        transfer_messages(local, local, n, size, false);
+    }).min);
+
+    std::string name = "/spscq_bench_" + std::to_string(getpid());
+    auto shared = ByteQueue::create_shm(name, 1 << 20);
+    double cross_process = throughput(benchmark::measure("ByteQueue processes", {{"n", n}, {"size", size}}, [&] {
+        // Both processes map the same pages, the forked producer uses the parent's mapping
+        transfer_messages(shared, shared, n, size, true);
+    }).min);
+    shm_unlink(name.c_str());
+
+    std::cout << "Transferred " << n << " messages of " << size << " bytes.";
+    std::cout << " Threads: " << in_process << "GB/s.";
+    std::cout << " Processes over shared memory: " << cross_process << "GB/s" << std::endl;
+    assert(in_process > 0.1);
+    assert(cross_process > 0.1);
+}
+
+void test_performance_bytes()
+{
+    for (size_t size : {16, 256, 4096}) {
+        test_performance_bytes(size);
+    }
+    std::cout << "test_performance_bytes PASSED" << std::endl;
+}
+
+// Producer sends its clock every `gap`, consumer blocks in pop_wait and
+// records how long each message took to arrive, so every message pays the
+// wake-up cost of the wait strategy
+template <typename Wait>
+void test_latency(const char* name, int n, std::chrono::microseconds gap)
+{
+    SPSCQueue<long, Wait> q;
+    std::vector<long> latencies(n);
+    rusage producer_usage, consumer_usage;
+
+    long start = now_ns();
+    auto producer = std::thread([&] {
+        for (int i = 0; i < n; ++i) {
+            std::this_thread::sleep_for(gap);
+            q.push_wait(now_ns());
+        }
+        getrusage(RUSAGE_THREAD, &producer_usage);
+    });
+    auto consumer = std::thread([&] {
+        for (int i = 0; i < n; ++i) {
+            long sent = q.pop_wait();
+            latencies[i] = now_ns() - sent;
+        }
+        getrusage(RUSAGE_THREAD, &consumer_usage);
+    });
+    producer.join();
+    consumer.join();
+    double wall = now_ns() - start;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&] (double p) {
+        return latencies[std::min<size_t>(n - 1, p * n)];
+    };
+    std::cout << name << ": latency p50 " << percentile(0.5) << "ns";
+    std::cout << " p99 " << percentile(0.99) << "ns";
+    std::cout << " p99.9 " << percentile(0.999) << "ns";
+    std::cout << " max " << latencies.back() << "ns.";
+    std::cout << " CPU usage: producer " << 100 * cpu_time_ns(producer_usage) / wall << "%";
+    std::cout << " consumer " << 100 * cpu_time_ns(consumer_usage) / wall << "%" << std::endl;
+}
+
+void test_latency()
+{
+    constexpr int n = 10000;
+    constexpr auto gap = std::chrono::microseconds(50);
+    test_latency<SpinWait>("SpinWait", n, gap);
+    test_latency<FutexWait>("FutexWait", n, gap);
+    test_latency<EventfdWait>("EventfdWait", n, gap);
+    std::cout << "test_latency PASSED" << std::endl;
+}
+
+// Ticks of the time stamp counter per nanosecond, measured against steady_clock
+double calibrate_tsc()
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_tsc = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto end = std::chrono::steady_clock::now();
+    uint64_t end_tsc = __rdtsc();
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    return double(end_tsc - start_tsc) / duration;
+}
+
+// -1 if the topology attribute is unavailable
+int cpu_topology(int cpu, const std::string& attribute)
+{
+    std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + attribute);
+    int value = -1;
+    file >> value;
+    return value;
+}
+
+// Finds a pair of CPUs the thread is allowed to run on, such that they are
+// SMT siblings of one core, different cores of one socket or different sockets
+bool find_cpu_pair(const std::string& placement, int& first, int& second)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+    for (first = 0; first < CPU_SETSIZE; ++first) {
+        for (second = first + 1; second < CPU_SETSIZE; ++second) {
+            if (!CPU_ISSET(first, &allowed) || !CPU_ISSET(second, &allowed)) {
+                continue;
+            }
+            bool same_socket = cpu_topology(first, "physical_package_id") == cpu_topology(second, "physical_package_id");
+            bool same_core = same_socket && cpu_topology(first, "core_id") == cpu_topology(second, "core_id");
+            if ((placement == "same core" && same_core)
+                    || (placement == "same socket" && same_socket && !same_core)
+                    || (placement == "cross socket" && !same_socket)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Initiator sends its time stamp through `ping`, responder echoes it back
+// through `pong`. Records round-trip times in ns
+void ping_pong(Histogram& histogram, int n, double ticks_per_ns, int initiator_cpu, int responder_cpu)
+{
+    SPSCQueue<uint64_t> ping(64);
+    SPSCQueue<uint64_t> pong(64);
+    auto responder = std::thread([&] {
+        benchmark::pin_to_cpu(responder_cpu);
+        int spins = 0;
+        for (int i = 0; i < n; ++i) {
+            std::optional<uint64_t> v;
+            while (!(v = ping.pop())) {
+                backoff(spins);
+            }
+            pong.push(*v);
+        }
+    });
+    auto initiator = std::thread([&] {
+        benchmark::pin_to_cpu(initiator_cpu);
+        int spins = 0;
+        for (int i = 0; i < n; ++i) {
+            ping.push(__rdtsc());
+            std::optional<uint64_t> v;
+            while (!(v = pong.pop())) {
+                backoff(spins);
+            }
+            histogram.record((__rdtsc() - *v) / ticks_per_ns);
+        }
+    });
+    initiator.join();
+    responder.join();
+}
+
+void test_round_trip(const std::string& placement, double ticks_per_ns)
+{
+    int first = -1, second = -1;
+    if (placement != "unpinned" && !find_cpu_pair(placement, first, second)) {
+        std::cout << "Round trip " << placement << ": no suitable CPU pair, skipped" << std::endl;
+        return;
+    }
+    Histogram histogram;
+    ping_pong(histogram, 100000, ticks_per_ns, first, second);
+    std::cout << "Round trip " << placement;
+    if (first >= 0) {
+        std::cout << " (CPU " << first << " <-> CPU " << second << ")";
+    }
+    std::cout << ": p50 " << histogram.percentile(0.5) << "ns";
+    std::cout << " p99 " << histogram.percentile(0.99) << "ns";
+    std::cout << " p99.9 " << histogram.percentile(0.999) << "ns";
+    std::cout << " max " << histogram.max() << "ns" << std::endl;
+    assert(histogram.count() == 100000);
+}
+
+void test_round_trip()
+{
+    double ticks_per_ns = calibrate_tsc();
+    std::cout << "TSC frequency: " << ticks_per_ns << " GHz" << std::endl;
+    for (const char* placement : {"unpinned", "same core", "same socket", "cross socket"}) {
+        test_round_trip(placement, ticks_per_ns);
+    }
+    std::cout << "test_round_trip PASSED" << std::endl;
+}
+
+int main(int argc, char** argv)
 {
+    // Producers and consumers need cores of their own
+    benchmark::Config config;
+    config.cpu = benchmark::CPU_ANY;
+    benchmark::init(argc, argv, config);
     test_correctness();
     test_performance();
+    test_performance_batch();
+    test_performance_many();
+    test_performance_bytes();
+    test_latency();
+    test_round_trip();
 }
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "queue.h"
+
+// Bounded array queue with per-slot sequence numbers (D. Vyukov).
+// Each cell carries a sequence number telling whose turn it is:
+//   seq == pos                  - free, the producer that claims pos may write
+//   seq == pos + 1              - full, the consumer that claims pos may read
+//   seq == pos + capacity       - freed, becomes free for the next lap
+// Producers claim positions with a CAS on tail_. With MULTI_CONSUMER
+// consumers do the same on head_, otherwise the single consumer owns head_
+// and pops without any RMW.
+template <typename T, bool MULTI_CONSUMER>
+class SequencedQueue
+{
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+    // Capacity is rounded up to the nearest power of two
+    explicit SequencedQueue(size_t capacity = DEFAULT_CAPACITY);
+    ~SequencedQueue();
+
+    SequencedQueue(const SequencedQueue&) = delete;
+    SequencedQueue& operator=(const SequencedQueue&) = delete;
+
+    // Any thread. False if the queue is full
+    bool push(T val);
+    // Any thread if MULTI_CONSUMER, otherwise the single consumer only.
+    // Empty optional if the queue is empty
+    std::optional<T> pop();
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T * value() { return reinterpret_cast<T*>(storage); }
+    };
+
+    // Immutable after construction
+    Cell * cells_;
+    size_t mask_;
+
+    // Next position to claim for writing
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_ = 0;
+    // Next position to claim for reading
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_ = 0;
+};
+
+template <typename T>
+using MPMCQueue = SequencedQueue<T, true>;
+
+template <typename T>
+using MPSCQueue = SequencedQueue<T, false>;
+
+template <typename T, bool MULTI_CONSUMER>
+SequencedQueue<T, MULTI_CONSUMER>::SequencedQueue(size_t capacity)
+    : cells_(nullptr)
+    , mask_(1)
+{
+    while (mask_ + 1 < capacity) {
+        mask_ = (mask_ << 1) | 1;
+    }
+    cells_ = static_cast<Cell*>(::operator new((mask_ + 1) * sizeof(Cell), std::align_val_t(CACHE_LINE_SIZE)));
+    for (size_t pos = 0; pos <= mask_; ++pos) {
+        new (&cells_[pos].seq) std::atomic<size_t>(pos);
+    }
+}
+
+template <typename T, bool MULTI_CONSUMER>
+SequencedQueue<T, MULTI_CONSUMER>::~SequencedQueue() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    for (; head != tail; ++head) {
+        cells_[head & mask_].value()->~T();
+    }
+    ::operator delete(cells_, std::align_val_t(CACHE_LINE_SIZE));
+}
+
+template <typename T, bool MULTI_CONSUMER>
+bool SequencedQueue<T, MULTI_CONSUMER>::push(T val) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell * cell = nullptr;
+    while (true) {
+        cell = cells_ + (pos & mask_);
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            // On failure pos is reloaded with the current tail
+            if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The cell of the previous lap is not consumed yet
+            return false;
+        } else {
+            pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+    new (cell->value()) T(std::move(val));
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, bool MULTI_CONSUMER>
+std::optional<T> SequencedQueue<T, MULTI_CONSUMER>::pop() {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    Cell * cell = nullptr;
+    while (true) {
+        cell = cells_ + (pos & mask_);
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+        if (diff < 0) {
+            return std::nullopt;
+        }
+        if constexpr (MULTI_CONSUMER) {
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        } else {
+            // Nobody else moves head_, so the cell can only be ready
+            head_.store(pos + 1, std::memory_order_relaxed);
+            break;
+        }
+    }
+    std::optional<T> val(std::move(*cell->value()));
+    cell->value()->~T();
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return val;
+}
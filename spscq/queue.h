@@ -1,59 +1,262 @@
-#include <thread>
+#pragma once
+
+#include <algorithm>
 #include <atomic>
-#include <mutex>
-#include <deque>
 #include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
 #include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "wait.h"
+
+constexpr size_t CACHE_LINE_SIZE = 64;
 
-class Spinlock {
+// Bounded lock-free Single-Producer-Single-Consumer ring buffer.
+// Storage is allocated once in the constructor, push/pop never allocate.
+// Wait is the strategy used by the blocking push_wait/pop_wait (see wait.h)
+template <typename T, typename Wait = SpinWait>
+class SPSCQueue
+{
 public:
-    void lock() {
-        while (locked.test_and_set(std::memory_order_acq_rel)) {
-            std::this_thread::yield();
-        }
-    }
+    static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
 
-    void unlock() {
-        locked.clear(std::memory_order_release);
-    }
+    // Capacity is rounded up to the nearest power of two
+    explicit SPSCQueue(size_t capacity = DEFAULT_CAPACITY);
+    ~SPSCQueue();
+
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+    // Producer side. False if the queue is full
+    bool push(T val);
+    // Consumer side. Empty optional if the queue is empty
+    std::optional<T> pop();
+
+    // Blocking variants: sleep according to Wait until there is room (a value)
+    void push_wait(T val);
+    T pop_wait();
+
+    // Batched variants: the index is published once per call.
+    // Return the number of elements actually transferred (may be less than asked)
+    size_t push_bulk(const T * vals, size_t n);
+    size_t pop_bulk(T * out, size_t max);
+
+    // Contiguous run of ring slots
+    struct Span {
+        T * data;
+        size_t size;
+    };
+
+    // Zero-copy producer side: up to n contiguous free slots to be filled in
+    // place, then published with commit_write(k), k <= span.size.
+    // The span is shorter than n when the queue is nearly full or the run
+    // reaches the end of the ring
+    Span reserve_write(size_t n);
+    void commit_write(size_t n);
+
+    // Zero-copy consumer side: up to n contiguous ready slots, handed back to
+    // the producer with release_read(k), k <= span.size
+    Span peek_read(size_t n);
+    void release_read(size_t n);
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Signalled on every publish by producer (consumer)
+    Wait& not_empty() { return not_empty_; }
+    Wait& not_full() { return not_full_; }
 
 private:
-    std::atomic_flag locked = ATOMIC_FLAG_INIT;
+    static size_t round_up_pow2(size_t val);
+
+    // Number of free slots as seen by producer, refreshes cached_head_ if less than wanted
+    size_t writable(size_t tail, size_t wanted);
+    // Number of ready slots as seen by consumer, refreshes cached_tail_ if less than wanted
+    size_t readable(size_t head, size_t wanted);
+
+    // Immutable after construction, shared by both sides
+    T * buffer_;
+    size_t mask_;
+
+    // Indices grow monotonically and are wrapped with mask_ on access.
+    // Each side owns one cache line: its own index plus a cached copy of
+    // the other side's index, so the shared atomic is only re-read when
+    // the cached value says the queue looks full (empty).
+
+    // Next slot to read. Written by consumer only
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_ = 0;
+    // Consumer's last observed value of tail_
+    size_t cached_tail_ = 0;
+
+    // Next slot to write. Written by producer only
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_ = 0;
+    // Producer's last observed value of head_
+    size_t cached_head_ = 0;
+
+    // Consumer sleeps here, producer notifies
+    alignas(CACHE_LINE_SIZE) Wait not_empty_;
+    // Producer sleeps here, consumer notifies
+    alignas(CACHE_LINE_SIZE) Wait not_full_;
 };
 
+static_assert(sizeof(SPSCQueue<int>) == 5 * CACHE_LINE_SIZE, "SPSCQueue lines are not isolated");
 
-template <typename T>
-class SPSCQueue
+template <typename T, typename Wait>
+size_t SPSCQueue<T, Wait>::round_up_pow2(size_t val) {
+    size_t result = 1;
+    while (result < val) {
+        result <<= 1;
+    }
+    return result;
+}
+
+template <typename T, typename Wait>
+SPSCQueue<T, Wait>::SPSCQueue(size_t capacity)
+    : buffer_(nullptr)
+    , mask_(round_up_pow2(capacity < 2 ? 2 : capacity) - 1)
 {
-public:
-    SPSCQueue() {}
-
-    bool push(T val) {
-        std::lock_guard guard(for_produce_mtx_);
-        for_produce_.push_back(std::move(val));
-        return true;
-    }
-
-    std::optional<T> pop() {
-        if (for_consume_.empty()) {
-            std::lock_guard guard(for_produce_mtx_);
-            // Constant work here
-            if (!for_produce_.empty()) {
-                std::swap(for_produce_, for_consume_);
-            }
-        }
-        if (for_consume_.empty()) {
-            return std::nullopt;
-        }
-        T val = std::move(for_consume_.front());
-        for_consume_.pop_front();
-        return val;
+    buffer_ = static_cast<T*>(::operator new((mask_ + 1) * sizeof(T), std::align_val_t(CACHE_LINE_SIZE)));
+}
+
+template <typename T, typename Wait>
+SPSCQueue<T, Wait>::~SPSCQueue() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    for (; head != tail; ++head) {
+        buffer_[head & mask_].~T();
     }
+    ::operator delete(buffer_, std::align_val_t(CACHE_LINE_SIZE));
+}
 
-private:
-    // Used only by consumer
-    std::deque<T> for_consume_;
-    // Used by both producer and consumer : consumer steales values from here
-    std::deque<T> for_produce_;
-    Spinlock for_produce_mtx_;
-};
+template <typename T, typename Wait>
+bool SPSCQueue<T, Wait>::push(T val) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (writable(tail, 1) == 0) {
+        return false;
+    }
+    new (buffer_ + (tail & mask_)) T(std::move(val));
+    tail_.store(tail + 1, std::memory_order_release);
+    not_empty_.notify();
+    return true;
+}
+
+template <typename T, typename Wait>
+void SPSCQueue<T, Wait>::push_wait(T val) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    not_full_.wait([&] { return writable(tail, 1) != 0; });
+    push(std::move(val));
+}
+
+template <typename T, typename Wait>
+std::optional<T> SPSCQueue<T, Wait>::pop() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (readable(head, 1) == 0) {
+        return std::nullopt;
+    }
+    T * slot = buffer_ + (head & mask_);
+    std::optional<T> val(std::move(*slot));
+    slot->~T();
+    head_.store(head + 1, std::memory_order_release);
+    not_full_.notify();
+    return val;
+}
+
+template <typename T, typename Wait>
+T SPSCQueue<T, Wait>::pop_wait() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    not_empty_.wait([&] { return readable(head, 1) != 0; });
+    return std::move(*pop());
+}
+
+template <typename T, typename Wait>
+size_t SPSCQueue<T, Wait>::writable(size_t tail, size_t wanted) {
+    size_t free = capacity() - (tail - cached_head_);
+    if (free < wanted) {
+        cached_head_ = head_.load(std::memory_order_acquire);
+        free = capacity() - (tail - cached_head_);
+    }
+    return free;
+}
+
+template <typename T, typename Wait>
+size_t SPSCQueue<T, Wait>::readable(size_t head, size_t wanted) {
+    size_t ready = cached_tail_ - head;
+    if (ready < wanted) {
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        ready = cached_tail_ - head;
+    }
+    return ready;
+}
+
+template <typename T, typename Wait>
+size_t SPSCQueue<T, Wait>::push_bulk(const T * vals, size_t n) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    n = std::min(n, writable(tail, n));
+    if (n == 0) {
+        return 0;
+    }
+    size_t pos = tail & mask_;
+    // The batch may wrap around the end of the ring
+    size_t first = std::min(n, capacity() - pos);
+    std::uninitialized_copy_n(vals, first, buffer_ + pos);
+    std::uninitialized_copy_n(vals + first, n - first, buffer_);
+    tail_.store(tail + n, std::memory_order_release);
+    not_empty_.notify();
+    return n;
+}
+
+template <typename T, typename Wait>
+size_t SPSCQueue<T, Wait>::pop_bulk(T * out, size_t max) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t n = std::min(max, readable(head, max));
+    if (n == 0) {
+        return 0;
+    }
+    size_t pos = head & mask_;
+    size_t first = std::min(n, capacity() - pos);
+    std::move(buffer_ + pos, buffer_ + pos + first, out);
+    std::move(buffer_, buffer_ + (n - first), out + first);
+    std::destroy(buffer_ + pos, buffer_ + pos + first);
+    std::destroy(buffer_, buffer_ + (n - first));
+    head_.store(head + n, std::memory_order_release);
+    not_full_.notify();
+    return n;
+}
+
+template <typename T, typename Wait>
+typename SPSCQueue<T, Wait>::Span SPSCQueue<T, Wait>::reserve_write(size_t n) {
+    static_assert(std::is_trivially_copyable_v<T>, "Zero-copy access requires trivially copyable T");
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t pos = tail & mask_;
+    n = std::min(n, capacity() - pos);
+    n = std::min(n, writable(tail, n));
+    return {buffer_ + pos, n};
+}
+
+template <typename T, typename Wait>
+void SPSCQueue<T, Wait>::commit_write(size_t n) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    assert(tail + n - cached_head_ <= capacity());
+    tail_.store(tail + n, std::memory_order_release);
+    not_empty_.notify();
+}
+
+template <typename T, typename Wait>
+typename SPSCQueue<T, Wait>::Span SPSCQueue<T, Wait>::peek_read(size_t n) {
+    static_assert(std::is_trivially_copyable_v<T>, "Zero-copy access requires trivially copyable T");
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t pos = head & mask_;
+    n = std::min(n, capacity() - pos);
+    n = std::min(n, readable(head, n));
+    return {buffer_ + pos, n};
+}
+
+template <typename T, typename Wait>
+void SPSCQueue<T, Wait>::release_read(size_t n) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    assert(head + n <= cached_tail_);
+    head_.store(head + n, std::memory_order_release);
+    not_full_.notify();
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+
+#include <immintrin.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Wait strategies for the blocking SPSCQueue calls.
+//
+// A strategy is a condition one side sleeps on and the other side signals:
+//   template <typename Pred> void wait(Pred ready) - returns once ready() is true
+//   void notify()                                  - called after every publish
+// notify() is on the hot path of every push/pop, so it must be cheap when
+// nobody is sleeping: blocking strategies only make a syscall if the waiting
+// side announced itself in sleepers_.
+
+// Busy wait on the other side's index. Lowest latency, burns a full core
+struct SpinWait {
+    template <typename Pred>
+    void wait(Pred ready) {
+        while (!ready()) {
+            _mm_pause();
+        }
+    }
+
+    void notify() {}
+};
+
+// Spin for a bounded number of iterations, then sleep on a futex
+class FutexWait {
+public:
+    static constexpr int SPIN_COUNT = 1 << 8;
+
+    template <typename Pred>
+    void wait(Pred ready) {
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            if (ready()) {
+                return;
+            }
+            _mm_pause();
+        }
+        while (true) {
+            uint32_t seq = seq_.load(std::memory_order_acquire);
+            sleepers_.fetch_add(1, std::memory_order_seq_cst);
+            // Re-check after announcing ourselves: a publish that happened before
+            // the announcement is visible here, a later one will see sleepers_ > 0
+            if (ready()) {
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            futex(FUTEX_WAIT_PRIVATE, seq);
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            if (ready()) {
+                return;
+            }
+        }
+    }
+
+    void notify() {
+        // Orders the preceding index publish before reading sleepers_
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) != 0) {
+            seq_.fetch_add(1, std::memory_order_release);
+            futex(FUTEX_WAKE_PRIVATE, 1);
+        }
+    }
+
+private:
+    long futex(int op, uint32_t val) {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq_), op, val, nullptr, nullptr, 0);
+    }
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be 32 bit");
+
+    // Futex word, bumped on every wake so a sleeper never misses one
+    std::atomic<uint32_t> seq_ = 0;
+    // Number of threads that are about to sleep or sleeping
+    std::atomic<uint32_t> sleepers_ = 0;
+};
+
+// Spin for a bounded number of iterations, then block on an eventfd.
+// fd() becomes readable whenever the condition may have changed, so the
+// waiting side can multiplex the queue with other descriptors in epoll
+class EventfdWait {
+public:
+    static constexpr int SPIN_COUNT = 1 << 8;
+
+    EventfdWait() : fd_(eventfd(0, EFD_CLOEXEC)) {
+        if (fd_ < 0) {
+            throw std::runtime_error("eventfd failed");
+        }
+    }
+
+    ~EventfdWait() {
+        close(fd_);
+    }
+
+    EventfdWait(const EventfdWait&) = delete;
+    EventfdWait& operator=(const EventfdWait&) = delete;
+
+    int fd() const { return fd_; }
+
+    // For epoll users: announce that the caller is going to wait on fd().
+    // Must be paired with disarm() once woken, and ready() re-checked after arm()
+    void arm() {
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    void disarm() {
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        uint64_t count;
+        // Consume the pending wake-up so it does not leak into the next wait
+        if (signalled_.exchange(false, std::memory_order_acquire)) {
+            while (read(fd_, &count, sizeof(count)) < 0 && errno == EINTR);
+        }
+    }
+
+    template <typename Pred>
+    void wait(Pred ready) {
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            if (ready()) {
+                return;
+            }
+            _mm_pause();
+        }
+        while (true) {
+            arm();
+            if (ready()) {
+                disarm();
+                return;
+            }
+            uint64_t count;
+            while (read(fd_, &count, sizeof(count)) < 0 && errno == EINTR);
+            // Acquire pairs with notifiers that found the flag already set
+            signalled_.exchange(false, std::memory_order_acq_rel);
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            if (ready()) {
+                return;
+            }
+        }
+    }
+
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) != 0
+                && !signalled_.exchange(true, std::memory_order_acq_rel)) {
+            uint64_t one = 1;
+            while (write(fd_, &one, sizeof(one)) < 0 && errno == EINTR);
+        }
+    }
+
+private:
+    int fd_;
+    // Number of threads that are about to sleep or sleeping
+    std::atomic<uint32_t> sleepers_ = 0;
+    // True while a wake-up is pending in the eventfd counter
+    std::atomic<bool> signalled_ = false;
+};